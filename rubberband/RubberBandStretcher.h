@@ -26,7 +26,7 @@
     
 #define RUBBERBAND_VERSION "1.8.1"
 #define RUBBERBAND_API_MAJOR_VERSION 2
-#define RUBBERBAND_API_MINOR_VERSION 5
+#define RUBBERBAND_API_MINOR_VERSION 6
 
 #include <vector>
 #include <map>
@@ -51,10 +51,25 @@
  * So you can run process() in its own thread if you like, but if you
  * want to change ratios dynamically from a different thread, you will
  * need some form of mutex in your code.  Changing the time or pitch
- * ratio is real-time safe except in extreme circumstances, so for
- * most applications that may change these dynamically it probably
- * makes most sense to do so from the same thread as calls process(),
- * even if that is a real-time thread.
+ * ratio is real-time safe, so for most applications that may change
+ * these dynamically it probably makes most sense to do so from the
+ * same thread as calls process(), even if that is a real-time thread.
+ *
+ * In real-time mode, once the first process() call has been made, no
+ * call to process(), available(), retrieve(), setTimeRatio() or
+ * setPitchScale() allocates or frees memory.  Everything is sized
+ * when the stretcher is constructed (or when setRatioRanges() or
+ * setMaxProcessSize() is called before processing begins).  See
+ * setRatioRanges() for what happens if a ratio is later requested
+ * that was not prepared for.  The one exception is that if a
+ * process() call is given more samples than setMaxProcessSize()
+ * allowed for, or the time ratio is outside the declared ranges, and
+ * the output could then overrun the output buffers, process() (or
+ * retrieve(), when using an input callback) enlarges the buffers
+ * before it starts processing rather than lose output.  Builds with
+ * RUBBERBAND_TRACK_ALLOCATIONS defined abort there instead.  None of
+ * these functions prints warnings in real-time mode: see
+ * getRealTimeWarnings().
  */
 
 namespace RubberBand
@@ -177,8 +192,11 @@ public:
      *   determine its own threading model.  Usually this means using
      *   one processing thread per audio channel in offline mode if
      *   the stretcher is able to determine that more than one CPU is
-     *   available, and one thread only in realtime mode.  This is the
-     *   defafult.
+     *   available, and one thread only in realtime mode.  If there
+     *   are more channels than processors, the channels are instead
+     *   shared out among a pool of one thread per processor, with
+     *   idle threads taking over work queued for busy ones.  This is
+     *   the defafult.
      *
      *   \li \c OptionThreadingNever - Never use more than one thread.
      *  
@@ -186,6 +204,53 @@ public:
      *   situation where \c OptionThreadingAuto would do so, except omit
      *   the check for multiple CPUs and instead assume it to be true.
      *
+     *   \li \c OptionThreadingShared - May be combined with
+     *   \c OptionThreadingAuto or \c OptionThreadingAlways.  Where
+     *   the stretcher would use one processing thread per channel,
+     *   instead run the per-channel work on a process-wide pool of
+     *   worker threads shared by all stretchers constructed with this
+     *   flag.  This avoids creating threads for each stretcher and
+     *   bounds the total number of threads when many stretchers are
+     *   in use at once.  See setThreadPoolSize().
+     *
+     *   \li \c OptionThreadingPipelined - May be combined with
+     *   \c OptionThreadingAuto or \c OptionThreadingAlways, in
+     *   offline mode.  Where the stretcher would otherwise use only
+     *   one thread (most usefully with a single channel), run the
+     *   analysis of each channel on a separate thread a few chunks
+     *   ahead of the rest of its processing.  This gives some
+     *   parallelism even for mono audio.  The output is identical to
+     *   single-threaded processing.
+     *
+     *   \li \c OptionThreadingRealTime - May be combined with
+     *   \c OptionProcessRealTime and \c OptionThreadingAuto or
+     *   \c OptionThreadingAlways.  Start worker threads at
+     *   construction and, within each process() call, analyse and
+     *   synthesise the channels in parallel across those threads and
+     *   the calling thread.  Results are collected before process()
+     *   returns, and the output is identical to single-threaded
+     *   processing.  Workers busy-wait briefly for the next chunk
+     *   before sleeping, so this trades some CPU time for lower
+     *   latency per process() call with many channels.  Has no
+     *   effect with only one channel.
+     *
+     *   \li \c OptionThreadingSegmented - May be combined with
+     *   \c OptionThreadingAuto or \c OptionThreadingAlways, in
+     *   offline mode.  Split the input at the points where the
+     *   stretcher resets its phase (at transients and after silence,
+     *   as found by study()), and render the resulting segments
+     *   concurrently on the shared thread pool used with
+     *   \c OptionThreadingShared, splicing them back together in
+     *   order.  This scales with the number of CPUs rather than the
+     *   number of channels, for long inputs with some transients.
+     *   The output is identical to single-threaded processing.  This
+     *   takes precedence over the other threading options; it
+     *   requires that study() be called first and that the pitch
+     *   scale be 1.0, and it is ignored with \c OptionTransientsMixed
+     *   or \c OptionPitchHighConsistency.  Where it cannot be used,
+     *   processing falls back to the per-channel threading that
+     *   would apply without this option.
+     *
      * 7. Flags prefixed \c OptionWindow control the window size for
      * FFT processing.  The window size actually used will depend on
      * many factors, but it can be influenced.  These options may not
@@ -270,6 +335,38 @@ public:
      *   setting).  This usually leads to better focus in the centre
      *   but a loss of stereo space and width.  Any channels beyond
      *   the first two are processed individually.
+     *
+     * 12. Flags prefixed \c OptionPrecision control the numerical
+     * precision used for frequency-domain processing.  These options
+     * may not be changed after construction.
+     *
+     *   \li \c OptionPrecisionDouble - Process in double precision.
+     *   This is the default, and is intended for the highest quality
+     *   results.
+     *
+     *   \li \c OptionPrecisionSingle - Process in single precision.
+     *   This halves the memory used for frequency-domain data and may
+     *   be substantially faster, especially where vector arithmetic
+     *   is available, at the expense of a small loss of accuracy.
+     *
+     * 13. Flags prefixed \c OptionStudy control how the results of
+     * study() are stored in offline mode, which matters only for very
+     * long inputs: a few bytes are kept for every few hundred input
+     * samples.  These options may not be changed after construction,
+     * and have no effect in realtime mode.  They may be combined.
+     *
+     *   \li \c OptionStudyStandard - Keep the study results in
+     *   memory at full precision.  This is the default.
+     *
+     *   \li \c OptionStudyCompact - Keep the study results at 16-bit
+     *   rather than 32-bit precision.  This halves the memory they
+     *   take, but may make small differences to the output.
+     *
+     *   \li \c OptionStudyFileBacked - Keep the study results in a
+     *   memory-mapped temporary file (in the directory named by the
+     *   TMPDIR environment variable, or /tmp), so that they can be
+     *   paged out rather than occupying memory.  If the file cannot
+     *   be created, memory is used as normal.
      */
     
     enum Option {
@@ -294,6 +391,10 @@ public:
         OptionThreadingAuto        = 0x00000000,
         OptionThreadingNever       = 0x00010000,
         OptionThreadingAlways      = 0x00020000,
+        OptionThreadingShared      = 0x00040000,
+        OptionThreadingRealTime    = 0x00080000,
+        OptionThreadingPipelined   = 0x00008000,
+        OptionThreadingSegmented   = 0x00004000,
 
         OptionWindowStandard       = 0x00000000,
         OptionWindowShort          = 0x00100000,
@@ -312,6 +413,13 @@ public:
         OptionChannelsApart        = 0x00000000,
         OptionChannelsTogether     = 0x10000000,
 
+        OptionPrecisionDouble      = 0x00000000,
+        OptionPrecisionSingle      = 0x20000000,
+
+        OptionStudyStandard        = 0x00000000,
+        OptionStudyCompact         = 0x00000040,
+        OptionStudyFileBacked      = 0x00000080,
+
         // n.b. Options is int, so we must stop before 0x80000000
     };
 
@@ -335,6 +443,90 @@ public:
                         Options options = DefaultOptions,
                         double initialTimeRatio = 1.0,
                         double initialPitchScale = 1.0);
+
+    /**
+     * An interface through which a stretcher may obtain its memory,
+     * for applications that need to supply it from their own pools
+     * or locked arenas (see the constructor below).
+     */
+    class Allocator
+    {
+    public:
+        virtual ~Allocator() { }
+
+        /**
+         * Return a block of at least the given number of bytes,
+         * aligned to the given alignment (a power of two), or NULL if
+         * the request cannot be met.  This may be called from any
+         * thread that calls into the stretcher, and from the
+         * stretcher's own processing threads, so it must be thread
+         * safe if the stretcher is multi-threaded.
+         */
+        virtual void *allocate(size_t size, size_t alignment) = 0;
+
+        /**
+         * Release a block previously returned by allocate().  This
+         * may be called from any of the same threads as allocate().
+         */
+        virtual void deallocate(void *ptr) = 0;
+    };
+
+    /**
+     * Construct a time and pitch stretcher object as above, obtaining
+     * its working memory through the given allocator.  This includes
+     * all of the sample and spectral buffers, FFT and resampler state,
+     * and the main internal objects.  Memory used by the threading
+     * layer, debug output, and key-frame map handling still comes
+     * from the system allocator.
+     *
+     * Each block requested from the allocator is 64 bytes (one cache
+     * line) larger than the buffer it holds, as the stretcher keeps
+     * a header there recording which allocator to return it to, and
+     * buffer sizes are rounded up to whole cache lines.  Without an
+     * allocator, the input buffers are mapped twice in succession in
+     * virtual memory where the platform allows, so that they never
+     * need unwrapping; that memory cannot come from an allocator, so
+     * with one the input buffers are ordinary ones instead.
+     *
+     * The allocator is not owned by the stretcher and must outlive it.
+     */
+    RubberBandStretcher(size_t sampleRate,
+                        size_t channels,
+                        Options options,
+                        double initialTimeRatio,
+                        double initialPitchScale,
+                        Allocator *allocator);
+
+    /**
+     * The ranges within which the time ratio and pitch scale of a
+     * RealTime stretcher will stay.  See setRatioRanges().
+     */
+    struct RatioRanges
+    {
+        double minTimeRatio;
+        double maxTimeRatio;
+        double minPitchScale;
+        double maxPitchScale;
+    };
+
+    /**
+     * Construct a time and pitch stretcher object as above, with the
+     * ratio ranges declared from the start.  This has the same
+     * effect as calling setRatioRanges() straight after
+     * construction, but the stretcher allocates only what the ranges
+     * need, rather than allocating for its default set of ratios and
+     * then releasing that again.  The ranges are ignored in Offline
+     * mode.  The allocator, if any, is used as in the constructor
+     * above.
+     */
+    RubberBandStretcher(size_t sampleRate,
+                        size_t channels,
+                        Options options,
+                        double initialTimeRatio,
+                        double initialPitchScale,
+                        const RatioRanges &ranges,
+                        Allocator *allocator = 0);
+
     ~RubberBandStretcher();
 
     /**
@@ -489,12 +681,93 @@ public:
      * This function may not be called after the first call to study()
      * or process().
      *
+     * In RealTime mode, the output buffers are sized from this value
+     * (see also setRatioRanges()).  Passing a larger block to
+     * process() later makes it reallocate them.
+     *
      * Note that this value is only relevant to process(), not to
      * study() (to which you may pass any number of samples at a time,
      * and from which there is no output).
      */
     void setMaxProcessSize(size_t samples);
 
+    /**
+     * In RealTime mode, tell the stretcher the ranges within which
+     * the time ratio and pitch scale will stay for the rest of its
+     * life.  The current ratio and scale are added to the ranges if
+     * they fall outside them.
+     *
+     * By default a RealTime stretcher preallocates FFTs, windows,
+     * resamplers and buffers for a fairly wide set of possible
+     * ratios, so that later changes do not need to allocate.  Once
+     * ranges are declared, it keeps only what those ranges need: for
+     * example, no resamplers if the pitch scale is fixed at 1.0.
+     * This can reduce the memory used by each instance considerably.
+     *
+     * The output buffers are sized for the output of a process()
+     * block at the largest time ratio in the ranges, so if you will
+     * pass blocks larger than the stretcher would ask for through
+     * getSamplesRequired(), also call setMaxProcessSize() (before or
+     * after this function) before processing begins.
+     *
+     * Once processing has begun, the stretcher does not allocate
+     * while the ratios stay within the declared ranges and the
+     * blocks within the maximum process size.  A ratio or scale
+     * outside the ranges is not an error, but the stretcher then
+     * makes do with the nearest FFT and window sizes it prepared,
+     * possibly with some loss of quality.  If a
+     * time ratio outside the ranges means that a block could produce
+     * more output than the output buffers hold, process() also
+     * enlarges them, which allocates.  A pitch scale other than 1.0
+     * is rejected if the ranges declared that it would stay at 1.0.
+     * Each of these is reported through getRealTimeWarnings().
+     *
+     * This function has no effect in Offline mode, and may not be
+     * called after the first call to process().  Calling it
+     * reallocates everything that was sized at construction; to
+     * avoid that, pass the ranges to the constructor instead.
+     */
+    void setRatioRanges(double minTimeRatio, double maxTimeRatio,
+                        double minPitchScale, double maxPitchScale);
+
+    /**
+     * Conditions that a RealTime stretcher may run into once
+     * processing has begun, reported through getRealTimeWarnings().
+     */
+    enum RealTimeWarning {
+
+        /// The time ratio or pitch scale needed window or FFT sizes
+        /// that were not prepared, so the nearest prepared ones were
+        /// used instead.  See setRatioRanges().
+        RealTimeWarningSizesNotPrepared = 0x01,
+
+        /// setPitchScale() ignored a pitch scale other than 1.0,
+        /// because the ratio ranges excluded pitch changes.
+        RealTimeWarningPitchScaleRejected = 0x02,
+
+        /// process() or retrieve() enlarged the output buffers, which
+        /// allocates.  See setMaxProcessSize() and setRatioRanges().
+        RealTimeWarningOutputBuffersGrown = 0x04,
+
+        /// Some output was lost because the output buffers were full.
+        RealTimeWarningOutputLost = 0x08
+    };
+
+    /**
+     * In RealTime mode, return the RealTimeWarning flags for the
+     * conditions that have arisen since the last call to this
+     * function (or since construction), and clear them.
+     *
+     * These conditions arise within process(), retrieve() and
+     * setPitchScale(), which do not write to the console in RealTime
+     * mode, as that could block.  Poll this function to find out
+     * about them instead, for example from a non-real-time thread
+     * now and then.  It may be called from any thread.  With a debug
+     * level of 1 or more (see setDebugLevel()) they are also printed
+     * as they happen.
+     */
+    int getRealTimeWarnings();
+
     /**
      * Ask the stretcher how many audio sample frames should be
      * provided as input in order to ensure that some more output
@@ -557,6 +830,18 @@ public:
      * 
      * Set "final" to true if this is the last block of data that will
      * be provided to study() before the first process() call.
+     *
+     * If the stretcher has a thread pool (with \c OptionThreadingShared
+     * in multithreaded mode, with \c OptionThreadingSegmented, or in
+     * multithreaded mode with more channels than processors), or if
+     * \c OptionThreadingAlways or \c OptionThreadingShared was given,
+     * a large block is studied in parallel across the stretcher's
+     * own pool, or otherwise the shared pool, with the same results
+     * as studying it serially.  This applies for mono audio too.  With
+     * \c OptionThreadingAuto alone, a stretcher without a pool of its
+     * own studies serially, so as not to start the shared pool.  It is worth passing the
+     * whole input in one study() call, or in a few large blocks, where
+     * that is practical.
      */
     void study(const float *const *input, size_t samples, bool final);
 
@@ -568,6 +853,97 @@ public:
      */
     void process(const float *const *input, size_t samples, bool final);
 
+    /**
+     * Provide a block of sample frames for processing, as process(),
+     * but without waiting for processing threads to make room for
+     * it.  Return the number of sample frames accepted, which may be
+     * fewer than "samples" (including zero).  The caller should pass
+     * the remaining frames, starting from input[c] + accepted, in a
+     * later call.  "final" takes effect only if all of the frames are
+     * accepted.
+     *
+     * This is intended for offline multithreaded modes, where
+     * process() may block until the processing threads or tasks have
+     * consumed enough input:
+     *
+     *   \li With one processing thread or task per channel, only the
+     *   frames that fit in the input buffers are accepted.
+     *
+     *   \li With \c OptionThreadingPipelined, likewise only the frames
+     *   that fit are accepted, and only the chunks the analysis
+     *   threads have already finished are processed.  Call this
+     *   function again, with zero frames if there are none left to
+     *   give, to process the rest.  Once the final block has been
+     *   accepted, available() completes the processing and may wait
+     *   for the analysis threads to do so.
+     *
+     *   \li With \c OptionThreadingSegmented, every frame is
+     *   accepted, but segments are handed to the thread pool only
+     *   while it has a task free for them.  available() hands on the
+     *   rest as tasks become free.
+     *
+     * In any other mode there is nothing to wait for, and this
+     * function behaves exactly like process() and always accepts
+     * every frame.
+     *
+     * Use setNotificationCallback() to learn when to try again.
+     */
+    size_t processNonBlocking(const float *const *input, size_t samples,
+                              bool final);
+
+    typedef void (*NotificationCallback)(void *data);
+
+    /**
+     * Set a function to be called whenever a processing thread has
+     * consumed input or produced output.  This means that a
+     * subsequent processNonBlocking() call may accept more frames or
+     * available() may report more output.  "data" is passed to the
+     * function unchanged.  Pass a null callback to remove it.
+     *
+     * The function is called from the library's own processing
+     * threads, often many times per second.  It should do no more
+     * than wake the thread that drives the stretcher, for example by
+     * writing to a pipe or event descriptor that the caller's event
+     * loop polls.  It must not call any function of this stretcher.
+     * Calls may be spurious.
+     *
+     * Set the callback before the first process() call.
+     */
+    void setNotificationCallback(NotificationCallback callback, void *data);
+
+    typedef size_t (*InputCallback)(void *data, float *const *input,
+                                    size_t samples);
+
+    /**
+     * Set a function from which the stretcher will pull its input,
+     * as an alternative to supplying it through process().  Once this
+     * is set, each retrieve() call asks the function for input,
+     * "samples" sample frames at a time, until the requested amount
+     * of output is available or the input ends.  The stretcher never
+     * asks for more input than getSamplesRequired() reports, so input
+     * is not buffered any further ahead than it needs to be.
+     *
+     * The function should write up to "samples" frames of
+     * de-interleaved input, one float array per channel, to "input"
+     * and return the number of frames written.  Returning fewer than
+     * were asked for marks the end of the input.  "data" is passed to
+     * the function unchanged.
+     *
+     * The function is called on the thread that calls retrieve().
+     * In offline mode with one processing thread per channel,
+     * retrieve() waits for those threads when it needs output that
+     * they have not produced yet; so, with an input callback,
+     * retrieve() returns fewer frames than requested only when the
+     * stretch is complete.  Pass a null callback to return to
+     * supplying input through process().
+     *
+     * Do not mix calls to process() with an input callback, and set
+     * the callback before the first retrieve() call.  In offline mode
+     * study() must still be called first, and the callback must
+     * return the same input again for processing.
+     */
+    void setInputCallback(InputCallback callback, void *data);
+
     /**
      * Ask the stretcher how many audio sample frames of output data
      * are available for reading (via retrieve()).
@@ -589,6 +965,10 @@ public:
      * channel for de-interleaved audio data) pointed to by "output".
      * The return value is the actual number of sample frames
      * retrieved.
+     *
+     * If an input callback has been set with setInputCallback(), this
+     * first pulls as much input through it as is needed to produce
+     * "samples" frames of output.
      */
     size_t retrieve(float *const *output, size_t samples) const;
 
@@ -677,6 +1057,85 @@ public:
      */
     static void setDefaultDebugLevel(int level);
 
+    /**
+     * Set the number of worker threads in the process-wide thread
+     * pool used by stretchers constructed with OptionThreadingShared.
+     * The default, or a value of zero, is one thread per available
+     * processor.
+     *
+     * The pool is created when the first stretcher that uses it is
+     * constructed.  If this function is called after that, the pool
+     * may be enlarged but will not be reduced in size.
+     */
+    static void setThreadPoolSize(size_t threads);
+
+    /**
+     * Enable or disable threading verification for stretchers
+     * constructed subsequently.  This is a testing facility, to
+     * confirm that a multithreaded configuration produces exactly the
+     * same output as a single-threaded one before relying on it.
+     *
+     * Each verifying stretcher that is not constructed with
+     * \c OptionThreadingNever also creates an internal stretcher
+     * with the same options but \c OptionThreadingNever, passes it
+     * the same input and settings, and compares its output with that
+     * returned by every retrieve() call.  If the output differs in
+     * any bit, an error is printed and the process is aborted.  This
+     * more than doubles the processing cost, so it should not be
+     * enabled in production.
+     *
+     * The output of a stretcher is the same for any combination of
+     * \c OptionThreading flags and any thread pool size, and is
+     * independent of when, and from which thread, retrieve() is
+     * called.
+     */
+    static void setThreadingVerification(bool verify);
+
+    /**
+     * The following functions configure every thread the library
+     * creates, including per-channel processing threads, real-time
+     * workers, analysis threads and the threads of the shared pool.
+     * The settings are process-wide and take effect for threads
+     * started after the call; threads that are already running are
+     * not affected.  To be sure of covering the shared pool, call
+     * them before constructing the first stretcher that uses it.
+     * Failure to apply a setting (for example through lack of
+     * permission) is reported as a warning and the thread is started
+     * anyway.
+     */
+
+    /**
+     * Restrict library threads to the given processor indices.  An
+     * empty list, the default, places no restriction.  Supported on
+     * Linux and Windows; ignored elsewhere.
+     */
+    static void setThreadAffinity(const std::vector<int> &processors);
+
+    /**
+     * Set the scheduling policy and priority of library threads.  A
+     * priority from 1 to 99 requests real-time FIFO scheduling
+     * (SCHED_FIFO) at that priority; zero requests the default
+     * time-sharing policy (SCHED_OTHER); and -1, the default, means
+     * threads inherit the policy of the thread that creates them.  On
+     * Windows, any positive priority selects time-critical priority.
+     */
+    static void setThreadPriority(int priority);
+
+    /**
+     * Set the stack size in bytes for library threads, or zero (the
+     * default) for the system default.
+     */
+    static void setThreadStackSize(size_t bytes);
+
+    /**
+     * Set the prefix used when naming library threads.  Threads are
+     * named with the prefix followed by a short description of their
+     * role, such as "rb-pool" or "rb-processA", truncated to 15
+     * characters.  The default prefix is "rb".  Names are applied on
+     * Linux and macOS.
+     */
+    static void setThreadNamePrefix(const char *prefix);
+
 protected:
     class Impl;
     Impl *m_d;
@@ -24,13 +24,15 @@
 #ifndef _RUBBERBAND_C_API_H_
 #define _RUBBERBAND_C_API_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define RUBBERBAND_VERSION "1.8.1"
 #define RUBBERBAND_API_MAJOR_VERSION 2
-#define RUBBERBAND_API_MINOR_VERSION 5
+#define RUBBERBAND_API_MINOR_VERSION 6
 
 /**
  * This is a C-linkage interface to the Rubber Band time stretcher.
@@ -67,6 +69,10 @@ enum RubberBandOption {
     RubberBandOptionThreadingAuto        = 0x00000000,
     RubberBandOptionThreadingNever       = 0x00010000,
     RubberBandOptionThreadingAlways      = 0x00020000,
+    RubberBandOptionThreadingShared      = 0x00040000,
+    RubberBandOptionThreadingRealTime    = 0x00080000,
+    RubberBandOptionThreadingPipelined   = 0x00008000,
+    RubberBandOptionThreadingSegmented   = 0x00004000,
 
     RubberBandOptionWindowStandard       = 0x00000000,
     RubberBandOptionWindowShort          = 0x00100000,
@@ -84,6 +90,13 @@ enum RubberBandOption {
 
     RubberBandOptionChannelsApart        = 0x00000000,
     RubberBandOptionChannelsTogether     = 0x10000000,
+
+    RubberBandOptionPrecisionDouble      = 0x00000000,
+    RubberBandOptionPrecisionSingle      = 0x20000000,
+
+    RubberBandOptionStudyStandard        = 0x00000000,
+    RubberBandOptionStudyCompact         = 0x00000040,
+    RubberBandOptionStudyFileBacked      = 0x00000080,
 };
 
 typedef int RubberBandOptions;
@@ -97,6 +110,23 @@ extern RubberBandState rubberband_new(unsigned int sampleRate,
                                       double initialTimeRatio,
                                       double initialPitchScale);
 
+/**
+ * Functions through which a stretcher created with
+ * rubberband_new_with_allocator obtains its memory.  See
+ * RubberBandStretcher::Allocator for the requirements on these.
+ */
+typedef void *(*RubberBandAllocateFunction)(void *data, size_t size, size_t alignment);
+typedef void (*RubberBandDeallocateFunction)(void *data, void *ptr);
+
+extern RubberBandState rubberband_new_with_allocator(unsigned int sampleRate,
+                                                     unsigned int channels,
+                                                     RubberBandOptions options,
+                                                     double initialTimeRatio,
+                                                     double initialPitchScale,
+                                                     RubberBandAllocateFunction allocate,
+                                                     RubberBandDeallocateFunction deallocate,
+                                                     void *allocatorData);
+
 extern void rubberband_delete(RubberBandState);
 
 extern void rubberband_reset(RubberBandState);
@@ -120,10 +150,27 @@ extern void rubberband_set_expected_input_duration(RubberBandState, unsigned int
 extern unsigned int rubberband_get_samples_required(const RubberBandState);
 
 extern void rubberband_set_max_process_size(RubberBandState, unsigned int samples);
+extern void rubberband_set_ratio_ranges(RubberBandState, double min_time_ratio, double max_time_ratio, double min_pitch_scale, double max_pitch_scale);
+
+enum RubberBandRealTimeWarning {
+    RubberBandRealTimeWarningSizesNotPrepared   = 0x01,
+    RubberBandRealTimeWarningPitchScaleRejected = 0x02,
+    RubberBandRealTimeWarningOutputBuffersGrown = 0x04,
+    RubberBandRealTimeWarningOutputLost         = 0x08
+};
+
+extern int rubberband_get_realtime_warnings(RubberBandState);
 extern void rubberband_set_key_frame_map(RubberBandState, unsigned int keyframecount, unsigned int *from, unsigned int *to);
 
 extern void rubberband_study(RubberBandState, const float *const *input, unsigned int samples, int final);
 extern void rubberband_process(RubberBandState, const float *const *input, unsigned int samples, int final);
+extern unsigned int rubberband_process_nonblocking(RubberBandState, const float *const *input, unsigned int samples, int final);
+
+typedef void (*RubberBandNotificationCallback)(void *data);
+extern void rubberband_set_notification_callback(RubberBandState, RubberBandNotificationCallback callback, void *data);
+
+typedef unsigned int (*RubberBandInputCallback)(void *data, float *const *input, unsigned int samples);
+extern void rubberband_set_input_callback(RubberBandState, RubberBandInputCallback callback, void *data);
 
 extern int rubberband_available(const RubberBandState);
 extern unsigned int rubberband_retrieve(const RubberBandState, float *const *output, unsigned int samples);
@@ -135,6 +182,14 @@ extern void rubberband_calculate_stretch(RubberBandState);
 extern void rubberband_set_debug_level(RubberBandState, int level);
 extern void rubberband_set_default_debug_level(int level);
 
+extern void rubberband_set_thread_pool_size(unsigned int threads);
+extern void rubberband_set_threading_verification(int verify);
+
+extern void rubberband_set_thread_affinity(const int *processors, unsigned int count);
+extern void rubberband_set_thread_priority(int priority);
+extern void rubberband_set_thread_stack_size(unsigned int bytes);
+extern void rubberband_set_thread_name_prefix(const char *prefix);
+
 #ifdef __cplusplus
 }
 #endif
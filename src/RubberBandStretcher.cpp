@@ -38,6 +38,49 @@ RubberBandStretcher::RubberBandStretcher(size_t sampleRate,
 {
 }
 
+static void *
+allocateThrough(void *data, size_t bytes, size_t alignment)
+{
+    return ((RubberBandStretcher::Allocator *)data)->allocate(bytes, alignment);
+}
+
+static void
+deallocateThrough(void *data, void *ptr)
+{
+    ((RubberBandStretcher::Allocator *)data)->deallocate(ptr);
+}
+
+RubberBandStretcher::RubberBandStretcher(size_t sampleRate,
+                                         size_t channels,
+                                         Options options,
+                                         double initialTimeRatio,
+                                         double initialPitchScale,
+                                         Allocator *allocator) :
+    m_d(0)
+{
+    AllocatorHooks hooks = { allocateThrough, deallocateThrough, allocator };
+    AllocatorScope scope(allocator ? &hooks : 0);
+    m_d = new Impl(sampleRate, channels, options,
+                   initialTimeRatio, initialPitchScale,
+                   allocator ? &hooks : 0);
+}
+
+RubberBandStretcher::RubberBandStretcher(size_t sampleRate,
+                                         size_t channels,
+                                         Options options,
+                                         double initialTimeRatio,
+                                         double initialPitchScale,
+                                         const RatioRanges &ranges,
+                                         Allocator *allocator) :
+    m_d(0)
+{
+    AllocatorHooks hooks = { allocateThrough, deallocateThrough, allocator };
+    AllocatorScope scope(allocator ? &hooks : 0);
+    m_d = new Impl(sampleRate, channels, options,
+                   initialTimeRatio, initialPitchScale,
+                   allocator ? &hooks : 0, &ranges);
+}
+
 RubberBandStretcher::~RubberBandStretcher()
 {
     delete m_d;
@@ -46,18 +89,21 @@ RubberBandStretcher::~RubberBandStretcher()
 void
 RubberBandStretcher::reset()
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->reset();
 }
 
 void
 RubberBandStretcher::setTimeRatio(double ratio)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setTimeRatio(ratio);
 }
 
 void
 RubberBandStretcher::setPitchScale(double scale)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setPitchScale(scale);
 }
 
@@ -82,48 +128,71 @@ RubberBandStretcher::getLatency() const
 void
 RubberBandStretcher::setTransientsOption(Options options)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setTransientsOption(options);
 }
 
 void
 RubberBandStretcher::setDetectorOption(Options options)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setDetectorOption(options);
 }
 
 void
 RubberBandStretcher::setPhaseOption(Options options)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setPhaseOption(options);
 }
 
 void
 RubberBandStretcher::setFormantOption(Options options)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setFormantOption(options);
 }
 
 void
 RubberBandStretcher::setPitchOption(Options options)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setPitchOption(options);
 }
 
 void
 RubberBandStretcher::setExpectedInputDuration(size_t samples)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setExpectedInputDuration(samples);
 }
 
 void
 RubberBandStretcher::setMaxProcessSize(size_t samples)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setMaxProcessSize(samples);
 }
 
+void
+RubberBandStretcher::setRatioRanges(double minTimeRatio, double maxTimeRatio,
+                                    double minPitchScale, double maxPitchScale)
+{
+    AllocatorScope scope(m_d->getAllocatorHooks());
+    m_d->setRatioRanges(minTimeRatio, maxTimeRatio,
+                        minPitchScale, maxPitchScale);
+}
+
+int
+RubberBandStretcher::getRealTimeWarnings()
+{
+    return m_d->getRealTimeWarnings();
+}
+
 void
 RubberBandStretcher::setKeyFrameMap(const map<size_t, size_t> &mapping)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setKeyFrameMap(mapping);
 }
 
@@ -137,6 +206,7 @@ void
 RubberBandStretcher::study(const float *const *input, size_t samples,
                            bool final)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->study(input, samples, final);
 }
 
@@ -144,18 +214,42 @@ void
 RubberBandStretcher::process(const float *const *input, size_t samples,
                              bool final)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->process(input, samples, final);
 }
 
+size_t
+RubberBandStretcher::processNonBlocking(const float *const *input,
+                                        size_t samples, bool final)
+{
+    AllocatorScope scope(m_d->getAllocatorHooks());
+    return m_d->processNonBlocking(input, samples, final);
+}
+
+void
+RubberBandStretcher::setNotificationCallback(NotificationCallback callback,
+                                             void *data)
+{
+    m_d->setNotificationCallback(callback, data);
+}
+
+void
+RubberBandStretcher::setInputCallback(InputCallback callback, void *data)
+{
+    m_d->setInputCallback(callback, data);
+}
+
 int
 RubberBandStretcher::available() const
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     return m_d->available();
 }
 
 size_t
 RubberBandStretcher::retrieve(float *const *output, size_t samples) const
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     return m_d->retrieve(output, samples);
 }
 
@@ -168,6 +262,7 @@ RubberBandStretcher::getFrequencyCutoff(int n) const
 void
 RubberBandStretcher::setFrequencyCutoff(int n, float f)
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->setFrequencyCutoff(n, f);
 }
 
@@ -204,6 +299,7 @@ RubberBandStretcher::getChannelCount() const
 void
 RubberBandStretcher::calculateStretch()
 {
+    AllocatorScope scope(m_d->getAllocatorHooks());
     m_d->calculateStretch();
 }
 
@@ -219,5 +315,41 @@ RubberBandStretcher::setDefaultDebugLevel(int level)
     Impl::setDefaultDebugLevel(level);
 }
 
+void
+RubberBandStretcher::setThreadPoolSize(size_t threads)
+{
+    Impl::setThreadPoolSize(threads);
+}
+
+void
+RubberBandStretcher::setThreadingVerification(bool verify)
+{
+    Impl::setThreadingVerification(verify);
+}
+
+void
+RubberBandStretcher::setThreadAffinity(const std::vector<int> &processors)
+{
+    Impl::setThreadAffinity(processors);
+}
+
+void
+RubberBandStretcher::setThreadPriority(int priority)
+{
+    Impl::setThreadPriority(priority);
+}
+
+void
+RubberBandStretcher::setThreadStackSize(size_t bytes)
+{
+    Impl::setThreadStackSize(bytes);
+}
+
+void
+RubberBandStretcher::setThreadNamePrefix(const char *prefix)
+{
+    Impl::setThreadNamePrefix(prefix);
+}
+
 }
 
@@ -35,6 +35,33 @@
 namespace RubberBand
 {
 
+namespace {
+
+// The three-value moving mean of a curve, as smoothDF would return
+// it, calculated as needed rather than copying the whole curve
+
+class SmoothedCurve
+{
+public:
+    SmoothedCurve(const CurveStore &df) : m_df(df), m_size(df.size()) { }
+
+    float operator[](size_t i) const {
+        float total = 0.f, count = 0;
+        if (i > 0) { total += m_df[i-1]; ++count; }
+        total += m_df[i]; ++count;
+        if (i+1 < m_size) { total += m_df[i+1]; ++count; }
+        return total / count;
+    }
+
+    size_t size() const { return m_size; }
+
+private:
+    const CurveStore &m_df;
+    size_t m_size;
+};
+
+}
+
 StretchCalculator::StretchCalculator(size_t sampleRate,
                                      size_t inputIncrement,
                                      bool useHardPeaks) :
@@ -72,8 +99,8 @@ StretchCalculator::setKeyFrameMap(const std::map<size_t, size_t> &mapping)
 
 std::vector<int>
 StretchCalculator::calculate(double ratio, size_t inputDuration,
-                             const std::vector<float> &phaseResetDf,
-                             const std::vector<float> &stretchDf)
+                             const CurveStore &phaseResetDf,
+                             const CurveStore &stretchDf)
 {
     assert(phaseResetDf.size() == stretchDf.size());
 
@@ -407,9 +434,9 @@ StretchCalculator::reset()
 }
 
 std::vector<StretchCalculator::Peak>
-StretchCalculator::findPeaks(const std::vector<float> &rawDf)
+StretchCalculator::findPeaks(const CurveStore &rawDf)
 {
-    std::vector<float> df = smoothDF(rawDf);
+    SmoothedCurve df(rawDf);
 
     // We distinguish between "soft" and "hard" peaks.  A soft peak is
     // simply the result of peak-picking on the smoothed onset
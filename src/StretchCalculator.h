@@ -29,10 +29,13 @@
 #include <vector>
 #include <map>
 
+#include "base/CurveStore.h"
+#include "system/Allocators.h"
+
 namespace RubberBand
 {
 
-class StretchCalculator
+class StretchCalculator : public Allocated
 {
 public:
     StretchCalculator(size_t sampleRate, size_t inputIncrement, bool useHardPeaks);
@@ -52,11 +55,12 @@ public:
      * overall target stretch ratio, input duration in audio samples,
      * and the audio curves to use for identifying phase lock points
      * (lockAudioCurve) and for allocating stretches to relatively
-     * less prominent points (stretchAudioCurve).
+     * less prominent points (stretchAudioCurve).  The curves are
+     * read in place, and only short stretches of them are copied.
      */
     std::vector<int> calculate(double ratio, size_t inputDuration,
-                               const std::vector<float> &lockAudioCurve,
-                               const std::vector<float> &stretchAudioCurve);
+                               const CurveStore &lockAudioCurve,
+                               const CurveStore &stretchAudioCurve);
 
     /**
      * Calculate the phase increment for a single audio block, given
@@ -86,7 +90,7 @@ public:
     std::vector<float> smoothDF(const std::vector<float> &df);
 
 protected:
-    std::vector<Peak> findPeaks(const std::vector<float> &audioCurve);
+    std::vector<Peak> findPeaks(const CurveStore &audioCurve);
 
     void mapPeaks(std::vector<Peak> &peaks, std::vector<size_t> &targets,
                   size_t outputDuration, size_t totalCount);
@@ -30,9 +30,130 @@
 namespace RubberBand
 {
 
+template <typename T>
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::Spectrum() :
+    mag(0),
+    phase(0),
+#ifdef USE_BLOCKED_PHASE_STATE
+    state(0),
+#else
+    prevPhase(0),
+    prevError(0),
+    unwrappedPhase(0),
+#endif
+    dblbuf(0),
+    envelope(0),
+    spare(0)
+{
+}
+
+// All of a channel's per-size buffers are carved out of one block
+// (see allocateArena below), each starting on a cache line boundary
+
+static const size_t arenaAlignment = RUBBERBAND_ALIGNMENT;
+
+static size_t
+arenaBytes(size_t bytes)
+{
+    return (bytes + arenaAlignment - 1) & ~(arenaAlignment - 1);
+}
+
+template <typename T>
+static T *
+carve(char *&arena, size_t count)
+{
+    T *ptr = (T *)arena;
+    arena += arenaBytes(count * sizeof(T));
+    return ptr;
+}
+
+template <typename T>
+size_t
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::stateSize(size_t realSize)
+{
+#ifdef USE_BLOCKED_PHASE_STATE
+    return ((realSize + stateBlock - 1) / stateBlock) * (3 * stateBlock);
+#else
+    return realSize;
+#endif
+}
+
+template <typename T>
+size_t
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::bytes(size_t realSize,
+                                                           size_t maxSize)
+{
+#ifdef USE_BLOCKED_PHASE_STATE
+    return 4 * arenaBytes(realSize * sizeof(T)) +
+        arenaBytes(stateSize(realSize) * sizeof(T)) +
+        arenaBytes(maxSize * sizeof(T));
+#else
+    return 7 * arenaBytes(realSize * sizeof(T)) +
+        arenaBytes(maxSize * sizeof(T));
+#endif
+}
+
+template <typename T>
+void
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::assign(char *&arena,
+                                                            size_t realSize,
+                                                            size_t maxSize)
+{
+    // In the order the phase vocoder works through them: the
+    // per-bin arrays are all read and written in the same loops, and
+    // dblbuf is the FFT i/o buffer that feeds and is fed by them
+
+    mag = carve<T>(arena, realSize);
+    phase = carve<T>(arena, realSize);
+#ifdef USE_BLOCKED_PHASE_STATE
+    state = carve<T>(arena, stateSize(realSize));
+#else
+    prevPhase = carve<T>(arena, realSize);
+    prevError = carve<T>(arena, realSize);
+    unwrappedPhase = carve<T>(arena, realSize);
+#endif
+    envelope = carve<T>(arena, realSize);
+
+    dblbuf = carve<T>(arena, maxSize);
+
+    spare = carve<T>(arena, realSize);
+}
+
+template <typename T>
+void
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::clear(size_t realSize,
+                                                           size_t maxSize)
+{
+    v_zero(dblbuf, maxSize);
+
+    v_zero(mag, realSize);
+    v_zero(phase, realSize);
+#ifdef USE_BLOCKED_PHASE_STATE
+    v_zero(state, stateSize(realSize));
+#else
+    v_zero(prevPhase, realSize);
+    v_zero(prevError, realSize);
+    v_zero(unwrappedPhase, realSize);
+#endif
+}
+
+template <typename T>
+void
+RubberBandStretcher::Impl::ChannelData::Spectrum<T>::release()
+{
+    mag = phase = envelope = dblbuf = spare = 0;
+#ifdef USE_BLOCKED_PHASE_STATE
+    state = 0;
+#else
+    prevPhase = prevError = unwrappedPhase = 0;
+#endif
+}
+
 RubberBandStretcher::Impl::ChannelData::ChannelData(size_t windowSize,
                                                     size_t fftSize,
-                                                    size_t outbufSize)
+                                                    size_t outbufSize,
+                                                    bool sp) :
+    singlePrecision(sp)
 {
     std::set<size_t> s;
     construct(s, windowSize, fftSize, outbufSize);
@@ -41,7 +162,9 @@ RubberBandStretcher::Impl::ChannelData::ChannelData(size_t windowSize,
 RubberBandStretcher::Impl::ChannelData::ChannelData(const std::set<size_t> &sizes,
                                                     size_t initialWindowSize,
                                                     size_t initialFftSize,
-                                                    size_t outbufSize)
+                                                    size_t outbufSize,
+                                                    bool sp) :
+    singlePrecision(sp)
 {
     construct(sizes, initialWindowSize, initialFftSize, outbufSize);
 }
@@ -64,53 +187,80 @@ RubberBandStretcher::Impl::ChannelData::construct(const std::set<size_t> &sizes,
         if (*i > maxSize) maxSize = *i;
     }
 
-    // max possible size of the real "half" of freq data
-    size_t realSize = maxSize / 2 + 1;
-
-//    std::cerr << "ChannelData::construct([" << sizes.size() << "], " << maxSize << ", " << realSize << ", " << outbufSize << ")" << std::endl;
-
     if (outbufSize < maxSize) outbufSize = maxSize;
 
-    inbuf = new RingBuffer<float>(maxSize);
-    outbuf = new RingBuffer<float>(outbufSize);
+    // Make room for the largest of the sizes that setSizes() may be
+    // asked for, so that switching to it does not have to reallocate
+    capacity = maxSize;
+    if (i != sizes.end() && *i * 2 > capacity) capacity = *i * 2;
 
-    mag = allocate_and_zero<process_t>(realSize);
-    phase = allocate_and_zero<process_t>(realSize);
-    prevPhase = allocate_and_zero<process_t>(realSize);
-    prevError = allocate_and_zero<process_t>(realSize);
-    unwrappedPhase = allocate_and_zero<process_t>(realSize);
-    envelope = allocate_and_zero<process_t>(realSize);
-
-    fltbuf = allocate_and_zero<float>(maxSize);
-    dblbuf = allocate_and_zero<process_t>(maxSize);
+    inbuf = new RingBuffer<float>(maxSize, true, capacity);
+    outbuf = new RingBuffer<float>(outbufSize);
 
-    accumulator = allocate_and_zero<float>(maxSize);
-    windowAccumulator = allocate_and_zero<float>(maxSize);
-    ms = allocate_and_zero<float>(maxSize);
-    interpolator = allocate_and_zero<float>(maxSize);
+    arena = 0;
+    allocateArena(capacity / 2 + 1, capacity);
     interpolatorScale = 0;
 
     for (std::set<size_t>::const_iterator i = sizes.begin();
          i != sizes.end(); ++i) {
         ffts[*i] = new FFT(*i);
-        if (sizeof(process_t) == sizeof(double)) {
-            ffts[*i]->initDouble();
-        } else {
+        if (singlePrecision) {
             ffts[*i]->initFloat();
+        } else {
+            ffts[*i]->initDouble();
         }
     }
     fft = ffts[initialFftSize];
 
     resampler = 0;
+    interpolatorCache = 0;
     resamplebuf = 0;
     resamplebufSize = 0;
 
+    segmentOverlap = 0;
+
     reset();
 
     // Avoid dividing opening sample (which will be discarded anyway) by zero
     windowAccumulator[0] = 1.f;
 }
 
+void
+RubberBandStretcher::Impl::ChannelData::allocateArena(size_t realSize,
+                                                      size_t maxSize)
+{
+    size_t floatBytes = arenaBytes(maxSize * sizeof(float));
+
+    size_t bytes = 6 * floatBytes;
+    if (singlePrecision) {
+        bytes += fspec.bytes(realSize, maxSize);
+    } else {
+        bytes += dspec.bytes(realSize, maxSize);
+    }
+
+    // allocate() returns aligned memory, and each buffer's size is
+    // rounded up to keep the next one aligned
+    arena = allocate_and_zero<char>(bytes);
+
+    char *p = arena;
+
+    if (singlePrecision) {
+        fspec.assign(p, realSize, maxSize);
+    } else {
+        dspec.assign(p, realSize, maxSize);
+    }
+
+    // Synthesis goes from dblbuf (above) through fltbuf into the
+    // accumulators, so those follow on directly
+
+    fltbuf = carve<float>(p, maxSize);
+    accumulator = carve<float>(p, maxSize);
+    windowAccumulator = carve<float>(p, maxSize);
+    interpolator = carve<float>(p, maxSize);
+    ms = carve<float>(p, maxSize);
+    fltspare = carve<float>(p, maxSize);
+}
+
 
 void
 RubberBandStretcher::Impl::ChannelData::setSizes(size_t windowSize,
@@ -121,7 +271,20 @@ RubberBandStretcher::Impl::ChannelData::setSizes(size_t windowSize,
     size_t maxSize = 2 * std::max(windowSize, fftSize);
     size_t realSize = maxSize / 2 + 1;
     size_t oldMax = inbuf->getSize();
-    size_t oldReal = oldMax / 2 + 1;
+
+    if (oldMax < maxSize && capacity >= maxSize) {
+
+        // Grow into the room set aside at construction.  As in the
+        // reallocating case below, only the accumulators are kept
+
+        inbuf->setSize(maxSize);
+
+        v_zero(accumulator + oldMax, maxSize - oldMax);
+        v_zero(windowAccumulator + oldMax, maxSize - oldMax);
+
+        interpolatorScale = 0;
+        oldMax = maxSize;
+    }
 
     if (oldMax >= maxSize) {
 
@@ -135,23 +298,22 @@ RubberBandStretcher::Impl::ChannelData::setSizes(size_t windowSize,
             //!!! this also requires a lock, but it shouldn't occur in
             //RT mode with proper initialisation
             ffts[fftSize] = new FFT(fftSize);
-            if (sizeof(process_t) == sizeof(double)) {
-                ffts[fftSize]->initDouble();
-            } else {
+            if (singlePrecision) {
                 ffts[fftSize]->initFloat();
+            } else {
+                ffts[fftSize]->initDouble();
             }
         }
 
         fft = ffts[fftSize];
 
         v_zero(fltbuf, maxSize);
-        v_zero(dblbuf, maxSize);
 
-        v_zero(mag, realSize);
-        v_zero(phase, realSize);
-        v_zero(prevPhase, realSize);
-        v_zero(prevError, realSize);
-        v_zero(unwrappedPhase, realSize);
+        if (singlePrecision) {
+            fspec.clear(realSize, maxSize);
+        } else {
+            dspec.clear(realSize, maxSize);
+        }
 
         return;
     }
@@ -167,26 +329,20 @@ RubberBandStretcher::Impl::ChannelData::setSizes(size_t windowSize,
     delete inbuf;
     inbuf = newbuf;
 
-    // We don't want to preserve data in these arrays
+    // The new arena is all zeros, and we don't want to preserve data
+    // in any of the arrays in it except the accumulators
 
-    mag = reallocate_and_zero(mag, oldReal, realSize);
-    phase = reallocate_and_zero(phase, oldReal, realSize);
-    prevPhase = reallocate_and_zero(prevPhase, oldReal, realSize);
-    prevError = reallocate_and_zero(prevError, oldReal, realSize);
-    unwrappedPhase = reallocate_and_zero(unwrappedPhase, oldReal, realSize);
-    envelope = reallocate_and_zero(envelope, oldReal, realSize);
-    fltbuf = reallocate_and_zero(fltbuf, oldMax, maxSize);
-    dblbuf = reallocate_and_zero(dblbuf, oldMax, maxSize);
-    ms = reallocate_and_zero(ms, oldMax, maxSize);
-    interpolator = reallocate_and_zero(interpolator, oldMax, maxSize);
+    char *oldArena = arena;
+    float *oldAccumulator = accumulator;
+    float *oldWindowAccumulator = windowAccumulator;
 
-    // But we do want to preserve data in these
+    allocateArena(realSize, maxSize);
+    capacity = maxSize;
 
-    accumulator = reallocate_and_zero_extension
-        (accumulator, oldMax, maxSize);
+    v_copy(accumulator, oldAccumulator, oldMax);
+    v_copy(windowAccumulator, oldWindowAccumulator, oldMax);
 
-    windowAccumulator = reallocate_and_zero_extension
-        (windowAccumulator, oldMax, maxSize);
+    deallocate(oldArena);
 
     interpolatorScale = 0;
 
@@ -194,16 +350,24 @@ RubberBandStretcher::Impl::ChannelData::setSizes(size_t windowSize,
 
     if (ffts.find(fftSize) == ffts.end()) {
         ffts[fftSize] = new FFT(fftSize);
-        if (sizeof(process_t) == sizeof(double)) {
-            ffts[fftSize]->initDouble();
-        } else {
+        if (singlePrecision) {
             ffts[fftSize]->initFloat();
+        } else {
+            ffts[fftSize]->initDouble();
         }
     }
 
     fft = ffts[fftSize];
 }
 
+bool
+RubberBandStretcher::Impl::ChannelData::isPrepared(size_t windowSize,
+                                                   size_t fftSize) const
+{
+    return (2 * std::max(windowSize, fftSize) <= capacity &&
+            ffts.find(fftSize) != ffts.end());
+}
+
 void
 RubberBandStretcher::Impl::ChannelData::setOutbufSize(size_t outbufSize)
 {
@@ -232,26 +396,19 @@ RubberBandStretcher::Impl::ChannelData::setResampleBufSize(size_t sz)
 RubberBandStretcher::Impl::ChannelData::~ChannelData()
 {
     delete resampler;
+    delete interpolatorCache;
 
     deallocate(resamplebuf);
 
     delete inbuf;
     delete outbuf;
 
-    deallocate(mag);
-    deallocate(phase);
-    deallocate(prevPhase);
-    deallocate(prevError);
-    deallocate(unwrappedPhase);
-    deallocate(envelope);
-    deallocate(interpolator);
-    deallocate(ms);
-    deallocate(accumulator);
-    deallocate(windowAccumulator);
-    deallocate(fltbuf);
-    deallocate(dblbuf);
-
-    for (std::map<size_t, FFT *>::iterator i = ffts.begin();
+    fspec.release();
+    dspec.release();
+
+    deallocate(arena);
+
+    for (FFTMap::iterator i = ffts.begin();
          i != ffts.end(); ++i) {
         delete i->second;
     }
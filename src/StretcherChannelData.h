@@ -35,7 +35,7 @@ namespace RubberBand
 
 class Resampler;
 
-class RubberBandStretcher::Impl::ChannelData
+class RubberBandStretcher::Impl::ChannelData : public Allocated
 {
 public:
     /**
@@ -54,7 +54,8 @@ public:
      */
     ChannelData(size_t windowSize,
                 size_t fftSize,
-                size_t outbufSize);
+                size_t outbufSize,
+                bool singlePrecision);
 
     /**
      * Construct a ChannelData structure that can process at different
@@ -66,11 +67,15 @@ public:
      * The outbufSize should be the maximum possible outbufSize to
      * avoid reallocation, which will happen if setOutbufSize is
      * called subsequently.
+     *
+     * If singlePrecision is true, the frequency-domain data is held
+     * and processed in floats, otherwise in doubles.
      */
     ChannelData(const std::set<size_t> &sizes,
                 size_t initialWindowSize,
                 size_t initialFftSize,
-                size_t outbufSize);
+                size_t outbufSize,
+                bool singlePrecision);
     ~ChannelData();
 
     /**
@@ -86,6 +91,12 @@ public:
      */
     void setSizes(size_t windowSize, size_t fftSizes);
 
+    /**
+     * Return true if setSizes can be called with the given window
+     * and FFT sizes without any allocation.
+     */
+    bool isPrepared(size_t windowSize, size_t fftSize) const;
+
     /**
      * Set the outbufSize for the channel data.  Reallocation will
      * occur.
@@ -98,15 +109,78 @@ public:
      */
     void setResampleBufSize(size_t resamplebufSize);
 
+    /**
+     * The frequency-domain data and FFT buffers for a channel, at a
+     * given sample precision.  Only one of fspec and dspec (below) is
+     * allocated, depending on the precision the ChannelData was
+     * constructed with; use spectrum<T>() to select it.
+     */
+    template <typename T>
+    struct Spectrum
+    {
+        Spectrum();
+
+        static size_t bytes(size_t realSize, size_t maxSize);
+        void assign(char *&arena, size_t realSize, size_t maxSize);
+        void clear(size_t realSize, size_t maxSize);
+        void release();
+
+        T *mag;
+        T *phase;
+
+        // The phase vocoder's per-bin state, which only modifyChunk
+        // uses.  Normally this is three arrays.  With
+        // USE_BLOCKED_PHASE_STATE defined it is one array of blocks
+        // of stateBlock bins, each block holding stateBlock prevPhase
+        // values followed by the same number of prevError and then
+        // unwrappedPhase values, so that the vocoder loop reads one
+        // stream of cache lines rather than three.  Use the accessors
+        // below, which hide the difference.
+
+#ifdef USE_BLOCKED_PHASE_STATE
+        enum { stateBlock = 8 };
+
+        T *state;
+
+        T &prevPhaseAt(int i) {
+            return state[stateIndex(i)];
+        }
+        T &prevErrorAt(int i) {
+            return state[stateIndex(i) + stateBlock];
+        }
+        T &unwrappedPhaseAt(int i) {
+            return state[stateIndex(i) + 2 * stateBlock];
+        }
+        static size_t stateIndex(int i) {
+            return (size_t(i) / stateBlock) * (3 * stateBlock) +
+                size_t(i) % stateBlock;
+        }
+#else
+        T *prevPhase;
+        T *prevError;
+        T *unwrappedPhase;
+
+        T &prevPhaseAt(int i) { return prevPhase[i]; }
+        T &prevErrorAt(int i) { return prevError[i]; }
+        T &unwrappedPhaseAt(int i) { return unwrappedPhase[i]; }
+#endif
+
+        T *dblbuf; // only used for time domain FFT i/o
+        T *envelope; // for cepstral formant shift
+        T *spare; // scratch, e.g. for formant shift and magnitude sums
+
+    private:
+        static size_t stateSize(size_t realSize);
+    };
+
+    template <typename T> Spectrum<T> &spectrum();
+
     RingBuffer<float> *inbuf;
     RingBuffer<float> *outbuf;
 
-    process_t *mag;
-    process_t *phase;
-
-    process_t *prevPhase;
-    process_t *prevError;
-    process_t *unwrappedPhase;
+    bool singlePrecision;
+    Spectrum<float> fspec;
+    Spectrum<double> dspec;
 
     float *accumulator;
     size_t accumulatorFill;
@@ -114,10 +188,10 @@ public:
     float *ms; // only used when mid-side processing
     float *interpolator; // only used when time-domain smoothing is on
     int interpolatorScale;
+    SincWindowCache<float> *interpolatorCache; // likewise; see Impl
 
     float *fltbuf;
-    process_t *dblbuf; // owned by FFT object, only used for time domain FFT i/o
-    process_t *envelope; // for cepstral formant shift
+    float *fltspare; // copy of fltbuf, for overlong increments
     bool unchanged;
 
     size_t prevIncrement; // only used in RT mode
@@ -131,18 +205,45 @@ public:
     bool outputComplete;
 
     FFT *fft;
-    std::map<size_t, FFT *> ffts;
+    typedef std::map<size_t, FFT *, std::less<size_t>,
+                     StlAllocator<std::pair<const size_t, FFT *> > > FFTMap;
+    FFTMap ffts;
 
     Resampler *resampler;
     float *resamplebuf;
     size_t resamplebufSize;
 
+    // Only set on the slots of a SegmentTask, while it records
+    // its overlap with the previous segment
+    SegmentOverlap *segmentOverlap;
+
 private:
     void construct(const std::set<size_t> &sizes,
                    size_t initialWindowSize, size_t initialFftSize,
                    size_t outbufSize);
+
+    // Allocate a single zeroed block holding the spectrum arrays and
+    // the float buffers for the given sizes, and point them into it.
+    // Each buffer starts on a 64-byte boundary
+    void allocateArena(size_t realSize, size_t maxSize);
+    char *arena;
+    size_t capacity; // largest maxSize setSizes can take without allocating
 };
 
+template <>
+inline RubberBandStretcher::Impl::ChannelData::Spectrum<float> &
+RubberBandStretcher::Impl::ChannelData::spectrum<float>()
+{
+    return fspec;
+}
+
+template <>
+inline RubberBandStretcher::Impl::ChannelData::Spectrum<double> &
+RubberBandStretcher::Impl::ChannelData::spectrum<double>()
+{
+    return dspec;
+}
+
 }
 
 #endif
@@ -31,6 +31,7 @@
 #include "audiocurves/CompoundAudioCurve.h"
 
 #include "dsp/Resampler.h"
+#include "dsp/WindowCache.h"
 
 #include "StretchCalculator.h"
 #include "StretcherChannelData.h"
@@ -43,6 +44,7 @@
 #include <cmath>
 #include <set>
 #include <map>
+#include <algorithm>
 
 using namespace RubberBand;
 
@@ -62,16 +64,24 @@ RubberBandStretcher::Impl::m_defaultIncrement = 256;
 const size_t
 RubberBandStretcher::Impl::m_defaultFftSize = 2048;
 
+const int
+RubberBandStretcher::Impl::m_interpolatorCacheCapacity = 16;
+
 int
 RubberBandStretcher::Impl::m_defaultDebugLevel = 0;
 
+std::atomic<bool>
+RubberBandStretcher::Impl::m_verifyThreading(false);
+
 static bool _initialised = false;
 
 RubberBandStretcher::Impl::Impl(size_t sampleRate,
                                 size_t channels,
                                 Options options,
                                 double initialTimeRatio,
-                                double initialPitchScale) :
+                                double initialPitchScale,
+                                const AllocatorHooks *allocator,
+                                const RatioRanges *ranges) :
     m_sampleRate(sampleRate),
     m_channels(channels),
     m_timeRatio(initialTimeRatio),
@@ -81,24 +91,57 @@ RubberBandStretcher::Impl::Impl(size_t sampleRate,
     m_sWindowSize(m_defaultFftSize),
     m_increment(m_defaultIncrement),
     m_outbufSize(m_defaultFftSize * 2),
+    m_outbufLimit(0),
+    m_processWaiting(false),
+    m_outputThrottled(false),
     m_maxProcessSize(m_defaultFftSize),
     m_expectedInputDuration(0),
+    m_ratioRangesSet(false),
+    m_minTimeRatio(initialTimeRatio),
+    m_maxTimeRatio(initialTimeRatio),
+    m_minPitchScale(initialPitchScale),
+    m_maxPitchScale(initialPitchScale),
+    m_rangeOutbufSize(0),
+    m_rangeResamplebufSize(0),
+    m_rtWarnings(0),
     m_threaded(false),
     m_realtime(false),
+    m_singlePrecision(sizeof(process_t) == sizeof(float)),
     m_options(options),
     m_debugLevel(m_defaultDebugLevel),
+    m_allocator(0),
     m_mode(JustCreated),
     m_awindow(0),
     m_afilter(0),
     m_swindow(0),
     m_studyFFT(0),
     m_spaceAvailable("space"),
+    m_spaceAvailableCount(0),
+    m_notificationCallback(0),
+    m_notificationData(0),
+    m_inputCallback(0),
+    m_inputCallbackData(0),
+    m_pullBuffer(0),
+    m_pullBufferSize(0),
+    m_threadPool(0),
+    m_ownThreadPool(0),
+    m_pipelined(false),
+    m_segmented(false),
+    m_segmentFallbackThreaded(false),
+    m_nextSegment(0),
+    m_segmentInputBase(0),
+    m_rtPhaseIncrement(0),
+    m_rtShiftIncrement(0),
+    m_rtPhaseReset(false),
     m_inputDuration(0),
     m_detectorType(CompoundAudioCurve::CompoundDetector),
     m_silentHistory(0),
     m_lastProcessOutputIncrements(16),
     m_lastProcessPhaseResetDf(16),
-    m_emergencyScavenger(10, 4),
+    m_emergencyScavenger(16),
+    m_verifier(0),
+    m_verifiedCount(0),
+    m_verifyBuffer(0),
     m_phaseResetAudioCurve(0),
     m_stretchAudioCurve(0),
     m_silentAudioCurve(0),
@@ -108,6 +151,11 @@ RubberBandStretcher::Impl::Impl(size_t sampleRate,
     m_freq2(12000),
     m_baseFftSize(m_defaultFftSize)
 {
+    if (allocator) {
+        m_allocatorHooks = *allocator;
+        m_allocator = &m_allocatorHooks;
+    }
+
     if (!_initialised) {
         system_specific_initialise();
         _initialised = true;
@@ -153,6 +201,41 @@ RubberBandStretcher::Impl::Impl(size_t sampleRate,
         }
     }
 
+    if (m_options & OptionPrecisionSingle) {
+        m_singlePrecision = true;
+    }
+
+    if (m_singlePrecision && m_debugLevel > 0) {
+        cerr << "Using single-precision processing" << endl;
+    }
+
+    if (!m_realtime) {
+        bool compact = (m_options & OptionStudyCompact);
+        bool fileBacked = (m_options & OptionStudyFileBacked);
+        m_phaseResetDf.setStorage(compact, fileBacked);
+        m_stretchDf.setStorage(compact, fileBacked);
+        m_silence.setFileBacked(fileBacked);
+    }
+
+    if (!m_realtime &&
+        (m_options & OptionThreadingSegmented) &&
+        !(m_options & OptionThreadingNever) &&
+        ((m_options & OptionThreadingAlways) || system_is_multiprocessor())) {
+
+        if ((m_options & OptionTransientsMixed) ||
+            (m_options & OptionPitchHighConsistency)) {
+            if (m_debugLevel > 0) {
+                cerr << "Segmented processing unavailable with these options" << endl;
+            }
+        } else {
+            m_segmented = true;
+        }
+    }
+
+    // With segmented processing, this is still set up as the fallback
+    // for when segments turn out not to be usable, which is only
+    // known once study() is done (see prepareSegments)
+
     if (m_channels > 1) {
 
         m_threaded = true;
@@ -166,16 +249,132 @@ RubberBandStretcher::Impl::Impl(size_t sampleRate,
             m_threaded = false;
         }
 
+        if (m_threaded && (m_options & OptionThreadingShared)) {
+            m_threadPool = ThreadPool::getShared();
+        } else if (m_threaded) {
+            // Rather than a thread per channel, use a pool of one
+            // thread per processor when there are more channels than
+            // that, so as to bound the thread count and balance the
+            // work across the threads we do have
+            size_t processors = system_get_processor_count();
+            if (processors < 2) processors = 2;
+            if (m_channels > processors) {
+                m_ownThreadPool = new ThreadPool(int(processors));
+                m_threadPool = m_ownThreadPool;
+            }
+        }
+
         if (m_threaded && m_debugLevel > 0) {
-            cerr << "Going multithreaded..." << endl;
+            if (m_ownThreadPool) {
+                cerr << "Going multithreaded (pool of " << m_threadPool->getThreadCount() << " threads for " << m_channels << " channels)..." << endl;
+            } else if (m_threadPool) {
+                cerr << "Going multithreaded (shared pool of " << m_threadPool->getThreadCount() << " threads)..." << endl;
+            } else {
+                cerr << "Going multithreaded..." << endl;
+            }
+        }
+    }
+
+    if (m_segmented) {
+
+        // Segments go on the pool the channels would have used, if
+        // any, otherwise on the shared one
+
+        if (!m_threadPool) m_threadPool = ThreadPool::getShared();
+        m_segmentFallbackThreaded = m_threaded;
+
+        if (m_debugLevel > 0) {
+            cerr << "Segmented processing requested (pool of " << m_threadPool->getThreadCount() << " threads)..." << endl;
+        }
+    }
+
+    if (!m_realtime && !m_threaded && !m_segmented &&
+        (m_options & OptionThreadingPipelined) &&
+        !(m_options & OptionThreadingNever) &&
+        ((m_options & OptionThreadingAlways) || system_is_multiprocessor())) {
+
+        m_pipelined = true;
+
+        if (m_debugLevel > 0) {
+            cerr << "Going multithreaded with pipelined analysis..." << endl;
+        }
+    }
+
+    if (ranges) {
+        // Declared up front, so that configure() allocates for the
+        // ranges straight away (compare setRatioRanges)
+        if (!m_realtime) {
+            if (m_debugLevel > 0) {
+                cerr << "RubberBandStretcher::Impl::Impl: Ratio ranges are not used in non-RT mode" << endl;
+            }
+        } else {
+            applyRatioRanges(ranges->minTimeRatio, ranges->maxTimeRatio,
+                             ranges->minPitchScale, ranges->maxPitchScale);
         }
     }
 
     configure();
+
+    if (m_realtime && m_channels > 1 &&
+        (m_options & OptionThreadingRealTime) &&
+        !(m_options & OptionThreadingNever) &&
+        ((m_options & OptionThreadingAlways) || system_is_multiprocessor())) {
+
+        // The calling thread handles one share of the channels
+        // itself, so we need one worker fewer than there are shares
+
+        size_t parts = std::min(m_channels,
+                                size_t(system_get_processor_count()));
+        if (parts < 2) parts = 2;
+
+        for (size_t i = 1; i < parts; ++i) {
+            RealTimeWorker *worker = new RealTimeWorker(this, i);
+            m_rtWorkers.push_back(worker);
+            worker->start();
+        }
+
+        if (m_debugLevel > 0) {
+            cerr << "Going multithreaded in real-time mode ("
+                 << m_rtWorkers.size() << " workers)..." << endl;
+        }
+    }
+
+    if (m_verifyThreading && !(m_options & OptionThreadingNever)) {
+        Options serial = m_options &
+            ~(OptionThreadingAlways | OptionThreadingShared |
+              OptionThreadingRealTime | OptionThreadingPipelined |
+              OptionThreadingSegmented);
+        m_verifier = new Impl(sampleRate, channels,
+                              serial | OptionThreadingNever,
+                              initialTimeRatio, initialPitchScale,
+                              m_allocator, ranges);
+        m_verifyBuffer = allocate_channels<float>(m_channels,
+                                                  m_verifyBufferSize);
+        if (m_debugLevel > 0) {
+            cerr << "Verifying output against a single-threaded stretcher" << endl;
+        }
+    }
 }
 
 RubberBandStretcher::Impl::~Impl()
 {
+    delete m_verifier;
+    if (m_verifyBuffer) deallocate_channels(m_verifyBuffer, m_channels);
+
+    clearSegments();
+
+    for (size_t c = 0; c < m_analysisThreads.size(); ++c) {
+        m_analysisThreads[c]->abandon();
+        m_analysisThreads[c]->wait();
+        delete m_analysisThreads[c];
+    }
+
+    for (size_t i = 0; i < m_rtWorkers.size(); ++i) {
+        m_rtWorkers[i]->abandon();
+        m_rtWorkers[i]->wait();
+        delete m_rtWorkers[i];
+    }
+
     if (m_threaded) {
         MutexLocker locker(&m_threadSetMutex);
         for (set<ProcessThread *>::iterator i = m_threadSet.begin();
@@ -187,9 +386,27 @@ RubberBandStretcher::Impl::~Impl()
             (*i)->wait();
             delete *i;
         }
+        for (TaskList::iterator i = m_taskList.begin();
+             i != m_taskList.end(); ++i) {
+            m_threadPool->cancel(*i);
+            delete *i;
+        }
     }
 
+    if (m_ownThreadPool) {
+        if (m_debugLevel > 0) {
+            cerr << "RubberBandStretcher::~RubberBandStretcher: pool steals = " << m_ownThreadPool->getStealCount() << endl;
+        }
+        delete m_ownThreadPool;
+    }
+
+    if (m_pullBuffer) deallocate_channels(m_pullBuffer, m_channels);
+
     for (size_t c = 0; c < m_channels; ++c) {
+        SincWindowCache<float> *cache = m_channelData[c]->interpolatorCache;
+        if (cache && m_debugLevel > 0) {
+            cerr << "RubberBandStretcher::~RubberBandStretcher: channel " << c << " interpolator cache hits = " << cache->getHitCount() << ", misses = " << cache->getMissCount() << endl;
+        }
         delete m_channelData[c];
     }
 
@@ -199,19 +416,23 @@ RubberBandStretcher::Impl::~Impl()
     delete m_stretchCalculator;
     delete m_studyFFT;
 
-    for (map<size_t, Window<float> *>::iterator i = m_windows.begin();
+    releaseInterpolators();
+
+    for (WindowMap::iterator i = m_windows.begin();
          i != m_windows.end(); ++i) {
-        delete i->second;
+        WindowCache::release(i->second);
     }
-    for (map<size_t, SincWindow<float> *>::iterator i = m_sincs.begin();
+    for (SincWindowMap::iterator i = m_sincs.begin();
          i != m_sincs.end(); ++i) {
-        delete i->second;
+        WindowCache::release(i->second);
     }
 }
 
 void
 RubberBandStretcher::Impl::reset()
 {
+    if (m_verifier) m_verifier->reset();
+
     if (m_threaded) {
         m_threadSetMutex.lock();
         for (set<ProcessThread *>::iterator i = m_threadSet.begin();
@@ -224,9 +445,25 @@ RubberBandStretcher::Impl::reset()
             delete *i;
         }
         m_threadSet.clear();
+        for (TaskList::iterator i = m_taskList.begin();
+             i != m_taskList.end(); ++i) {
+            m_threadPool->cancel(*i);
+            delete *i;
+        }
+        m_taskList.clear();
     }
 
-    m_emergencyScavenger.scavenge();
+    for (size_t c = 0; c < m_analysisThreads.size(); ++c) {
+        m_analysisThreads[c]->abandon();
+        m_analysisThreads[c]->wait();
+        delete m_analysisThreads[c];
+    }
+    m_analysisThreads.clear();
+
+    clearSegments();
+
+    // Nothing else is running now, so everything can go
+    m_emergencyScavenger.scavenge(true);
 
     if (m_stretchCalculator) {
         m_stretchCalculator->setKeyFrameMap(std::map<size_t, size_t>());
@@ -245,12 +482,17 @@ RubberBandStretcher::Impl::reset()
 
     if (m_threaded) m_threadSetMutex.unlock();
 
+    // The next pass may or may not be segmented again
+    if (m_segmented) m_threaded = m_segmentFallbackThreaded;
+
     reconfigure();
 }
 
 void
 RubberBandStretcher::Impl::setTimeRatio(double ratio)
 {
+    if (m_verifier) m_verifier->setTimeRatio(ratio);
+
     if (!m_realtime) {
         if (m_mode == Studying || m_mode == Processing) {
             cerr << "RubberBandStretcher::Impl::setTimeRatio: Cannot set ratio while studying or processing in non-RT mode" << endl;
@@ -261,12 +503,17 @@ RubberBandStretcher::Impl::setTimeRatio(double ratio)
     if (ratio == m_timeRatio) return;
     m_timeRatio = ratio;
 
+    NoAllocationScope guard(m_realtime && m_mode != JustCreated &&
+                            !m_verifier);
+
     reconfigure();
 }
 
 void
 RubberBandStretcher::Impl::setPitchScale(double fs)
 {
+    if (m_verifier) m_verifier->setPitchScale(fs);
+
     if (!m_realtime) {
         if (m_mode == Studying || m_mode == Processing) {
             cerr << "RubberBandStretcher::Impl::setPitchScale: Cannot set ratio while studying or processing in non-RT mode" << endl;
@@ -276,6 +523,18 @@ RubberBandStretcher::Impl::setPitchScale(double fs)
 
     if (fs == m_pitchScale) return;
 
+    bool started = (m_realtime && m_mode != JustCreated);
+
+    if (started && fs != 1.0 && !m_channelData[0]->resampler) {
+        m_rtWarnings |= RealTimeWarningPitchScaleRejected;
+        if (m_debugLevel > 0) {
+            cerr << "RubberBandStretcher::Impl::setPitchScale: WARNING: Cannot change pitch in RT mode after process() has begun, as no resamplers were created (the pitch scale range declared with setRatioRanges excludes pitch changes)" << endl;
+        }
+        return;
+    }
+
+    NoAllocationScope guard(started && !m_verifier);
+
     bool was1 = (m_pitchScale == 1.f);
     bool rbs = resampleBeforeStretching();
 
@@ -311,25 +570,123 @@ RubberBandStretcher::Impl::getPitchScale() const
 void
 RubberBandStretcher::Impl::setExpectedInputDuration(size_t samples)
 {
+    if (m_verifier) m_verifier->setExpectedInputDuration(samples);
+
     if (samples == m_expectedInputDuration) return;
     m_expectedInputDuration = samples;
 
     reconfigure();
+    reserveStudyCurves();
+}
+
+void
+RubberBandStretcher::Impl::reserveStudyCurves()
+{
+    // One value per increment, plus one for the half-window of
+    // padding at the start and one for the final partial increment
+    if (m_realtime || m_expectedInputDuration == 0) return;
+    size_t n = m_expectedInputDuration / m_increment + 2;
+    m_phaseResetDf.reserve(n);
+    m_stretchDf.reserve(n);
+    m_silence.reserve(n);
 }
 
 void
 RubberBandStretcher::Impl::setMaxProcessSize(size_t samples)
 {
+    if (m_verifier) m_verifier->setMaxProcessSize(samples);
+
     if (samples <= m_maxProcessSize) return;
     m_maxProcessSize = samples;
 
+    // The range sizes depend on the process size too
+    if (m_ratioRangesSet) calculateRangeSizes();
+
     reconfigure();
 }
 
+void
+RubberBandStretcher::Impl::setRatioRanges(double minTimeRatio,
+                                          double maxTimeRatio,
+                                          double minPitchScale,
+                                          double maxPitchScale)
+{
+    if (m_verifier) {
+        m_verifier->setRatioRanges(minTimeRatio, maxTimeRatio,
+                                   minPitchScale, maxPitchScale);
+    }
+
+    if (!m_realtime) {
+        cerr << "RubberBandStretcher::Impl::setRatioRanges: Ratio ranges are not used in non-RT mode" << endl;
+        return;
+    }
+    if (m_mode != JustCreated) {
+        cerr << "RubberBandStretcher::Impl::setRatioRanges: Cannot set ratio ranges after process() has begun" << endl;
+        return;
+    }
+    if (!applyRatioRanges(minTimeRatio, maxTimeRatio,
+                          minPitchScale, maxPitchScale)) {
+        return;
+    }
+
+    // Nothing has been processed yet, so we can throw away what was
+    // allocated for the default set of sizes and configure afresh.
+    // With no windows, configure() treats every size as changed
+
+    for (WindowMap::iterator i = m_windows.begin();
+         i != m_windows.end(); ++i) {
+        WindowCache::release(i->second);
+    }
+    for (SincWindowMap::iterator i = m_sincs.begin();
+         i != m_sincs.end(); ++i) {
+        WindowCache::release(i->second);
+    }
+    m_windows.clear();
+    m_sincs.clear();
+    m_awindow = 0;
+    m_afilter = 0;
+    m_swindow = 0;
+
+    configure();
+}
+
+int
+RubberBandStretcher::Impl::getRealTimeWarnings()
+{
+    return m_rtWarnings.exchange(0);
+}
+
+bool
+RubberBandStretcher::Impl::applyRatioRanges(double minTimeRatio,
+                                            double maxTimeRatio,
+                                            double minPitchScale,
+                                            double maxPitchScale)
+{
+    // Record the ranges and the sizes they need, for the next
+    // configure() to allocate.  Return false if they are invalid
+
+    if (minTimeRatio <= 0.0 || maxTimeRatio < minTimeRatio ||
+        minPitchScale <= 0.0 || maxPitchScale < minPitchScale) {
+        cerr << "RubberBandStretcher::Impl::setRatioRanges: WARNING: Invalid ranges (time ratio " << minTimeRatio << " to " << maxTimeRatio << ", pitch scale " << minPitchScale << " to " << maxPitchScale << "), ignoring them" << endl;
+        return false;
+    }
+
+    m_ratioRangesSet = true;
+    m_minTimeRatio = std::min(minTimeRatio, m_timeRatio);
+    m_maxTimeRatio = std::max(maxTimeRatio, m_timeRatio);
+    m_minPitchScale = std::min(minPitchScale, m_pitchScale);
+    m_maxPitchScale = std::max(maxPitchScale, m_pitchScale);
+
+    calculateRangeSizes();
+    return true;
+}
+
 void
 RubberBandStretcher::Impl::setKeyFrameMap(const std::map<size_t, size_t> &
                                           mapping)
 {
+    if (m_verifier) m_verifier->setKeyFrameMap(mapping);
+
     if (m_realtime) {
         cerr << "RubberBandStretcher::Impl::setKeyFrameMap: Cannot specify key frame map in RT mode" << endl;
         return;
@@ -358,6 +715,8 @@ RubberBandStretcher::Impl::getFrequencyCutoff(int n) const
 void
 RubberBandStretcher::Impl::setFrequencyCutoff(int n, float f)
 {
+    if (m_verifier) m_verifier->setFrequencyCutoff(n, f);
+
     switch (n) {
     case 0: m_freq0 = f; break;
     case 1: m_freq1 = f; break;
@@ -537,25 +896,135 @@ RubberBandStretcher::Impl::calculateSizes()
               (m_maxProcessSize / m_pitchScale,
                m_maxProcessSize * 2 * (m_timeRatio > 1.f ? m_timeRatio : 1.f))));
 
+    m_outbufLimit = 0;
+
     if (m_realtime) {
-        // This headroom is so as to try to avoid reallocation when
-        // the pitch scale changes
-        m_outbufSize = m_outbufSize * 16;
+        if (m_ratioRangesSet) {
+            // Sized for the whole of the declared ranges already
+            if (m_outbufSize < m_rangeOutbufSize) {
+                m_outbufSize = m_rangeOutbufSize;
+            }
+        } else {
+            // This headroom is so as to try to avoid reallocation when
+            // the pitch scale changes
+            m_outbufSize = m_outbufSize * 16;
+        }
     } else {
         if (m_threaded) {
-            // This headroom is to permit the processing threads to
-            // run ahead of the buffer output drainage; the exact
-            // amount of headroom is a question of tuning rather than
-            // results
-            m_outbufSize = m_outbufSize * 16;
+            // The processing threads may run ahead of the buffer
+            // output drainage.  Rather than allocate headroom for
+            // that up front, let the buffers grow to follow the
+            // actual backlog, up to a limit; the exact limit is a
+            // question of tuning rather than results
+            m_outbufLimit = m_outbufSize * 16;
         }
     }
 
     if (m_debugLevel > 0) {
-        cerr << "configure: outbuf size = " << m_outbufSize << endl;
+        cerr << "configure: outbuf size = " << m_outbufSize;
+        if (m_outbufLimit > 0) cerr << ", limit = " << m_outbufLimit;
+        cerr << endl;
     }
 }
 
+void
+RubberBandStretcher::Impl::calculateRangeSizes()
+{
+    // Find the sizes that calculateSizes() would choose anywhere in
+    // the declared ranges.  The window size changes monotonically
+    // with the effective ratio either side of 1, so we try the
+    // corners of the ranges and the points at which the effective
+    // ratio is exactly 1, and then fill in any power-of-two sizes
+    // between the smallest and largest found
+
+    double timeRatio = m_timeRatio;
+    double pitchScale = m_pitchScale;
+    size_t fftSize = m_fftSize;
+    size_t aWindowSize = m_aWindowSize;
+    size_t sWindowSize = m_sWindowSize;
+    size_t increment = m_increment;
+    size_t outbufSize = m_outbufSize;
+    size_t outbufLimit = m_outbufLimit;
+    size_t maxProcessSize = m_maxProcessSize;
+    int debugLevel = m_debugLevel;
+
+    m_debugLevel = 0;
+    m_rangeWindowSizes.clear();
+    m_rangeOutbufSize = 0;
+    m_rangeResamplebufSize = 0;
+
+    vector<std::pair<double, double> > points;
+    double pitches[] = { m_minPitchScale, m_maxPitchScale, 1.0 };
+    for (int i = 0; i < 3; ++i) {
+        double p = pitches[i];
+        if (p < m_minPitchScale || p > m_maxPitchScale) continue;
+        double times[] = { m_minTimeRatio, m_maxTimeRatio, 1.0 / p };
+        for (int j = 0; j < 3; ++j) {
+            double t = times[j];
+            if (t < m_minTimeRatio || t > m_maxTimeRatio) continue;
+            points.push_back(std::pair<double, double>(t, p));
+        }
+    }
+
+    size_t outbuf = 0;
+    size_t minSize = 0, maxSize = 0;
+
+    for (size_t i = 0; i < points.size(); ++i) {
+
+        m_timeRatio = points[i].first;
+        m_pitchScale = points[i].second;
+        calculateSizes();
+
+        size_t sizes[] = { m_fftSize, m_aWindowSize, m_sWindowSize };
+        for (int j = 0; j < 3; ++j) {
+            m_rangeWindowSizes.insert(sizes[j]);
+            if (minSize == 0 || sizes[j] < minSize) minSize = sizes[j];
+            if (sizes[j] > maxSize) maxSize = sizes[j];
+        }
+
+        if (m_outbufSize > outbuf) outbuf = m_outbufSize;
+
+        size_t rbs =
+            lrintf(ceil((m_increment * m_timeRatio * 2) / m_pitchScale));
+        if (rbs < m_increment * 16) rbs = m_increment * 16;
+        if (rbs > m_rangeResamplebufSize) m_rangeResamplebufSize = rbs;
+    }
+
+    for (size_t sz = minSize; sz > 0 && sz < maxSize; sz *= 2) {
+        m_rangeWindowSizes.insert(sz);
+    }
+
+    // On top of what calculateSizes() wants anywhere in the ranges,
+    // allow for the output of two process() blocks at the largest
+    // time ratio: the one being processed, and the previous one in
+    // case it has not been retrieved yet.  This is what the default
+    // 16x headroom would otherwise have covered.  A block is at most
+    // m_maxProcessSize, or the window size if the caller is following
+    // getSamplesRequired()
+    size_t block = std::max(maxProcessSize, maxSize);
+    m_rangeOutbufSize = outbuf + 2 * size_t(ceil(block * m_maxTimeRatio));
+
+    if (debugLevel > 0) {
+        cerr << "calculateRangeSizes: time ratio " << m_minTimeRatio << " to " << m_maxTimeRatio << ", pitch scale " << m_minPitchScale << " to " << m_maxPitchScale << ": window sizes";
+        for (set<size_t>::const_iterator i = m_rangeWindowSizes.begin();
+             i != m_rangeWindowSizes.end(); ++i) {
+            cerr << " " << *i;
+        }
+        cerr << ", outbuf size = " << m_rangeOutbufSize << ", resample buffer size = " << m_rangeResamplebufSize << endl;
+    }
+
+    m_timeRatio = timeRatio;
+    m_pitchScale = pitchScale;
+    m_fftSize = fftSize;
+    m_aWindowSize = aWindowSize;
+    m_sWindowSize = sWindowSize;
+    m_increment = increment;
+    m_outbufSize = outbufSize;
+    m_outbufLimit = outbufLimit;
+    m_maxProcessSize = maxProcessSize;
+    m_debugLevel = debugLevel;
+}
+
 void
 RubberBandStretcher::Impl::configure()
 {
@@ -590,10 +1059,19 @@ RubberBandStretcher::Impl::configure()
 
     set<size_t> windowSizes;
     if (m_realtime) {
-        windowSizes.insert(m_baseFftSize);
-        windowSizes.insert(m_baseFftSize / 2);
-        windowSizes.insert(m_baseFftSize * 2);
-//        windowSizes.insert(m_baseFftSize * 4);
+        if (m_ratioRangesSet) {
+            windowSizes = m_rangeWindowSizes;
+        } else {
+            windowSizes.insert(m_baseFftSize);
+            windowSizes.insert(m_baseFftSize / 2);
+            windowSizes.insert(m_baseFftSize * 2);
+//            windowSizes.insert(m_baseFftSize * 4);
+            if (m_options & OptionSmoothingOn) {
+                // Analysis and synthesis windows are twice the FFT size
+                windowSizes.insert(m_baseFftSize);
+                windowSizes.insert(m_baseFftSize * 4);
+            }
+        }
     }
     windowSizes.insert(m_fftSize);
     windowSizes.insert(m_aWindowSize);
@@ -604,10 +1082,10 @@ RubberBandStretcher::Impl::configure()
         for (set<size_t>::const_iterator i = windowSizes.begin();
              i != windowSizes.end(); ++i) {
             if (m_windows.find(*i) == m_windows.end()) {
-                m_windows[*i] = new Window<float>(HanningWindow, *i);
+                m_windows[*i] = WindowCache::getWindow(HanningWindow, *i);
             }
             if (m_sincs.find(*i) == m_sincs.end()) {
-                m_sincs[*i] = new SincWindow<float>(*i, *i);
+                m_sincs[*i] = WindowCache::getSincWindow(*i, *i);
             }
         }
         m_awindow = m_windows[m_aWindowSize];
@@ -631,7 +1109,10 @@ RubberBandStretcher::Impl::configure()
                 (new ChannelData(windowSizes,
                                  std::max(m_aWindowSize, m_sWindowSize),
                                  m_fftSize,
-                                 m_outbufSize));
+                                 m_outbufSize,
+                                 m_singlePrecision));
+            // windowSizes is ordered, so the last is the largest
+            createInterpolatorCache(*m_channelData[c], *windowSizes.rbegin());
         }
     }
 
@@ -641,9 +1122,16 @@ RubberBandStretcher::Impl::configure()
         m_studyFFT->initFloat();
     }
 
+    // In RT mode the pitch scale may change later, so we want
+    // resamplers ready unless we have been told it won't
+    bool rtPitchMayChange =
+        (m_realtime &&
+         (!m_ratioRangesSet ||
+          m_minPitchScale != 1.0 || m_maxPitchScale != 1.0));
+
     if (m_pitchScale != 1.0 ||
         (m_options & OptionPitchHighConsistency) ||
-        m_realtime) {
+        rtPitchMayChange) {
 
         for (size_t c = 0; c < m_channels; ++c) {
 
@@ -659,7 +1147,23 @@ RubberBandStretcher::Impl::configure()
             size_t rbs =
                 lrintf(ceil((m_increment * m_timeRatio * 2) / m_pitchScale));
             if (rbs < m_increment * 16) rbs = m_increment * 16;
+            if (rbs < m_rangeResamplebufSize) rbs = m_rangeResamplebufSize;
             m_channelData[c]->setResampleBufSize(rbs);
+
+            // Have the resampler allocate up front for any ratio it
+            // may be used at, so that a later pitch change does not
+            // make it allocate during processing
+            if (m_realtime) {
+                double minPitch = 1.0 / 16.0, maxPitch = 16.0;
+                if (m_ratioRangesSet) {
+                    minPitch = m_minPitchScale;
+                    maxPitch = m_maxPitchScale;
+                }
+                minPitch = std::min(minPitch, m_pitchScale);
+                maxPitch = std::max(maxPitch, m_pitchScale);
+                m_channelData[c]->resampler->prepare
+                    (float(1.0 / maxPitch), float(1.0 / minPitch));
+            }
         }
     }
 
@@ -667,9 +1171,21 @@ RubberBandStretcher::Impl::configure()
     // silentAudioCurve and stretchCalculator however are used in all
     // modes
 
+    // In RT mode, reconfigure() may later change the FFT size to any
+    // of the window sizes.  Construct the curve for the largest of
+    // them, so that it can do so without allocating
+
+    size_t curveSize = m_fftSize;
+    if (m_realtime && *windowSizes.rbegin() > curveSize) {
+        curveSize = *windowSizes.rbegin();
+    }
+
     delete m_phaseResetAudioCurve;
     m_phaseResetAudioCurve = new CompoundAudioCurve
-        (CompoundAudioCurve::Parameters(m_sampleRate, m_fftSize));
+        (CompoundAudioCurve::Parameters(m_sampleRate, curveSize));
+    if (curveSize != m_fftSize) {
+        m_phaseResetAudioCurve->setFftSize(m_fftSize);
+    }
     m_phaseResetAudioCurve->setType(m_detectorType);
 
     delete m_silentAudioCurve;
@@ -741,29 +1257,43 @@ RubberBandStretcher::Impl::reconfigure()
 
     calculateSizes();
 
-    // There are various allocations in this function, but they should
-    // never happen in normal use -- they just recover from the case
-    // where not all of the things we need were correctly created when
-    // we first configured (for whatever reason).  This is intended to
-    // be "effectively" realtime safe.  The same goes for
-    // ChannelData::setOutbufSize and setSizes.
+    // Once processing has begun in RT mode, nothing here may
+    // allocate: if the new sizes were not prepared for when we were
+    // configured, we make do with the nearest ones that were.
+    // Before that, the allocations below just recover from the case
+    // where not all of the things we need were created when we first
+    // configured, and are harmless.
+
+    bool started = (m_realtime && m_mode != JustCreated);
+
+    if (started) {
+        choosePreparedSizes();
+        if (m_outbufSize > prevOutbufSize) {
+            // This is only the generous size calculateSizes() would
+            // like; process() grows the buffers if a block needs it
+            if (m_debugLevel > 0) {
+                std::cerr << "reconfigure(): output buffer size " << m_outbufSize << " exceeds the " << prevOutbufSize << " prepared for in RT mode, keeping the latter" << std::endl;
+            }
+            m_outbufSize = prevOutbufSize;
+        }
+    }
 
     if (m_aWindowSize != prevAWindowSize ||
         m_sWindowSize != prevSWindowSize) {
 
         if (m_windows.find(m_aWindowSize) == m_windows.end()) {
             std::cerr << "WARNING: reconfigure(): window allocation (size " << m_aWindowSize << ") required in RT mode" << std::endl;
-            m_windows[m_aWindowSize] = new Window<float>
+            m_windows[m_aWindowSize] = WindowCache::getWindow
                 (HanningWindow, m_aWindowSize);
-            m_sincs[m_aWindowSize] = new SincWindow<float>
+            m_sincs[m_aWindowSize] = WindowCache::getSincWindow
                 (m_aWindowSize, m_aWindowSize);
         }
 
         if (m_windows.find(m_sWindowSize) == m_windows.end()) {
             std::cerr << "WARNING: reconfigure(): window allocation (size " << m_sWindowSize << ") required in RT mode" << std::endl;
-            m_windows[m_sWindowSize] = new Window<float>
+            m_windows[m_sWindowSize] = WindowCache::getWindow
                 (HanningWindow, m_sWindowSize);
-            m_sincs[m_sWindowSize] = new SincWindow<float>
+            m_sincs[m_sWindowSize] = WindowCache::getSincWindow
                 (m_sWindowSize, m_sWindowSize);
         }
 
@@ -783,7 +1313,7 @@ RubberBandStretcher::Impl::reconfigure()
         }
     }
 
-    if (m_pitchScale != 1.0) {
+    if (m_pitchScale != 1.0 && !started) {
         for (size_t c = 0; c < m_channels; ++c) {
 
             if (m_channelData[c]->resampler) continue;
@@ -806,6 +1336,68 @@ RubberBandStretcher::Impl::reconfigure()
     }
 }
 
+void
+RubberBandStretcher::Impl::choosePreparedSizes()
+{
+    // Called from reconfigure() in RT mode after processing has
+    // begun, with the sizes calculateSizes() would like.  If we have
+    // windows, FFTs and buffers for those, keep them; otherwise pick
+    // the prepared FFT size nearest to the wanted one, and scale the
+    // window sizes and increment to match
+
+    ChannelData &cd = *m_channelData[0];
+
+    if (m_windows.find(m_aWindowSize) != m_windows.end() &&
+        m_windows.find(m_sWindowSize) != m_windows.end() &&
+        cd.isPrepared(std::max(m_aWindowSize, m_sWindowSize), m_fftSize)) {
+        return;
+    }
+
+    size_t best = 0;
+    double bestDistance = 0.0;
+
+    for (WindowMap::const_iterator i = m_windows.begin();
+         i != m_windows.end(); ++i) {
+
+        size_t fftSize = i->first;
+        size_t aWindowSize = fftSize * m_aWindowSize / m_fftSize;
+        size_t sWindowSize = fftSize * m_sWindowSize / m_fftSize;
+
+        if (m_windows.find(aWindowSize) == m_windows.end() ||
+            m_windows.find(sWindowSize) == m_windows.end() ||
+            !cd.isPrepared(std::max(aWindowSize, sWindowSize), fftSize)) {
+            continue;
+        }
+
+        double distance = fabs(log(double(fftSize) / double(m_fftSize)));
+        if (best == 0 || distance < bestDistance) {
+            best = fftSize;
+            bestDistance = distance;
+        }
+    }
+
+    // We are on the caller's RT thread, so report rather than print
+    m_rtWarnings |= RealTimeWarningSizesNotPrepared;
+
+    if (best == 0) {
+        // Can't happen if configure() did its job: the current sizes
+        // were prepared when we got going
+        if (m_debugLevel > 0) {
+            std::cerr << "WARNING: RubberBandStretcher: No prepared sizes available in RT mode, keeping FFT size " << m_fftSize << " regardless" << std::endl;
+        }
+        return;
+    }
+
+    if (m_debugLevel > 0) {
+        std::cerr << "WARNING: RubberBandStretcher: FFT size " << m_fftSize << " was not prepared for in RT mode, using " << best << " instead (declare the ratios in advance with setRatioRanges to avoid this)" << std::endl;
+    }
+
+    m_aWindowSize = best * m_aWindowSize / m_fftSize;
+    m_sWindowSize = best * m_sWindowSize / m_fftSize;
+    m_increment = std::max(size_t(1), best * m_increment / m_fftSize);
+    m_fftSize = best;
+}
+
 size_t
 RubberBandStretcher::Impl::getLatency() const
 {
@@ -816,6 +1408,8 @@ RubberBandStretcher::Impl::getLatency() const
 void
 RubberBandStretcher::Impl::setTransientsOption(Options options)
 {
+    if (m_verifier) m_verifier->setTransientsOption(options);
+
     if (!m_realtime) {
         cerr << "RubberBandStretcher::Impl::setTransientsOption: Not permissible in non-realtime mode" << endl;
         return;
@@ -832,6 +1426,8 @@ RubberBandStretcher::Impl::setTransientsOption(Options options)
 void
 RubberBandStretcher::Impl::setDetectorOption(Options options)
 {
+    if (m_verifier) m_verifier->setDetectorOption(options);
+
     if (!m_realtime) {
         cerr << "RubberBandStretcher::Impl::setDetectorOption: Not permissible in non-realtime mode" << endl;
         return;
@@ -856,6 +1452,8 @@ RubberBandStretcher::Impl::setDetectorOption(Options options)
 void
 RubberBandStretcher::Impl::setPhaseOption(Options options)
 {
+    if (m_verifier) m_verifier->setPhaseOption(options);
+
     int mask = (OptionPhaseLaminar | OptionPhaseIndependent);
     m_options &= ~mask;
     options &= mask;
@@ -865,6 +1463,8 @@ RubberBandStretcher::Impl::setPhaseOption(Options options)
 void
 RubberBandStretcher::Impl::setFormantOption(Options options)
 {
+    if (m_verifier) m_verifier->setFormantOption(options);
+
     int mask = (OptionFormantShifted | OptionFormantPreserved);
     m_options &= ~mask;
     options &= mask;
@@ -874,6 +1474,8 @@ RubberBandStretcher::Impl::setFormantOption(Options options)
 void
 RubberBandStretcher::Impl::setPitchOption(Options options)
 {
+    if (m_verifier) m_verifier->setPitchOption(options);
+
     if (!m_realtime) {
         cerr << "RubberBandStretcher::Impl::setPitchOption: Pitch option is not used in non-RT mode" << endl;
         return;
@@ -891,9 +1493,60 @@ RubberBandStretcher::Impl::setPitchOption(Options options)
     if (prior != m_options) reconfigure();
 }
 
+void
+RubberBandStretcher::Impl::studyChunk(float *frame, float *mag, FFT *fft,
+                                      CompoundAudioCurve *phaseResetCurve,
+                                      AudioCurveCalculator *stretchCurve,
+                                      AudioCurveCalculator *silentCurve,
+                                      float &phaseResetDf, float &stretchDf,
+                                      bool &silent)
+{
+    // Analyse one chunk of input for study().  The frame should
+    // contain m_aWindowSize samples of input, and is overwritten.
+
+    if (m_aWindowSize == m_fftSize) {
+
+        // We don't need the fftshift for studying, as we're
+        // only interested in magnitude.
+
+        m_awindow->cut(frame);
+
+    } else {
+
+        // If we need to fold (i.e. if the window size is
+        // greater than the fft size so we are doing a
+        // time-aliased presum fft) or zero-pad, then we might
+        // as well use our standard function for it.  This
+        // means we retain the m_afilter cut if folding as well,
+        // which is good for consistency with real-time mode.
+        // We get fftshift as well, which we don't want, but
+        // the penalty is nominal.
+
+        // Note that we can't do this in-place.  Pity
+
+        float *tmp = (float *)alloca
+            (std::max(m_fftSize, m_aWindowSize) * sizeof(float));
+
+        if (m_aWindowSize > m_fftSize) {
+            m_afilter->cut(frame);
+        }
+
+        cutShiftAndFold(tmp, m_fftSize, frame, m_awindow);
+        v_copy(frame, tmp, m_fftSize);
+    }
+
+    fft->forwardMagnitude(frame, mag);
+
+    phaseResetDf = phaseResetCurve->processFloat(mag, m_increment);
+    stretchDf = stretchCurve->processFloat(mag, m_increment);
+    silent = (silentCurve->processFloat(mag, m_increment) > 0.f);
+}
+
 void
 RubberBandStretcher::Impl::study(const float *const *input, size_t samples, bool final)
 {
+    if (m_verifier) m_verifier->study(input, samples, final);
+
     if (m_realtime) {
         if (m_debugLevel > 1) {
             cerr << "RubberBandStretcher::Impl::study: Not meaningful in realtime mode" << endl;
@@ -938,6 +1591,23 @@ RubberBandStretcher::Impl::study(const float *const *input, size_t samples, bool
         mixdown = input[0];
     }
 
+    // With a thread pool, or where the caller has asked for threads
+    // (which then means the shared pool), most of a long block can be
+    // analysed in parallel, leaving the rest of it to be studied as
+    // usual.  We don't create the shared pool just for this otherwise:
+    // it lives as long as the process does
+
+    vector<float> block;
+    if (m_threadPool ||
+        (!(m_options & OptionThreadingNever) &&
+         (m_options & (OptionThreadingAlways | OptionThreadingShared)))) {
+        size_t skip = studyInParallel(mixdown, samples, block);
+        if (skip > 0) {
+            mixdown = &block[skip];
+            samples = block.size() - skip;
+        }
+    }
+
     while (consumed < samples) {
 
 	size_t writable = inbuf.getWriteSpace();
@@ -951,8 +1621,12 @@ RubberBandStretcher::Impl::study(const float *const *input, size_t samples, bool
             consumed += writable;
         }
 
+        // Only pad out the last chunks once all of the final block
+        // is in: a final block can be longer than the inbuf
+
 	while ((inbuf.getReadSpace() >= int(m_aWindowSize)) ||
-               (final && (inbuf.getReadSpace() >= int(m_aWindowSize/2)))) {
+               (final && consumed == samples &&
+                (inbuf.getReadSpace() >= int(m_aWindowSize/2)))) {
 
 	    // We know we have at least m_aWindowSize samples
 	    // available in m_inbuf.  We need to peek m_aWindowSize of
@@ -966,56 +1640,23 @@ RubberBandStretcher::Impl::study(const float *const *input, size_t samples, bool
             assert(final || ready >= m_aWindowSize);
             inbuf.peek(cd.accumulator, std::min(ready, m_aWindowSize));
 
-            if (m_aWindowSize == m_fftSize) {
-
-                // We don't need the fftshift for studying, as we're
-                // only interested in magnitude.
-
-                m_awindow->cut(cd.accumulator);
-
-            } else {
-
-                // If we need to fold (i.e. if the window size is
-                // greater than the fft size so we are doing a
-                // time-aliased presum fft) or zero-pad, then we might
-                // as well use our standard function for it.  This
-                // means we retain the m_afilter cut if folding as well,
-                // which is good for consistency with real-time mode.
-                // We get fftshift as well, which we don't want, but
-                // the penalty is nominal.
+            float phaseResetDf = 0.f, stretchDf = 0.f;
+            bool silent = false;
 
-                // Note that we can't do this in-place.  Pity
+            studyChunk(cd.accumulator, cd.fltbuf, m_studyFFT,
+                       m_phaseResetAudioCurve,
+                       m_stretchAudioCurve,
+                       m_silentAudioCurve,
+                       phaseResetDf, stretchDf, silent);
 
-                float *tmp = (float *)alloca
-                    (std::max(m_fftSize, m_aWindowSize) * sizeof(float));
-
-                if (m_aWindowSize > m_fftSize) {
-                    m_afilter->cut(cd.accumulator);
-                }
+            m_phaseResetDf.push_back(phaseResetDf);
+            m_stretchDf.push_back(stretchDf);
 
-                cutShiftAndFold(tmp, m_fftSize, cd.accumulator, m_awindow);
-                v_copy(cd.accumulator, tmp, m_fftSize);
-            }
-
-            m_studyFFT->forwardMagnitude(cd.accumulator, cd.fltbuf);
-
-            float df = m_phaseResetAudioCurve->processFloat(cd.fltbuf, m_increment);
-            m_phaseResetDf.push_back(df);
-
-//            cout << m_phaseResetDf.size() << " [" << final << "] -> " << df << " \t: ";
-
-            df = m_stretchAudioCurve->processFloat(cd.fltbuf, m_increment);
-            m_stretchDf.push_back(df);
-
-            df = m_silentAudioCurve->processFloat(cd.fltbuf, m_increment);
-            bool silent = (df > 0.f);
             if (silent && m_debugLevel > 1) {
                 cerr << "silence found at " << m_inputDuration << endl;
             }
             m_silence.push_back(silent);
 
-//            cout << df << endl;
-
             // We have augmented the input by m_aWindowSize/2 so that
             // the first chunk is centred on the first audio sample.
             // We want to ensure that m_inputDuration contains the
@@ -1042,6 +1683,187 @@ RubberBandStretcher::Impl::study(const float *const *input, size_t samples, bool
     if (m_channels > 1 || final) delete[] mdalloc;
 }
 
+size_t
+RubberBandStretcher::Impl::studyInParallel(const float *mixdown,
+                                           size_t samples,
+                                           vector<float> &block)
+{
+    // The serial pass analyses a chunk at each increment through the
+    // input held over in the inbuf followed by this block, for as
+    // long as a whole window is available.  Analyse all but the last
+    // m_studyPreRoll of those chunks here, in ranges of which the
+    // calling thread takes the first, and leave the rest for the
+    // serial pass.  Return the number of samples of the combined
+    // input (returned in block) that the serial pass should skip, or
+    // zero if the input is not long enough to be worth splitting.
+
+    ChannelData &cd = *m_channelData[0];
+    RingBuffer<float> &inbuf = *cd.inbuf;
+
+    size_t held = inbuf.getReadSpace();
+    size_t total = held + samples;
+    if (total < m_aWindowSize) return 0;
+
+    size_t chunks = (total - m_aWindowSize) / m_increment + 1;
+    if (chunks <= m_studyPreRoll) return 0;
+    chunks -= m_studyPreRoll;
+    if (chunks < m_minStudyTaskChunks * 2) return 0;
+
+    // Use the pool we will process with, if any, otherwise the
+    // shared one (see study())
+
+    ThreadPool *pool = m_threadPool;
+    if (!pool) pool = ThreadPool::getShared();
+
+    size_t ranges = pool->getThreadCount() + 1;
+    if (ranges > chunks / m_minStudyTaskChunks) {
+        ranges = chunks / m_minStudyTaskChunks;
+    }
+    if (ranges < 2) return 0;
+
+    if (m_debugLevel > 1) {
+        cerr << "RubberBandStretcher::Impl::study: analysing " << chunks
+             << " chunks in " << ranges << " ranges" << endl;
+    }
+
+    block.resize(total);
+    inbuf.read(&block[0], held);
+    v_copy(&block[held], mixdown, samples);
+
+    vector<StudyTask *> tasks;
+
+    for (size_t i = 1; i < ranges; ++i) {
+        StudyTask *task = new StudyTask(this);
+        task->input = &block[0];
+        task->from = (chunks * i) / ranges;
+        task->to = (chunks * (i + 1)) / ranges;
+        tasks.push_back(task);
+        pool->schedule(task);
+    }
+
+    // The first range continues from the state our own curves were
+    // left in by any earlier study() call
+
+    float phaseResetDf = 0.f, stretchDf = 0.f;
+    bool silent = false;
+
+    size_t first = chunks / ranges;
+
+    for (size_t j = 0; j < first; ++j) {
+        v_copy(cd.accumulator, &block[j * m_increment], m_aWindowSize);
+        studyChunk(cd.accumulator, cd.fltbuf, m_studyFFT,
+                   m_phaseResetAudioCurve,
+                   m_stretchAudioCurve,
+                   m_silentAudioCurve,
+                   phaseResetDf, stretchDf, silent);
+        m_phaseResetDf.push_back(phaseResetDf);
+        m_stretchDf.push_back(stretchDf);
+        m_silence.push_back(silent);
+    }
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        StudyTask *task = tasks[i];
+        m_spaceAvailable.lock();
+        while (!task->done) {
+            m_spaceAvailable.wait();
+        }
+        m_spaceAvailable.unlock();
+        pool->cancel(task);
+        for (size_t j = 0; j < task->phaseResetDf.size(); ++j) {
+            m_phaseResetDf.push_back(task->phaseResetDf[j]);
+            m_stretchDf.push_back(task->stretchDf[j]);
+            m_silence.push_back(task->silence[j]);
+        }
+        delete task;
+    }
+
+    // Bring our own curves into the state they would have had after
+    // the last range, for the serial pass to continue from
+
+    m_phaseResetAudioCurve->reset();
+    m_stretchAudioCurve->reset();
+    m_silentAudioCurve->reset();
+
+    for (size_t j = chunks - m_studyPreRoll; j < chunks; ++j) {
+        v_copy(cd.accumulator, &block[j * m_increment], m_aWindowSize);
+        studyChunk(cd.accumulator, cd.fltbuf, m_studyFFT,
+                   m_phaseResetAudioCurve,
+                   m_stretchAudioCurve,
+                   m_silentAudioCurve,
+                   phaseResetDf, stretchDf, silent);
+    }
+
+    m_inputDuration += chunks * m_increment;
+    return chunks * m_increment;
+}
+
+RubberBandStretcher::Impl::StudyTask::StudyTask(Impl *s) :
+    input(0),
+    from(0),
+    to(0),
+    done(false),
+    m_s(s)
+{
+    m_fft = new FFT(s->m_fftSize, s->m_debugLevel);
+    m_fft->initFloat();
+
+    // These must match the curves created in configure()
+
+    m_phaseResetCurve = new CompoundAudioCurve
+        (CompoundAudioCurve::Parameters(s->m_sampleRate, s->m_fftSize));
+    m_phaseResetCurve->setType(s->m_detectorType);
+
+    if (!(s->m_options & OptionStretchPrecise)) {
+        m_stretchCurve = new SpectralDifferenceAudioCurve
+            (SpectralDifferenceAudioCurve::Parameters(s->m_sampleRate, s->m_fftSize));
+    } else {
+        m_stretchCurve = new ConstantAudioCurve
+            (ConstantAudioCurve::Parameters(s->m_sampleRate, s->m_fftSize));
+    }
+
+    m_silentCurve = new SilentAudioCurve
+        (SilentAudioCurve::Parameters(s->m_sampleRate, s->m_fftSize));
+
+    m_frame = allocate<float>(std::max(s->m_aWindowSize, s->m_fftSize));
+    m_mag = allocate<float>(s->m_fftSize / 2 + 1);
+}
+
+RubberBandStretcher::Impl::StudyTask::~StudyTask()
+{
+    delete m_fft;
+    delete m_phaseResetCurve;
+    delete m_stretchCurve;
+    delete m_silentCurve;
+    deallocate(m_frame);
+    deallocate(m_mag);
+}
+
+void
+RubberBandStretcher::Impl::StudyTask::run()
+{
+    AllocatorScope scope(m_s->m_allocator);
+
+    size_t start = from - m_s->m_studyPreRoll;
+
+    float resetValue = 0.f, stretchValue = 0.f;
+    bool silentValue = false;
+
+    for (size_t j = start; j < to; ++j) {
+        v_copy(m_frame, input + j * m_s->m_increment, m_s->m_aWindowSize);
+        m_s->studyChunk(m_frame, m_mag, m_fft,
+                        m_phaseResetCurve, m_stretchCurve, m_silentCurve,
+                        resetValue, stretchValue, silentValue);
+        if (j >= from) {
+            phaseResetDf.push_back(resetValue);
+            stretchDf.push_back(stretchValue);
+            silence.push_back(silentValue);
+        }
+    }
+
+    done = true;
+    m_s->signalSpaceAvailable();
+}
+
 vector<int>
 RubberBandStretcher::Impl::getOutputIncrements() const
 {
@@ -1060,7 +1882,7 @@ vector<float>
 RubberBandStretcher::Impl::getPhaseResetCurve() const
 {
     if (!m_realtime) {
-        return m_phaseResetDf;
+        return m_phaseResetDf.toVector();
     } else {
         vector<float> df;
         while (m_lastProcessPhaseResetDf.getReadSpace() > 0) {
@@ -1084,6 +1906,72 @@ RubberBandStretcher::Impl::getExactTimePoints() const
     return points;
 }
 
+void
+RubberBandStretcher::Impl::createInterpolatorCache(ChannelData &cd,
+                                                   size_t maxSize)
+{
+    // Each channel has its own cache, so that synthesiseChunk can use
+    // it without locking from whichever thread processes the channel
+
+    if (!(m_options & OptionSmoothingOn)) return;
+    delete cd.interpolatorCache;
+    cd.interpolatorCache = new SincWindowCache<float>
+        (int(maxSize), m_interpolatorCacheCapacity);
+}
+
+void
+RubberBandStretcher::Impl::prepareInterpolators()
+{
+    // With the stretch calculated, we know every shift increment the
+    // offline synthesis will use.  Fetch shared interpolator windows
+    // for the most common of them, so that the process threads need
+    // only look them up
+
+    releaseInterpolators();
+
+    if (m_realtime || !(m_options & OptionSmoothingOn) ||
+        m_sWindowSize <= m_fftSize) {
+        return;
+    }
+
+    std::map<int, size_t> counts;
+    for (size_t i = 0; i < m_outputIncrements.size(); ++i) {
+        int inc = m_outputIncrements[i];
+        ++counts[(inc < 0 ? -inc : inc) * 2];
+    }
+
+    std::vector<std::pair<size_t, int> > common;
+    for (std::map<int, size_t>::const_iterator i = counts.begin();
+         i != counts.end(); ++i) {
+        common.push_back(std::pair<size_t, int>(i->second, i->first));
+    }
+    std::sort(common.rbegin(), common.rend());
+
+    // Bound the memory used for long, highly variable stretches: the
+    // rarer increments can be left to the per-channel caches
+    size_t limit = size_t(m_interpolatorCacheCapacity) * 8;
+
+    for (size_t i = 0; i < common.size() && i < limit; ++i) {
+        int p = common[i].second;
+        if (p <= 0) continue;
+        m_interpolators[p] = WindowCache::getSincWindow(int(m_sWindowSize), p);
+    }
+
+    if (m_debugLevel > 1) {
+        cerr << "prepareInterpolators: " << m_interpolators.size() << " shared interpolator windows for " << counts.size() << " distinct shift increments" << endl;
+    }
+}
+
+void
+RubberBandStretcher::Impl::releaseInterpolators()
+{
+    for (SincWindowMap::iterator i = m_interpolators.begin();
+         i != m_interpolators.end(); ++i) {
+        WindowCache::release(i->second);
+    }
+    m_interpolators.clear();
+}
+
 void
 RubberBandStretcher::Impl::calculateStretch()
 {
@@ -1153,6 +2041,11 @@ RubberBandStretcher::Impl::getSamplesRequired() const
 {
     size_t reqd = 0;
 
+    // See m_emergencyScavenger and m_outbufMutex
+    Scavenger<RingBuffer<float> >::Reader reader(m_emergencyScavenger,
+                                                 !m_threaded);
+    MutexLocker locker(m_threaded ? &m_outbufMutex : 0);
+
     for (size_t c = 0; c < m_channels; ++c) {
 
         size_t reqdHere = 0;
@@ -1198,18 +2091,18 @@ RubberBandStretcher::Impl::getSamplesRequired() const
 }
 
 void
-RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bool final)
+RubberBandStretcher::Impl::prepareToProcess()
 {
-    if (m_mode == Finished) {
-        cerr << "RubberBandStretcher::Impl::process: Cannot process again after final chunk" << endl;
-        return;
-    }
+    // Free any output buffers that were replaced during earlier calls
+    // and are no longer being read
+    m_emergencyScavenger.scavenge();
 
     if (m_mode == JustCreated || m_mode == Studying) {
 
         if (m_mode == Studying) {
 
             calculateStretch();
+            prepareInterpolators();
 
             if (!m_realtime) {
                 // See note in configure() above. Of course, we should
@@ -1221,25 +2114,131 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
                     m_channelData[c]->reset();
                     m_channelData[c]->inbuf->zero(m_aWindowSize/2);
                 }
+                prepareSegments();
             }
         }
 
         if (m_threaded) {
             MutexLocker locker(&m_threadSetMutex);
 
-            for (size_t c = 0; c < m_channels; ++c) {
-                ProcessThread *thread = new ProcessThread(this, c);
-                m_threadSet.insert(thread);
-                thread->start();
+            if (m_threadPool) {
+
+                for (size_t c = 0; c < m_channels; ++c) {
+                    m_taskList.push_back(new ProcessTask(this, c));
+                }
+
+            } else {
+
+                for (size_t c = 0; c < m_channels; ++c) {
+                    ProcessThread *thread = new ProcessThread(this, c);
+                    m_threadSet.insert(thread);
+                    thread->start();
+                }
+
+                if (m_debugLevel > 0) {
+                    cerr << m_channels << " threads created" << endl;
+                }
             }
+        }
 
-            if (m_debugLevel > 0) {
-                cerr << m_channels << " threads created" << endl;
+        if (m_pipelined) {
+            for (size_t c = 0; c < m_channels; ++c) {
+                AnalysisThread *thread = new AnalysisThread(this, c);
+                m_analysisThreads.push_back(thread);
+                thread->start();
             }
         }
 
         m_mode = Processing;
     }
+}
+
+bool
+RubberBandStretcher::Impl::prepareOutbufs(size_t samples, size_t pending)
+{
+    // Called in RT mode from process(), and from retrieve() when
+    // pulling input, before they start processing.  The output
+    // buffers were sized for the maximum process size and ratio
+    // ranges we were given.  If a block of this many samples could
+    // produce more output at the current ratio than there is room
+    // for alongside what has not yet been retrieved (or the given
+    // number of pending samples, if more), grow them now: there is
+    // nothing else we could do with the excess once we are
+    // processing, except throw it away.  Allow for a window's worth
+    // of input already waiting in the inbuf, and for rounding.
+    // Return true if anything grew.
+
+    size_t window = std::max(m_aWindowSize, m_sWindowSize);
+    size_t output = size_t(ceil((samples + window) * m_timeRatio)) + window;
+    bool grown = false;
+
+    for (size_t c = 0; c < m_channels; ++c) {
+
+        ChannelData &cd = *m_channelData[c];
+        size_t required =
+            std::max(size_t(cd.outbuf->getReadSpace()), pending) + output;
+        size_t current = cd.outbuf->getSize();
+        if (required <= current) continue;
+
+        // Grow geometrically, so that a caller who consistently
+        // passes larger blocks than it said it would only makes us
+        // reallocate a few times
+        size_t size = std::max(required, current * 2);
+
+        if (c == 0 && m_debugLevel > 0) {
+            cerr << "WARNING: RubberBandStretcher: output buffer size "
+                 << current << " is too small for a process block of "
+                 << samples << " samples at time ratio " << m_timeRatio
+                 << ", reallocating it with size " << size
+                 << " (see setMaxProcessSize and setRatioRanges)" << endl;
+        }
+
+        // As when growing in processChunkForChannel, a reader on
+        // another thread may still have the old buffer
+        RingBuffer<float> *oldbuf = cd.outbuf;
+        cd.outbuf = oldbuf->resized(int(size));
+        m_emergencyScavenger.claim(oldbuf);
+
+        if (size > m_outbufSize) m_outbufSize = size;
+        grown = true;
+    }
+
+    // Free the old buffers now if no reader has them, rather than
+    // in a later call that may not be allowed to
+    if (grown) m_emergencyScavenger.scavenge();
+    return grown;
+}
+
+void
+RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bool final)
+{
+    if (m_verifier) m_verifier->process(input, samples, final);
+
+    if (m_mode == Finished) {
+        cerr << "RubberBandStretcher::Impl::process: Cannot process again after final chunk" << endl;
+        return;
+    }
+
+    prepareToProcess();
+
+    // Everything an RT stretcher needs was allocated when it was
+    // configured (see NoAllocationScope).  The verifier, if any, is
+    // exempt: it is for debugging and processes a copy of each call
+    NoAllocationScope guard(m_realtime && !m_verifier);
+
+    // Growing the output buffers here is the one case in which we
+    // do allocate, because the caller broke its promises about block
+    // size or ratios.  It is inside the guard so that tracking builds
+    // catch it
+    if (m_realtime && prepareOutbufs(samples)) {
+        m_rtWarnings |= RealTimeWarningOutputBuffersGrown;
+    }
+
+    if (!m_segmentTasks.empty()) {
+        processSegments(input, samples, final);
+        if (final) m_mode = Finished;
+        return;
+    }
 
     bool allConsumed = false;
 
@@ -1250,6 +2249,17 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
 
     while (!allConsumed) {
 
+        // Note how many times the processing threads have freed
+        // input space so far: if we fail to consume everything, we
+        // need to sleep until this count has changed.
+
+        unsigned int spaceCount = 0;
+        if (m_threaded) {
+            m_spaceAvailable.lock();
+            spaceCount = m_spaceAvailableCount;
+            m_spaceAvailable.unlock();
+        }
+
         // In a threaded mode, our "consumed" counters only indicate
         // the number of samples that have been taken into the input
         // ring buffers waiting to be processed by the process thread.
@@ -1269,11 +2279,17 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
 //                cerr << "process: waiting on input consumption for channel " << c << endl;
             } else {
                 if (final) {
+                    // publish the input before its size: see
+                    // testInbufReadSpace
+                    MBARRIER();
                     m_channelData[c]->inputSize = m_channelData[c]->inCount;
                 }
 //                cerr << "process: happy with channel " << c << endl;
             }
             if (!m_threaded && !m_realtime) {
+                if (!m_analysisThreads.empty()) {
+                    m_analysisThreads[c]->signalDataAvailable();
+                }
                 bool any = false, last = false;
                 processChunks(c, any, last);
             }
@@ -1287,13 +2303,23 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
             processOneChunk();
         }
         if (m_threaded) {
+            // If we are about to wait, the threads must not hold
+            // back at the output buffer limit waiting for us to
+            // retrieve: tell them before waking them
+            if (!allConsumed) {
+                m_processWaiting = true;
+            }
             for (ThreadSet::iterator i = m_threadSet.begin();
                  i != m_threadSet.end(); ++i) {
                 (*i)->signalDataAvailable();
             }
+            for (TaskList::iterator i = m_taskList.begin();
+                 i != m_taskList.end(); ++i) {
+                m_threadPool->schedule(*i);
+            }
             m_spaceAvailable.lock();
-            if (!allConsumed) {
-                m_spaceAvailable.wait(500);
+            while (!allConsumed && m_spaceAvailableCount == spaceCount) {
+                m_spaceAvailable.wait();
             }
             m_spaceAvailable.unlock();
         }
@@ -1303,6 +2329,8 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
         }
     }
 
+    m_processWaiting = false;
+
     if (m_debugLevel > 2) {
         cerr << "process returning" << endl;
     }
@@ -1310,6 +2338,187 @@ RubberBandStretcher::Impl::process(const float *const *input, size_t samples, bo
     if (final) m_mode = Finished;
 }
 
+size_t
+RubberBandStretcher::Impl::processNonBlocking(const float *const *input,
+                                              size_t samples, bool final)
+{
+    if (m_mode == Finished) {
+        cerr << "RubberBandStretcher::Impl::processNonBlocking: Cannot process again after final chunk" << endl;
+        return 0;
+    }
+
+    // This decides whether we are segmented, which changes m_threaded
+    prepareToProcess();
+
+    if (!m_segmentTasks.empty()) {
+        // Segment input is held in growable buffers, so all of it
+        // fits; only the handing of segments to tasks has to wait,
+        // and that is left for a later call if no task is free
+        if (m_verifier) m_verifier->process(input, samples, final);
+        processSegments(input, samples, final, false);
+        if (final) m_mode = Finished;
+        return samples;
+    }
+
+    bool pipelined = !m_analysisThreads.empty();
+
+    if (!m_threaded && !pipelined) {
+        // Nothing to wait for: everything is processed on this thread
+        process(input, samples, final);
+        return samples;
+    }
+
+    // Take only as much as every channel has room for, so that the
+    // channels stay in step and the caller can resubmit the rest.
+    // There is no resampling before stretching in offline mode, so
+    // each channel consumes exactly what it is given
+
+    size_t accepted = samples;
+    for (size_t c = 0; c < m_channels; ++c) {
+        size_t ws = m_channelData[c]->inbuf->getWriteSpace();
+        if (ws < accepted) accepted = ws;
+    }
+
+    bool allIn = (accepted == samples);
+    final = final && allIn;
+
+    if (m_verifier) m_verifier->process(input, accepted, final);
+
+    for (size_t c = 0; c < m_channels; ++c) {
+        consumeChannel(c, input, 0, accepted, final);
+        if (final) {
+            // publish the input before its size: see
+            // testInbufReadSpace
+            MBARRIER();
+            m_channelData[c]->inputSize = m_channelData[c]->inCount;
+        }
+    }
+
+    if (pipelined) {
+        // Process whatever the analysis threads have finished with,
+        // without waiting for more; the input they have used is
+        // freed as they go
+        for (size_t c = 0; c < m_channels; ++c) {
+            m_analysisThreads[c]->signalDataAvailable();
+            bool any = false, last = false;
+            processChunks(c, any, last, 0, false);
+        }
+    }
+    for (ThreadSet::iterator i = m_threadSet.begin();
+         i != m_threadSet.end(); ++i) {
+        (*i)->signalDataAvailable();
+    }
+    for (TaskList::iterator i = m_taskList.begin();
+         i != m_taskList.end(); ++i) {
+        m_threadPool->schedule(*i);
+    }
+
+    if (m_debugLevel > 2) {
+        cerr << "processNonBlocking: accepted " << accepted << " of "
+             << samples << endl;
+    }
+
+    if (final) m_mode = Finished;
+    return accepted;
+}
+
+void
+RubberBandStretcher::Impl::setNotificationCallback(NotificationCallback callback,
+                                                   void *data)
+{
+    m_notificationCallback = callback;
+    m_notificationData = data;
+}
+
+void
+RubberBandStretcher::Impl::setInputCallback(InputCallback callback,
+                                            void *data)
+{
+    m_inputCallback = callback;
+    m_inputCallbackData = data;
+
+    // Allocate here rather than in retrieve(), which must not
+    // allocate in real-time mode.  pullInput() asks for no more than
+    // this at a time, and simply asks again if it needs more
+    size_t size = std::max(m_maxProcessSize, m_aWindowSize);
+    if (callback && size > m_pullBufferSize) {
+        m_pullBuffer = reallocate_channels(m_pullBuffer,
+                                           m_channels, m_pullBufferSize,
+                                           m_channels, size);
+        m_pullBufferSize = size;
+    }
+}
+
+void
+RubberBandStretcher::Impl::pullInput(size_t samples)
+{
+    while (true) {
+
+        // As in process(), note how many times the processing
+        // threads have made progress before we look at the output,
+        // so that we don't miss a change while deciding to wait
+
+        unsigned int spaceCount = 0;
+        if (m_threaded) {
+            m_spaceAvailable.lock();
+            spaceCount = m_spaceAvailableCount;
+            m_spaceAvailable.unlock();
+        }
+
+        bool complete = true;
+        for (size_t c = 0; c < m_channels; ++c) {
+            if (!m_channelData[c]->outputComplete) complete = false;
+        }
+        MBARRIER();
+
+        int avail = available();
+        if (avail < 0 || size_t(avail) >= samples || complete) break;
+
+        size_t reqd = 0;
+        if (m_mode != Finished) reqd = getSamplesRequired();
+
+        if (reqd > 0) {
+            if (reqd > m_pullBufferSize) reqd = m_pullBufferSize;
+            size_t got = m_inputCallback(m_inputCallbackData,
+                                         m_pullBuffer, reqd);
+            if (got > reqd) got = reqd;
+            if (m_debugLevel > 2) {
+                cerr << "pullInput: asked for " << reqd << ", got "
+                     << got << endl;
+            }
+            process(m_pullBuffer, got, got < reqd);
+            continue;
+        }
+
+        // Nothing more is wanted yet.  Without processing threads,
+        // that means the output we have is all there is for now
+
+        if (!m_threaded) break;
+
+        // As when process() waits, the threads must not hold back at
+        // the output buffer limit while we wait for them, as we won't
+        // be retrieving anything until they have produced enough
+
+        m_processWaiting = true;
+        for (ThreadSet::iterator i = m_threadSet.begin();
+             i != m_threadSet.end(); ++i) {
+            (*i)->signalDataAvailable();
+        }
+        for (TaskList::iterator i = m_taskList.begin();
+             i != m_taskList.end(); ++i) {
+            m_threadPool->schedule(*i);
+        }
+
+        m_spaceAvailable.lock();
+        while (m_spaceAvailableCount == spaceCount) {
+            m_spaceAvailable.wait();
+        }
+        m_spaceAvailable.unlock();
+    }
+
+    m_processWaiting = false;
+}
+
 
 }
 
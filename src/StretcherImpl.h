@@ -28,22 +28,34 @@
 
 #include "dsp/Window.h"
 #include "dsp/SincWindow.h"
+#include "dsp/SincWindowCache.h"
 #include "dsp/FFT.h"
 
 #include "audiocurves/CompoundAudioCurve.h"
 
 #include "base/RingBuffer.h"
+#include "base/ChunkedArray.h"
+#include "base/CurveStore.h"
 #include "base/Scavenger.h"
 #include "system/Thread.h"
+#include "system/ThreadPool.h"
+#include "system/Allocators.h"
 #include "system/sysutils.h"
 
 #include <set>
+#include <deque>
+#include <atomic>
 
 using namespace RubberBand;
 
 namespace RubberBand
 {
 
+// The default sample type for frequency-domain processing.  This can
+// be overridden per stretcher at runtime using OptionPrecisionSingle;
+// if PROCESS_SAMPLE_TYPE is defined as float, single precision is
+// always used.
+
 #ifdef PROCESS_SAMPLE_TYPE
 typedef PROCESS_SAMPLE_TYPE process_t;
 #else
@@ -53,13 +65,17 @@ typedef double process_t;
 class AudioCurveCalculator;
 class StretchCalculator;
 
-class RubberBandStretcher::Impl
+class RubberBandStretcher::Impl : public Allocated
 {
 public:
     Impl(size_t sampleRate, size_t channels, Options options,
-         double initialTimeRatio, double initialPitchScale);
+         double initialTimeRatio, double initialPitchScale,
+         const AllocatorHooks *allocator = 0,
+         const RatioRanges *ranges = 0);
     ~Impl();
 
+    const AllocatorHooks *getAllocatorHooks() const { return m_allocator; }
+
     void reset();
     void setTimeRatio(double ratio);
     void setPitchScale(double scale);
@@ -77,15 +93,25 @@ public:
 
     void setExpectedInputDuration(size_t samples);
     void setMaxProcessSize(size_t samples);
+    void setRatioRanges(double minTimeRatio, double maxTimeRatio,
+                        double minPitchScale, double maxPitchScale);
     void setKeyFrameMap(const std::map<size_t, size_t> &);
 
+    int getRealTimeWarnings();
+
     size_t getSamplesRequired() const;
 
     void study(const float *const *input, size_t samples, bool final);
     void process(const float *const *input, size_t samples, bool final);
+    bool prepareOutbufs(size_t samples, size_t pending = 0);
+    size_t processNonBlocking(const float *const *input, size_t samples,
+                              bool final);
+    void setNotificationCallback(NotificationCallback callback, void *data);
+    void setInputCallback(InputCallback callback, void *data);
 
     int available() const;
     size_t retrieve(float *const *output, size_t samples) const;
+    size_t readOutput(float *const *output, size_t samples) const;
 
     float getFrequencyCutoff(int n) const;
     void setFrequencyCutoff(int n, float f);
@@ -107,6 +133,27 @@ public:
     void setDebugLevel(int level);
     static void setDefaultDebugLevel(int level) { m_defaultDebugLevel = level; }
 
+    static void setThreadPoolSize(size_t threads) {
+        ThreadPool::setSharedThreadCount(int(threads));
+    }
+
+    static void setThreadingVerification(bool verify) {
+        m_verifyThreading = verify;
+    }
+
+    static void setThreadAffinity(const std::vector<int> &processors) {
+        Thread::setAffinity(processors);
+    }
+    static void setThreadPriority(int priority) {
+        Thread::setPriority(priority);
+    }
+    static void setThreadStackSize(size_t bytes) {
+        Thread::setStackSize(bytes);
+    }
+    static void setThreadNamePrefix(const char *prefix) {
+        Thread::setNamePrefix(prefix ? prefix : "");
+    }
+
 protected:
     size_t m_sampleRate;
     size_t m_channels;
@@ -115,22 +162,44 @@ protected:
                           size_t offset, size_t samples, float *prepared);
     size_t consumeChannel(size_t channel, const float *const *inputs,
                           size_t offset, size_t samples, bool final);
-    void processChunks(size_t channel, bool &any, bool &last);
+    size_t processChunks(size_t channel, bool &any, bool &last,
+                         size_t maxChunks = 0, bool wait = true);
     bool processOneChunk(); // across all channels, for real time use
+    bool processOneChunkPart(size_t part, bool synthesis); // ditto, threaded
     bool processChunkForChannel(size_t channel, size_t phaseIncrement,
                                 size_t shiftIncrement, bool phaseReset);
     bool testInbufReadSpace(size_t channel);
+    bool testInbufReadSpace(size_t channel, bool &draining);
+    bool testOutputThrottled(size_t channel);
+    void wakeThrottled();
     void calculateIncrements(size_t &phaseIncrement,
                              size_t &shiftIncrement, bool &phaseReset);
     bool getIncrements(size_t channel, size_t &phaseIncrement,
                        size_t &shiftIncrement, bool &phaseReset);
-    void analyseChunk(size_t channel);
+    void analyseInput(size_t channel);
+    void analyseChunk(size_t channel, const float *input = 0);
     void modifyChunk(size_t channel, size_t outputIncrement, bool phaseReset);
-    void formantShiftChunk(size_t channel);
     void synthesiseChunk(size_t channel, size_t shiftIncrement);
     void writeChunk(size_t channel, size_t shiftIncrement, bool last);
 
+    // Implementations of the above for each processing sample type
+    // (float or double), selected according to m_singlePrecision
+    template <typename T>
+    void calculateCurveValues(float &df, bool &silent);
+    template <typename T>
+    void analyseChunk(size_t channel, const float *input);
+    template <typename T>
+    void modifyChunk(size_t channel, size_t outputIncrement, bool phaseReset);
+    template <typename T>
+    void formantShiftChunk(size_t channel);
+    template <typename T>
+    void synthesiseChunk(size_t channel, size_t shiftIncrement);
+
     void calculateSizes();
+    bool applyRatioRanges(double minTimeRatio, double maxTimeRatio,
+                          double minPitchScale, double maxPitchScale);
+    void calculateRangeSizes();
+    void choosePreparedSizes();
     void configure();
     void reconfigure();
 
@@ -141,9 +210,14 @@ protected:
     template <typename T, typename S>
     void cutShiftAndFold(T *target, int targetSize,
                          S *src, // destructive to src
-                         Window<float> *window) {
+                         const Window<float> *window) {
         window->cut(src);
-        const int windowSize = window->getSize();
+        shiftAndFold(target, targetSize, src, window->getSize());
+    }
+
+    template <typename T, typename S>
+    void shiftAndFold(T *target, int targetSize,
+                      const S *src, int windowSize) {
         const int hs = targetSize / 2;
         if (windowSize == targetSize) {
             v_convert(target, src + hs, hs);
@@ -172,14 +246,44 @@ protected:
     size_t m_increment;
     size_t m_outbufSize;
 
+    // In offline threaded mode, the output buffers start at
+    // m_outbufSize and grow as the processing threads get ahead of
+    // retrieve(), until they hold m_outbufLimit samples: then the
+    // threads stop and wait, unless process() or pullInput() is
+    // itself waiting for them.  Zero for no limit
+    size_t m_outbufLimit;
+    std::atomic<bool> m_processWaiting; // process() or pullInput() is waiting
+    std::atomic<bool> m_outputThrottled; // a thread has stopped at the limit
+
     size_t m_maxProcessSize;
     size_t m_expectedInputDuration;
 
+    // Declared with setRatioRanges() in RT mode.  If set, configure()
+    // allocates for the sizes calculateRangeSizes() found across the
+    // ranges, rather than for the default set
+    bool m_ratioRangesSet;
+    double m_minTimeRatio;
+    double m_maxTimeRatio;
+    double m_minPitchScale;
+    double m_maxPitchScale;
+    std::set<size_t> m_rangeWindowSizes;
+    size_t m_rangeOutbufSize;
+    size_t m_rangeResamplebufSize;
+
+    // RealTimeWarning flags raised since getRealTimeWarnings() was
+    // last called.  The RT paths set these instead of printing,
+    // which they may do only at debug level 1 or more
+    mutable std::atomic<int> m_rtWarnings;
+
     bool m_threaded;
     bool m_realtime;
+    bool m_singlePrecision;
     Options m_options;
     int m_debugLevel;
 
+    AllocatorHooks m_allocatorHooks;
+    const AllocatorHooks *m_allocator; // &m_allocatorHooks, or 0 if none
+
     enum ProcessMode {
         JustCreated,
         Studying,
@@ -189,14 +293,42 @@ protected:
 
     ProcessMode m_mode;
 
-    std::map<size_t, Window<float> *> m_windows;
-    std::map<size_t, SincWindow<float> *> m_sincs;
-    Window<float> *m_awindow;
-    SincWindow<float> *m_afilter;
-    Window<float> *m_swindow;
+    // Shared with other instances through WindowCache
+    typedef std::map<size_t, const Window<float> *, std::less<size_t>,
+                     StlAllocator<std::pair<const size_t,
+                                            const Window<float> *> > >
+        WindowMap;
+    typedef std::map<size_t, const SincWindow<float> *, std::less<size_t>,
+                     StlAllocator<std::pair<const size_t,
+                                            const SincWindow<float> *> > >
+        SincWindowMap;
+    WindowMap m_windows;
+    SincWindowMap m_sincs;
+    const Window<float> *m_awindow;
+    const SincWindow<float> *m_afilter;
+    const Window<float> *m_swindow;
+    // With smoothing on, the interpolator windows for the most
+    // common shift increments, keyed by scale (twice the increment).
+    // Filled through WindowCache before processing starts in offline
+    // mode and read-only after that; other increments fall back to
+    // each channel's own interpolatorCache
+    SincWindowMap m_interpolators;
     FFT *m_studyFFT;
 
     Condition m_spaceAvailable;
+    unsigned int m_spaceAvailableCount; // protected by m_spaceAvailable
+    void signalSpaceAvailable(); // also calls m_notificationCallback
+
+    NotificationCallback m_notificationCallback;
+    void *m_notificationData;
+
+    InputCallback m_inputCallback;
+    void *m_inputCallbackData;
+    float **m_pullBuffer; // input scratch for m_inputCallback
+    size_t m_pullBufferSize;
+    void pullInput(size_t samples); // until samples of output available
+
+    void prepareToProcess();
 
     class ProcessThread : public Thread
     {
@@ -216,21 +348,292 @@ protected:
     typedef std::set<ProcessThread *> ThreadSet;
     ThreadSet m_threadSet;
 
+    // Used instead of ProcessThreads with OptionThreadingShared, or
+    // when there are more channels than processors: one task per
+    // channel, run on the shared pool or on our own.  Each run
+    // processes at most m_taskChunks chunks and then requeues the
+    // task, so that idle workers can steal the remaining channels
+
+    class ProcessTask : public ThreadPool::Task
+    {
+    public:
+        ProcessTask(Impl *s, size_t c);
+        void run();
+    private:
+        Impl *m_s;
+        size_t m_channel;
+    };
+
+    ThreadPool *m_threadPool;
+    ThreadPool *m_ownThreadPool; // if m_threadPool is not the shared one
+    static const size_t m_taskChunks = 16;
+    typedef std::vector<ProcessTask *> TaskList;
+    TaskList m_taskList;
+
+    // Used with OptionThreadingRealTime: workers started at
+    // construction, each of which analyses and then synthesises a
+    // fixed subset of the channels when processOneChunk hands it a
+    // chunk.  Handoff is through atomic counters polled by both
+    // sides; the worker only parks on m_wake once it has spun for a
+    // while with nothing to do, and dispatch() wakes it with a
+    // semaphore post, which takes no lock.  Each job is claimed by
+    // whoever gets to it first, so that if the worker has not started
+    // a job by the time collect() has waited m_rtCollectTimeout, the
+    // calling thread runs it instead of waiting on a thread that may
+    // not be scheduled in time.
+
+    class RealTimeWorker : public Thread
+    {
+    public:
+        RealTimeWorker(Impl *s, size_t part);
+        void run();
+        void dispatch(bool synthesis);
+        bool collect();
+        void abandon();
+    private:
+        bool claim(unsigned int job);
+        void perform(unsigned int job);
+
+        // Job numbers wrap around, so they are unsigned and only ever
+        // compared for equality
+        Impl *m_s;
+        size_t m_part;
+        Semaphore m_wake;
+        std::atomic<unsigned int> m_requested; // number of the latest job
+        std::atomic<unsigned int> m_claimed; // latest job started by anyone
+        std::atomic<unsigned int> m_completed; // latest job finished
+        bool m_synthesis; // published with m_requested
+        bool m_last; // published with m_completed
+        std::atomic<bool> m_sleeping;
+        std::atomic<bool> m_abandoning;
+    };
+
+    // Used with OptionThreadingPipelined in offline mode when not
+    // otherwise threaded: one thread per channel that reads input
+    // from the channel's inbuf and performs the analysis FFT and
+    // polar conversion up to m_frameCount chunks ahead of the
+    // processing of the channel.  Analysed chunks are passed through
+    // a pair of lock-free queues of frame indices.  Phase
+    // modification, synthesis and overlap-add, which depend on the
+    // previous chunk, stay with processChunks -- as does analysis of
+    // a short final chunk, whose padding comes from the previous
+    // synthesis in cd.fltbuf.
+
+    class AnalysisThread : public Thread
+    {
+    public:
+        AnalysisThread(Impl *s, size_t c);
+        ~AnalysisThread();
+        void run();
+        void signalDataAvailable();
+        void abandon();
+
+        // Wait for the next analysed chunk and copy it into the
+        // channel's spectrum.  Returns false without waiting further
+        // if the thread has run out of input, or without waiting at
+        // all if wait is false and no chunk is ready yet.
+        bool getAnalysedChunk(bool wait = true);
+
+    private:
+        struct Frame {
+            float *fltbuf;
+            size_t fill;
+            bool analysed;
+            float *fmag;
+            float *fphase;
+            double *dmag;
+            double *dphase;
+            bool draining;
+        };
+
+        Impl *m_s;
+        size_t m_channel;
+        FFT *m_fft;
+        float *m_fbuf;
+        double *m_dbuf;
+        Frame *m_frames;
+        RingBuffer<int> m_ready;
+        RingBuffer<int> m_free;
+        Condition m_condition;
+        bool m_draining;
+        bool m_idle;
+        bool m_abandoning;
+        static const int m_frameCount = 8;
+    };
+
+    typedef std::vector<AnalysisThread *> AnalysisThreadList;
+    AnalysisThreadList m_analysisThreads;
+    bool m_pipelined;
+
+    // Used with OptionThreadingSegmented in offline mode: the input
+    // is cut at chunks for which the stretch calculator asked for a
+    // full phase reset, and each segment is rendered by a task on the
+    // thread pool into a spare set of ChannelData objects ("slots",
+    // held in m_channelData after the real channels).  A full reset
+    // discards all phase history, so a segment depends on the one
+    // before it only through the overlap-add accumulators.  The task
+    // therefore records what it adds to them until its output has
+    // passed the synthesis window length, and spliceSegments replays
+    // that on top of the previous segment's accumulator tail in the
+    // real channel before appending the rest of the task's output.
+
+    struct SegmentOverlap
+    {
+        struct Write {
+            size_t shiftIncrement;
+            long inputSize;
+            bool synthesised;
+        };
+        std::vector<Write> writes;
+        std::vector<float> frames;  // m_sWindowSize per synthesised chunk
+        std::vector<float> windows; // likewise, if m_sWindowSize > m_fftSize
+        size_t extent;              // sum of shift increments written
+        bool synthesised;           // frame pending for the next write
+        bool complete;              // extent reached m_sWindowSize
+    };
+
+    class SegmentTask : public ThreadPool::Task
+    {
+    public:
+        SegmentTask(Impl *s, size_t firstSlot);
+        void run();
+
+        size_t firstSlot;
+        size_t startChunk;
+        size_t startOutput;
+        bool last;
+        long inputSize;
+        std::vector<std::vector<float> > input; // per channel
+        std::vector<std::vector<float> > output;
+        std::vector<SegmentOverlap> overlap;
+        std::atomic<bool> done;
+
+    private:
+        Impl *m_s;
+    };
+
+    // Used by study() to analyse a long block in parallel: each task
+    // takes a range of the block's chunks, with its own FFT and audio
+    // curves.  The curves carry state from one chunk to the next, so
+    // a task first runs them over the m_studyPreRoll chunks before
+    // its range, discarding the results.  That is enough to bring
+    // them into a state that gives the same results as the serial
+    // pass from then on.
+
+    class StudyTask : public ThreadPool::Task
+    {
+    public:
+        StudyTask(Impl *s);
+        ~StudyTask();
+        void run();
+
+        const float *input; // start of the block being studied
+        size_t from;        // chunk index of first result
+        size_t to;          // chunk index after last result
+        std::vector<float> phaseResetDf;
+        std::vector<float> stretchDf;
+        std::vector<bool> silence;
+        std::atomic<bool> done;
+
+    private:
+        Impl *m_s;
+        FFT *m_fft;
+        CompoundAudioCurve *m_phaseResetCurve;
+        AudioCurveCalculator *m_stretchCurve;
+        AudioCurveCalculator *m_silentCurve;
+        float *m_frame;
+        float *m_mag;
+    };
+
+    void studyChunk(float *frame, float *mag, FFT *fft,
+                    CompoundAudioCurve *phaseResetCurve,
+                    AudioCurveCalculator *stretchCurve,
+                    AudioCurveCalculator *silentCurve,
+                    float &phaseResetDf, float &stretchDf, bool &silent);
+    size_t studyInParallel(const float *mixdown, size_t samples,
+                           std::vector<float> &block);
+
+    static const size_t m_studyPreRoll = 32;
+    static const size_t m_minStudyTaskChunks = 1024;
+
+    void prepareSegments();
+    void processSegments(const float *const *input, size_t samples,
+                         bool final, bool wait = true);
+    void dispatchSegments(bool final, bool wait = true);
+    bool spliceSegments(bool wait);
+    void spliceSegment(SegmentTask *task, size_t channel);
+    void clearSegments();
+
+    bool m_segmented; // requested and permitted at construction
+    bool m_segmentFallbackThreaded; // m_threaded when not using segments
+    std::vector<SegmentTask *> m_segmentTasks; // non-empty when active
+    std::deque<SegmentTask *> m_segmentsPending; // in segment order
+    std::vector<SegmentTask *> m_segmentsFree;
+    std::vector<size_t> m_segmentStarts; // first chunk of each segment
+    std::vector<size_t> m_segmentOutputs; // output count at each start
+    size_t m_nextSegment;
+    std::vector<std::vector<float> > m_segmentInput; // per channel
+    size_t m_segmentInputBase; // input position of m_segmentInput[c][0]
+    static const size_t m_minSegmentChunks = 128;
+
+    typedef std::vector<RealTimeWorker *> RealTimeWorkerList;
+    RealTimeWorkerList m_rtWorkers;
+    size_t m_rtPhaseIncrement;
+    size_t m_rtShiftIncrement;
+    bool m_rtPhaseReset;
+    static const int m_rtSpinCount = 20000; // iterations, each a CPU pause
+    static const int m_rtCollectTimeout = 200; // microseconds
+
     size_t m_inputDuration;
     CompoundAudioCurve::Type m_detectorType;
-    std::vector<float> m_phaseResetDf;
-    std::vector<float> m_stretchDf;
-    std::vector<bool> m_silence;
+    // Study results, one value per input increment.  These may be
+    // very long, so they are kept in chunks rather than vectors, and
+    // may be compact and/or file-backed (see OptionStudy flags)
+    CurveStore m_phaseResetDf;
+    CurveStore m_stretchDf;
+    ChunkedArray<bool> m_silence;
+    void reserveStudyCurves();
     int m_silentHistory;
 
     class ChannelData;
     std::vector<ChannelData *> m_channelData;
 
+    void createInterpolatorCache(ChannelData &cd, size_t maxSize);
+    void prepareInterpolators();
+    void releaseInterpolators();
+
     std::vector<int> m_outputIncrements;
 
     mutable RingBuffer<int> m_lastProcessOutputIncrements;
     mutable RingBuffer<float> m_lastProcessPhaseResetDf;
+    // The output buffers may be replaced by larger ones while other
+    // threads are reading them, and exactly one of these protects
+    // that, according to the mode:
+    //
+    // m_outbufMutex, in offline multithreaded mode (m_threaded).  The
+    // process threads replace buffers in processChunkForChannel, with
+    // the mutex held for the copy, so that samples are neither lost
+    // nor duplicated by a read during it.  Everything that reads the
+    // output buffers from the caller's side holds it too, so the old
+    // buffer can be deleted at once.
+    //
+    // m_emergencyScavenger, otherwise (RT and single-threaded modes).
+    // Buffers are replaced on the calling thread, by prepareOutbufs
+    // in RT mode and processChunkForChannel offline, but available()
+    // and retrieve() may be called on another thread.  They read
+    // within a Reader scope, and the old buffers are claimed by the
+    // scavenger, which deletes them once no such scope can see them.
     Scavenger<RingBuffer<float> > m_emergencyScavenger;
+    mutable Mutex m_outbufMutex;
+
+    // With threading verification: a single-threaded stretcher that
+    // is given the same calls as we are, whose output retrieve()
+    // compares with ours
+    Impl *m_verifier;
+    mutable size_t m_verifiedCount;
+    float **m_verifyBuffer; // m_verifyBufferSize per channel
+    static const size_t m_verifyBufferSize = 4096;
+    void verifyOutput(float *const *output, size_t samples) const;
 
     CompoundAudioCurve *m_phaseResetAudioCurve;
     AudioCurveCalculator *m_stretchAudioCurve;
@@ -248,8 +651,10 @@ protected:
                      size_t qty, size_t &outCount, size_t theoreticalOut);
 
     static int m_defaultDebugLevel;
+    static std::atomic<bool> m_verifyThreading;
     static const size_t m_defaultIncrement;
     static const size_t m_defaultFftSize;
+    static const int m_interpolatorCacheCapacity;
 };
 
 }
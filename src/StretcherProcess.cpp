@@ -39,9 +39,13 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
 #include <set>
 #include <map>
 #include <deque>
+#include <chrono>
+#include <thread>
 
 using namespace RubberBand;
 
@@ -51,6 +55,7 @@ using std::endl;
 namespace RubberBand {
 
 RubberBandStretcher::Impl::ProcessThread::ProcessThread(Impl *s, size_t c) :
+    Thread(std::string("process") + char('A' + c)),
     m_s(s),
     m_channel(c),
     m_dataAvailable(std::string("data ") + char('A' + c)),
@@ -60,6 +65,8 @@ RubberBandStretcher::Impl::ProcessThread::ProcessThread(Impl *s, size_t c) :
 void
 RubberBandStretcher::Impl::ProcessThread::run()
 {
+    AllocatorScope scope(m_s->m_allocator);
+
     if (m_s->m_debugLevel > 1) {
         cerr << "thread " << m_channel << " getting going" << endl;
     }
@@ -80,14 +87,21 @@ RubberBandStretcher::Impl::ProcessThread::run()
         if (last) break;
 
         if (any) {
-            m_s->m_spaceAvailable.lock();
-            m_s->m_spaceAvailable.signal();
-            m_s->m_spaceAvailable.unlock();
+            m_s->signalSpaceAvailable();
         }
 
+        // Sleep until process() has written more input or set the
+        // input size, retrieve() has made room in a full output
+        // buffer, or we are abandoned.  Each of these is signalled
+        // with m_dataAvailable held, and we test for them with it
+        // held, so no wakeup can be missed and no timeout is needed.
+
         m_dataAvailable.lock();
-        if (!m_s->testInbufReadSpace(m_channel) && !m_abandoning) {
-            m_dataAvailable.wait(50000); // bounded in case of abandonment
+        while (cd.inputSize == -1 &&
+               (!m_s->testInbufReadSpace(m_channel) ||
+                m_s->testOutputThrottled(m_channel)) &&
+               !m_abandoning) {
+            m_dataAvailable.wait();
         }
         m_dataAvailable.unlock();
 
@@ -99,29 +113,847 @@ RubberBandStretcher::Impl::ProcessThread::run()
         }
     }
 
-    bool any = false, last = false;
-    m_s->processChunks(m_channel, any, last);
-    m_s->m_spaceAvailable.lock();
-    m_s->m_spaceAvailable.signal();
-    m_s->m_spaceAvailable.unlock();
+    bool any = false, last = false;
+    m_s->processChunks(m_channel, any, last);
+    m_s->signalSpaceAvailable();
+
+    if (m_s->m_debugLevel > 1) {
+        cerr << "thread " << m_channel << " done" << endl;
+    }
+}
+
+void
+RubberBandStretcher::Impl::ProcessThread::signalDataAvailable()
+{
+    m_dataAvailable.lock();
+    m_dataAvailable.signal();
+    m_dataAvailable.unlock();
+}
+
+void
+RubberBandStretcher::Impl::ProcessThread::abandon()
+{
+    m_dataAvailable.lock();
+    m_abandoning = true;
+    m_dataAvailable.signal();
+    m_dataAvailable.unlock();
+}
+
+RubberBandStretcher::Impl::AnalysisThread::AnalysisThread(Impl *s, size_t c) :
+    Thread(std::string("analysis") + char('A' + c)),
+    m_s(s),
+    m_channel(c),
+    m_fft(new FFT(s->m_fftSize, s->m_debugLevel)),
+    m_fbuf(0),
+    m_dbuf(0),
+    m_frames(new Frame[m_frameCount]),
+    m_ready(m_frameCount),
+    m_free(m_frameCount),
+    m_condition(std::string("analysis ") + char('A' + c)),
+    m_draining(s->m_channelData[c]->draining),
+    m_idle(false),
+    m_abandoning(false)
+{
+    const int fftSize = s->m_fftSize;
+    const int count = fftSize / 2 + 1;
+    const int bufSize = std::max(s->m_aWindowSize, s->m_fftSize);
+
+    if (s->m_singlePrecision) {
+        m_fft->initFloat();
+        m_fbuf = allocate_and_zero<float>(fftSize);
+    } else {
+        m_fft->initDouble();
+        m_dbuf = allocate_and_zero<double>(fftSize);
+    }
+
+    for (int i = 0; i < m_frameCount; ++i) {
+        Frame &f = m_frames[i];
+        f.fltbuf = allocate_and_zero<float>(bufSize);
+        f.fill = 0;
+        f.analysed = false;
+        f.fmag = f.fphase = 0;
+        f.dmag = f.dphase = 0;
+        if (s->m_singlePrecision) {
+            f.fmag = allocate_and_zero<float>(count);
+            f.fphase = allocate_and_zero<float>(count);
+        } else {
+            f.dmag = allocate_and_zero<double>(count);
+            f.dphase = allocate_and_zero<double>(count);
+        }
+        f.draining = false;
+        m_free.write(&i, 1);
+    }
+}
+
+RubberBandStretcher::Impl::AnalysisThread::~AnalysisThread()
+{
+    for (int i = 0; i < m_frameCount; ++i) {
+        deallocate(m_frames[i].fltbuf);
+        deallocate(m_frames[i].fmag);
+        deallocate(m_frames[i].fphase);
+        deallocate(m_frames[i].dmag);
+        deallocate(m_frames[i].dphase);
+    }
+    delete[] m_frames;
+    deallocate(m_dbuf);
+    deallocate(m_fbuf);
+    delete m_fft;
+}
+
+void
+RubberBandStretcher::Impl::AnalysisThread::run()
+{
+    AllocatorScope scope(m_s->m_allocator);
+
+    if (m_s->m_debugLevel > 1) {
+        cerr << "analysis thread " << m_channel << " getting going" << endl;
+    }
+
+    ChannelData &cd = *m_s->m_channelData[m_channel];
+
+    while (true) {
+
+        // Wait until we have both a free frame to analyse into and
+        // enough input to analyse.  If it's the input we lack, mark
+        // ourselves idle so that getAnalysedChunk stops waiting for
+        // us; signalDataAvailable clears the flag again.
+
+        m_condition.lock();
+        while (!m_abandoning) {
+            if (m_free.getReadSpace() == 0) {
+                m_condition.wait();
+                continue;
+            }
+            if (m_s->testInbufReadSpace(m_channel, m_draining)) {
+                break;
+            }
+            if (!m_idle) {
+                m_idle = true;
+                m_condition.signal();
+            }
+            m_condition.wait();
+        }
+        if (m_abandoning) {
+            m_condition.unlock();
+            break;
+        }
+        m_condition.unlock();
+
+        int index = m_free.readOne();
+        Frame &f = m_frames[index];
+        f.draining = m_draining;
+
+        // When draining there is no more input, and the processing
+        // thread will not use the analysis, so we can skip it.  A
+        // short chunk at the end of the input is left for the
+        // processing thread to analyse (see getAnalysedChunk).
+
+        f.analysed = false;
+
+        if (!m_draining) {
+
+            size_t ready = cd.inbuf->getReadSpace();
+            f.fill = std::min(ready, m_s->m_aWindowSize);
+            cd.inbuf->peek(f.fltbuf, f.fill);
+            cd.inbuf->skip(m_s->m_increment);
+
+            if (f.fill == m_s->m_aWindowSize) {
+
+                if (m_s->m_aWindowSize > m_s->m_fftSize) {
+                    m_s->m_afilter->cut(f.fltbuf);
+                }
+
+                if (m_fbuf) {
+                    m_s->cutShiftAndFold(m_fbuf, m_s->m_fftSize, f.fltbuf,
+                                         m_s->m_awindow);
+                    m_fft->forwardPolar(m_fbuf, f.fmag, f.fphase);
+                } else {
+                    m_s->cutShiftAndFold(m_dbuf, m_s->m_fftSize, f.fltbuf,
+                                         m_s->m_awindow);
+                    m_fft->forwardPolar(m_dbuf, f.dmag, f.dphase);
+                }
+
+                f.analysed = true;
+            }
+        }
+
+        m_ready.write(&index, 1);
+
+        m_condition.lock();
+        m_condition.signal();
+        m_condition.unlock();
+
+        // Input space has been freed and a chunk is ready: tell a
+        // caller of processNonBlocking, which does not wait for us
+        m_s->signalSpaceAvailable();
+    }
+
+    if (m_s->m_debugLevel > 1) {
+        cerr << "analysis thread " << m_channel << " abandoning" << endl;
+    }
+}
+
+void
+RubberBandStretcher::Impl::AnalysisThread::signalDataAvailable()
+{
+    m_condition.lock();
+    m_idle = false;
+    m_condition.signal();
+    m_condition.unlock();
+}
+
+void
+RubberBandStretcher::Impl::AnalysisThread::abandon()
+{
+    m_condition.lock();
+    m_abandoning = true;
+    m_condition.signal();
+    m_condition.unlock();
+}
+
+bool
+RubberBandStretcher::Impl::AnalysisThread::getAnalysedChunk(bool wait)
+{
+    // Only one of us and the analysis thread can be waiting on
+    // m_condition at any time: the analysis thread waits only when
+    // it has no free frame (so there are frames ready for us) or is
+    // idle (so we don't wait)
+
+    m_condition.lock();
+    while (wait && m_ready.getReadSpace() == 0 && !m_idle) {
+        m_condition.wait();
+    }
+    bool have = (m_ready.getReadSpace() > 0);
+    m_condition.unlock();
+
+    if (!have) return false;
+
+    ChannelData &cd = *m_s->m_channelData[m_channel];
+    const int count = m_s->m_fftSize / 2 + 1;
+
+    int index = m_ready.readOne();
+    Frame &f = m_frames[index];
+
+    // cd.fltbuf must end up as analyseChunk would have left it,
+    // because synthesiseChunk reuses it for unchanged frames
+
+    cd.draining = f.draining;
+
+    if (!f.draining) {
+        v_copy(cd.fltbuf, f.fltbuf, f.fill);
+        if (!f.analysed) {
+            m_s->analyseChunk(m_channel);
+        } else if (f.fmag) {
+            v_copy(cd.spectrum<float>().mag, f.fmag, count);
+            v_copy(cd.spectrum<float>().phase, f.fphase, count);
+        } else {
+            v_copy(cd.spectrum<double>().mag, f.dmag, count);
+            v_copy(cd.spectrum<double>().phase, f.dphase, count);
+        }
+    }
+
+    m_free.write(&index, 1);
+
+    m_condition.lock();
+    m_condition.signal();
+    m_condition.unlock();
+
+    return true;
+}
+
+RubberBandStretcher::Impl::RealTimeWorker::RealTimeWorker(Impl *s, size_t part) :
+    Thread(std::string("worker") + char('A' + part)),
+    m_s(s),
+    m_part(part),
+    m_requested(0),
+    m_claimed(0),
+    m_completed(0),
+    m_synthesis(false),
+    m_last(false),
+    m_sleeping(false),
+    m_abandoning(false)
+{ }
+
+void
+RubberBandStretcher::Impl::RealTimeWorker::run()
+{
+    AllocatorScope scope(m_s->m_allocator);
+
+    if (m_s->m_debugLevel > 1) {
+        cerr << "real-time worker " << m_part << " getting going" << endl;
+    }
+
+    unsigned int seen = 0;
+
+    while (true) {
+
+        // Spin for a while in the hope that the next chunk arrives
+        // soon, then park until dispatch() or abandon() posts.  We
+        // publish m_sleeping before re-testing m_requested, and
+        // dispatch() publishes m_requested before testing
+        // m_sleeping, so at least one of us sees the other.  A
+        // redundant post just costs us one extra trip round the loop
+
+        int spin = 0;
+        while (m_requested == seen && !m_abandoning &&
+               spin < m_s->m_rtSpinCount) {
+            ++spin;
+            system_cpu_pause();
+        }
+
+        if (m_requested == seen && !m_abandoning) {
+            m_sleeping = true;
+            if (m_requested == seen && !m_abandoning) {
+                m_wake.wait();
+            }
+            m_sleeping = false;
+            continue;
+        }
+
+        if (m_abandoning) break;
+
+        seen = m_requested;
+        if (claim(seen)) {
+            NoAllocationScope guard;
+            perform(seen);
+        }
+    }
+
+    if (m_s->m_debugLevel > 1) {
+        cerr << "real-time worker " << m_part << " abandoning" << endl;
+    }
+}
+
+bool
+RubberBandStretcher::Impl::RealTimeWorker::claim(unsigned int job)
+{
+    unsigned int previous = job - 1;
+    return m_claimed.compare_exchange_strong(previous, job);
+}
+
+void
+RubberBandStretcher::Impl::RealTimeWorker::perform(unsigned int job)
+{
+    m_last = m_s->processOneChunkPart(m_part, m_synthesis);
+    m_completed.store(job, std::memory_order_release);
+}
+
+void
+RubberBandStretcher::Impl::RealTimeWorker::dispatch(bool synthesis)
+{
+    m_synthesis = synthesis;
+    m_requested.fetch_add(1);
+    if (m_sleeping) {
+        m_wake.post();
+    }
+}
+
+bool
+RubberBandStretcher::Impl::RealTimeWorker::collect()
+{
+    unsigned int job = m_requested;
+
+    // Give the worker until the deadline to pick the job up.  If it
+    // hasn't by then, it may not have been scheduled at all, so do
+    // the job here.  If it has, all we can do is wait for it
+
+    if (m_completed.load(std::memory_order_acquire) != job) {
+
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() +
+            std::chrono::microseconds(m_s->m_rtCollectTimeout);
+
+        while (m_claimed != job) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                if (claim(job)) {
+                    perform(job);
+                }
+                break;
+            }
+            system_cpu_pause();
+        }
+
+        // The worker has the job.  It should finish well within the
+        // time we have, but if it has been preempted, spinning here
+        // only delays it further on a busy processor: give way to it
+        // after a while
+
+        int spin = 0;
+        while (m_completed.load(std::memory_order_acquire) != job) {
+            if (++spin < m_s->m_rtSpinCount) {
+                system_cpu_pause();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    return m_last;
+}
+
+void
+RubberBandStretcher::Impl::RealTimeWorker::abandon()
+{
+    m_abandoning = true;
+    m_wake.post();
+}
+
+void
+RubberBandStretcher::Impl::signalSpaceAvailable()
+{
+    m_spaceAvailable.lock();
+    ++m_spaceAvailableCount;
+    m_spaceAvailable.signal();
+    m_spaceAvailable.unlock();
+
+    NotificationCallback callback = m_notificationCallback;
+    if (callback) callback(m_notificationData);
+}
+
+RubberBandStretcher::Impl::ProcessTask::ProcessTask(Impl *s, size_t c) :
+    m_s(s),
+    m_channel(c)
+{ }
+
+void
+RubberBandStretcher::Impl::ProcessTask::run()
+{
+    // Called on a thread pool worker each time the task is scheduled,
+    // i.e. whenever process() has written more input for the channel
+
+    AllocatorScope scope(m_s->m_allocator);
+
+    ChannelData &cd = *m_s->m_channelData[m_channel];
+    if (cd.outputComplete) return;
+
+    bool any = false, last = false;
+    size_t processed = m_s->processChunks(m_channel, any, last, m_taskChunks);
+
+    if (!last && processed == m_taskChunks) {
+        // There may be more to do.  Requeue: this worker will
+        // normally pick us up again next, but an idle worker can now
+        // steal the channel instead
+        m_s->m_threadPool->schedule(this);
+    }
+
+    if (any) {
+        m_s->signalSpaceAvailable();
+    }
+
+    if (last && m_s->m_debugLevel > 1) {
+        cerr << "task " << m_channel << " done" << endl;
+    }
+}
+
+RubberBandStretcher::Impl::SegmentTask::SegmentTask(Impl *s, size_t slot) :
+    firstSlot(slot),
+    startChunk(0),
+    startOutput(0),
+    last(false),
+    inputSize(-1),
+    input(s->m_channels),
+    output(s->m_channels),
+    overlap(s->m_channels),
+    done(false),
+    m_s(s)
+{ }
+
+void
+RubberBandStretcher::Impl::SegmentTask::run()
+{
+    // Called on a thread pool worker once per segment.  Each channel
+    // of the segment is rendered into its slot from scratch, with the
+    // chunk and output counts the channel will have reached by then
+
+    AllocatorScope scope(m_s->m_allocator);
+
+    for (size_t i = 0; i < m_s->m_channels; ++i) {
+
+        size_t c = firstSlot + i;
+        ChannelData &cd = *m_s->m_channelData[c];
+
+        cd.reset();
+        cd.chunkCount = startChunk;
+        cd.outCount = startOutput;
+
+        SegmentOverlap &ov = overlap[i];
+        ov.writes.clear();
+        ov.frames.clear();
+        ov.windows.clear();
+        ov.extent = 0;
+        ov.synthesised = false;
+        ov.complete = false;
+        cd.segmentOverlap = &ov;
+
+        const std::vector<float> &in = input[i];
+        std::vector<float> &out = output[i];
+        out.clear();
+
+        size_t n = in.size(), pos = 0;
+        bool any = false, lastChunk = false;
+
+        // Feed the input as process() would feed an inbuf, a
+        // bufferful at a time, so that the input size becomes known
+        // at the same point as it would there if the final block was
+        // a large one.  The slot's outbuf has ample headroom for the
+        // output of one bufferful.
+
+        while (!lastChunk) {
+            if (pos < n) {
+                size_t toWrite = std::min(n - pos,
+                                          size_t(cd.inbuf->getWriteSpace()));
+                cd.inbuf->write(&in[pos], toWrite);
+                pos += toWrite;
+                if (last && pos == n) cd.inputSize = inputSize;
+            } else if (!last || cd.inbuf->getReadSpace() == 0) {
+                break;
+            }
+            m_s->processChunks(c, any, lastChunk);
+            size_t got = cd.outbuf->getReadSpace();
+            if (got > 0) {
+                size_t prev = out.size();
+                out.resize(prev + got);
+                cd.outbuf->read(&out[prev], got);
+            }
+            if (pos == n && !any) break;
+        }
+
+        cd.segmentOverlap = 0;
+    }
+
+    done = true;
+    m_s->signalSpaceAvailable();
+}
+
+void
+RubberBandStretcher::Impl::prepareSegments()
+{
+    // Called from process() when processing starts after a study
+    // pass.  Decide whether this input can be rendered in segments,
+    // and if so, where they start
+
+    if (!m_segmented || m_outputIncrements.empty()) return;
+
+    // If we return without creating any segment tasks, processing
+    // goes ahead with the per-channel threads (or pool tasks) set up
+    // at construction, if any
+
+    if (m_pitchScale != 1.0) {
+        if (m_debugLevel > 0) {
+            cerr << "RubberBandStretcher: segmented processing unavailable with pitch shifting, using "
+                 << (m_threaded ? "per-channel threads" : "a single thread")
+                 << endl;
+        }
+        return;
+    }
+
+    // The shift increment of chunk k - 1 is the phase increment of
+    // chunk k, so the output count at the start of chunk k is the
+    // sum of the magnitudes of the increments up to and including k.
+    // A negative increment marks a full phase reset.  Keep segments
+    // long enough for the overlap to be a small part of them.
+
+    size_t n = m_outputIncrements.size();
+
+    m_segmentStarts.clear();
+    m_segmentOutputs.clear();
+    m_segmentStarts.push_back(0);
+    m_segmentOutputs.push_back(0);
+
+    size_t start = 0, out = 0;
+
+    for (size_t k = 1; k < n; ++k) {
+        int inc = m_outputIncrements[k];
+        out += (inc < 0 ? -inc : inc);
+        if (inc < 0 &&
+            k - start >= m_minSegmentChunks &&
+            n - k >= m_minSegmentChunks) {
+            m_segmentStarts.push_back(k);
+            m_segmentOutputs.push_back(out);
+            start = k;
+        }
+    }
+
+    if (m_segmentStarts.size() < 2) {
+        if (m_debugLevel > 0) {
+            cerr << "RubberBandStretcher: no phase resets to split at, using "
+                 << (m_threaded ? "per-channel threads" : "a single thread")
+                 << endl;
+        }
+        return;
+    }
+
+    // One more task than there are threads, so as to keep them all
+    // busy while the calling thread splices
+
+    size_t depth = m_threadPool->getThreadCount() + 1;
+    if (depth < 2) depth = 2;
+
+    std::set<size_t> sizes;
+    sizes.insert(m_fftSize);
+
+    for (size_t i = 0; i < depth; ++i) {
+        SegmentTask *task = new SegmentTask(this, m_channelData.size());
+        for (size_t c = 0; c < m_channels; ++c) {
+            // Ample for the output of one inbuf's worth of input;
+            // the draining of the final segment may need more, in
+            // which case the outbuf grows as it would in threaded mode
+            m_channelData.push_back
+                (new ChannelData(sizes,
+                                 std::max(m_aWindowSize, m_sWindowSize),
+                                 m_fftSize,
+                                 m_outbufSize,
+                                 m_singlePrecision));
+            createInterpolatorCache(*m_channelData.back(),
+                                    std::max(m_aWindowSize, m_sWindowSize));
+        }
+        m_segmentTasks.push_back(task);
+        m_segmentsFree.push_back(task);
+    }
+
+    // The input starts with the same padding as the inbufs would
+    // have been given
+
+    m_segmentInput = std::vector<std::vector<float> >
+        (m_channels, std::vector<float>(m_aWindowSize/2, 0.f));
+    m_segmentInputBase = 0;
+    m_nextSegment = 0;
+
+    // The segments replace the per-channel threads
+    m_threaded = false;
+
+    if (m_debugLevel > 0) {
+        cerr << "Going multithreaded with " << m_segmentStarts.size()
+             << " segments (" << depth << " tasks)..." << endl;
+    }
+}
+
+void
+RubberBandStretcher::Impl::processSegments(const float *const *input,
+                                           size_t samples, bool final,
+                                           bool wait)
+{
+    bool useMidSide = ((m_options & OptionChannelsTogether) &&
+                       (m_channels >= 2));
+
+    if (samples > 0) {
+        for (size_t c = 0; c < m_channels; ++c) {
+            std::vector<float> &store = m_segmentInput[c];
+            size_t prev = store.size();
+            store.resize(prev + samples);
+            if (useMidSide && c < 2) {
+                prepareChannelMS(c, input, 0, samples, &store[prev]);
+            } else {
+                v_copy(&store[prev], input[c], samples);
+            }
+            m_channelData[c]->inCount += samples;
+        }
+    }
+
+    dispatchSegments(final, wait);
+
+    // Splicing may free tasks for segments we could not dispatch
+    if (spliceSegments(false) && !wait) dispatchSegments(final, false);
+}
+
+void
+RubberBandStretcher::Impl::dispatchSegments(bool final, bool wait)
+{
+    // Hand each segment whose input is complete to a free task,
+    // waiting for the oldest segment to be finished and spliced if
+    // there is none -- or, if wait is false, leaving the rest for a
+    // later call
+
+    while (m_nextSegment < m_segmentStarts.size()) {
+
+        bool last = (m_nextSegment + 1 == m_segmentStarts.size());
+
+        size_t from = m_segmentStarts[m_nextSegment] * m_increment;
+        size_t to = m_segmentInputBase + m_segmentInput[0].size();
+
+        if (last) {
+            if (!final) break;
+        } else {
+            size_t end = (m_segmentStarts[m_nextSegment + 1] - 1) *
+                m_increment + m_aWindowSize;
+            if (to < end) {
+                if (!final) break;
+                // The input ended sooner than the study suggested:
+                // render everything that is left as the last segment
+                m_segmentStarts.resize(m_nextSegment + 1);
+                last = true;
+            } else {
+                to = end;
+            }
+        }
+
+        if (m_segmentsFree.empty() && !wait) break;
+
+        while (m_segmentsFree.empty()) {
+            spliceSegments(true);
+        }
+
+        SegmentTask *task = m_segmentsFree.back();
+        m_segmentsFree.pop_back();
+
+        task->startChunk = m_segmentStarts[m_nextSegment];
+        task->startOutput = m_segmentOutputs[m_nextSegment];
+        task->last = last;
+        task->inputSize = m_channelData[0]->inCount;
+        task->done = false;
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            std::vector<float> &store = m_segmentInput[c];
+            task->input[c].assign(store.begin() + (from - m_segmentInputBase),
+                                  store.begin() + (to - m_segmentInputBase));
+        }
+
+        m_segmentsPending.push_back(task);
+        m_threadPool->schedule(task);
+
+        ++m_nextSegment;
+
+        // Drop the input that no later segment needs
+
+        if (!last) {
+            size_t next = m_segmentStarts[m_nextSegment] * m_increment;
+            for (size_t c = 0; c < m_channels; ++c) {
+                std::vector<float> &store = m_segmentInput[c];
+                store.erase(store.begin(),
+                            store.begin() + (next - m_segmentInputBase));
+            }
+            m_segmentInputBase = next;
+        }
+    }
+}
+
+bool
+RubberBandStretcher::Impl::spliceSegments(bool wait)
+{
+    // Splice finished segments onto the output in order.  If wait is
+    // true and the oldest segment is still being rendered, wait for
+    // it first.  Return true if any segment was spliced.
+
+    bool spliced = false;
+
+    while (!m_segmentsPending.empty()) {
+
+        SegmentTask *task = m_segmentsPending.front();
+
+        if (!task->done) {
+            if (!wait || spliced) break;
+            m_spaceAvailable.lock();
+            while (!task->done) {
+                m_spaceAvailable.wait();
+            }
+            m_spaceAvailable.unlock();
+        }
+
+        // The task sets its done flag just before returning
+        m_threadPool->cancel(task);
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            spliceSegment(task, c);
+        }
+
+        m_segmentsPending.pop_front();
+        m_segmentsFree.push_back(task);
+        spliced = true;
+    }
+
+    return spliced;
+}
+
+void
+RubberBandStretcher::Impl::spliceSegment(SegmentTask *task, size_t c)
+{
+    ChannelData &cd = *m_channelData[c];
+    ChannelData &scd = *m_channelData[task->firstSlot + c];
+
+    const SegmentOverlap &overlap = task->overlap[c];
+    const std::vector<float> &out = task->output[c];
+
+    size_t required = overlap.extent + out.size();
+    size_t ws = cd.outbuf->getWriteSpace();
+    if (ws < required) {
+        cd.setOutbufSize(cd.outbuf->getSize() + required);
+    }
+
+    // Replay the start of the segment on top of the accumulators as
+    // the previous segment left them.  This writes the output for
+    // which the two segments overlap.
+
+    const int sz = m_sWindowSize;
+    size_t before = cd.outbuf->getReadSpace();
+    size_t frame = 0;
+
+    for (size_t i = 0; i < overlap.writes.size(); ++i) {
+        const SegmentOverlap::Write &write = overlap.writes[i];
+        if (write.synthesised) {
+            v_add(cd.accumulator, &overlap.frames[frame], sz);
+            if (m_sWindowSize > m_fftSize) {
+                v_add(cd.windowAccumulator, &overlap.windows[frame], sz);
+            } else {
+                m_swindow->add(cd.windowAccumulator,
+                               m_awindow->getArea() * 1.5f);
+            }
+            frame += sz;
+        }
+        cd.inputSize = write.inputSize;
+        writeChunk(c, write.shiftIncrement, false);
+    }
+
+    // The slot wrote the same amount for these chunks: take the rest
+    // of its output as it is
+
+    size_t written = cd.outbuf->getReadSpace() - before;
+    if (written < out.size()) {
+        cd.outbuf->write(&out[written], out.size() - written);
+    }
+
+    // If the segment got past the overlap, the slot's accumulators
+    // are now correct; otherwise the replay has left ours correct
+
+    if (overlap.complete) {
+        v_copy(cd.accumulator, scd.accumulator, sz);
+        v_copy(cd.windowAccumulator, scd.windowAccumulator, sz);
+    }
+
+    cd.accumulatorFill = scd.accumulatorFill;
+    cd.chunkCount = scd.chunkCount;
+    cd.outCount = scd.outCount;
+    cd.inputSize = scd.inputSize;
+    cd.draining = scd.draining;
 
-    if (m_s->m_debugLevel > 1) {
-        cerr << "thread " << m_channel << " done" << endl;
+    if (task->last) {
+        MBARRIER();
+        cd.outputComplete = scd.outputComplete;
     }
 }
 
 void
-RubberBandStretcher::Impl::ProcessThread::signalDataAvailable()
+RubberBandStretcher::Impl::clearSegments()
 {
-    m_dataAvailable.lock();
-    m_dataAvailable.signal();
-    m_dataAvailable.unlock();
-}
+    for (size_t i = 0; i < m_segmentTasks.size(); ++i) {
+        m_threadPool->cancel(m_segmentTasks[i]);
+        delete m_segmentTasks[i];
+    }
+    m_segmentTasks.clear();
+    m_segmentsPending.clear();
+    m_segmentsFree.clear();
 
-void
-RubberBandStretcher::Impl::ProcessThread::abandon()
-{
-    m_abandoning = true;
+    for (size_t c = m_channels; c < m_channelData.size(); ++c) {
+        delete m_channelData[c];
+    }
+    if (m_channelData.size() > m_channels) {
+        m_channelData.resize(m_channels);
+    }
+
+    m_segmentStarts.clear();
+    m_segmentOutputs.clear();
+    m_segmentInput.clear();
+    m_segmentInputBase = 0;
+    m_nextSegment = 0;
 }
 
 bool
@@ -192,9 +1024,17 @@ RubberBandStretcher::Impl::consumeChannel(size_t c,
 
         size_t reqSize = int(ceil(samples / m_pitchScale));
         if (reqSize > cd.resamplebufSize) {
-            cerr << "WARNING: RubberBandStretcher::Impl::consumeChannel: resizing resampler buffer from "
-                 << cd.resamplebufSize << " to " << reqSize << endl;
-            cd.setResampleBufSize(reqSize);
+            if (m_realtime) {
+                // We can't reallocate in RT mode: take only as much
+                // input as the buffer has room for, and leave the
+                // rest for process() to come back to
+                samples = int(floor(cd.resamplebufSize * m_pitchScale));
+                if (samples == 0) return 0;
+            } else {
+                cerr << "WARNING: RubberBandStretcher::Impl::consumeChannel: resizing resampler buffer from "
+                     << cd.resamplebufSize << " to " << reqSize << endl;
+                cd.setResampleBufSize(reqSize);
+            }
         }
 
         if (useMidSide) {
@@ -239,12 +1079,15 @@ RubberBandStretcher::Impl::consumeChannel(size_t c,
     }
 }
 
-void
-RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
+size_t
+RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last,
+                                         size_t maxChunks, bool wait)
 {
     // Process as many chunks as there are available on the input
-    // buffer for channel c.  This requires that the increments have
-    // already been calculated.
+    // buffer for channel c, up to maxChunks if non-zero, returning
+    // the number processed.  This requires that the increments have
+    // already been calculated.  If wait is false, don't wait for the
+    // analysis thread (if any) to analyse further chunks.
 
     // This is the normal process method in offline mode.
 
@@ -253,11 +1096,37 @@ RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
     last = false;
     any = false;
 
-    float *tmp = 0;
+    // With pipelined analysis, the input has already been read and
+    // analysed for us by the channel's AnalysisThread, which also
+    // tells us when we are draining
+
+    size_t processed = 0;
+
+    AnalysisThread *analyser = 0;
+    if (!m_analysisThreads.empty()) {
+        analyser = m_analysisThreads[c];
+        if (cd.outputComplete) return processed;
+    }
 
     while (!last) {
 
-        if (!testInbufReadSpace(c)) {
+        if (maxChunks > 0 && processed == maxChunks) break;
+
+        if (m_threaded && testOutputThrottled(c)) {
+            if (m_debugLevel > 2) {
+                cerr << "processChunks: output buffer at limit" << endl;
+            }
+            break;
+        }
+
+        if (analyser) {
+            if (!analyser->getAnalysedChunk(wait)) {
+                if (m_debugLevel > 2) {
+                    cerr << "processChunks: out of analysed input" << endl;
+                }
+                break;
+            }
+        } else if (!testInbufReadSpace(c)) {
             if (m_debugLevel > 2) {
                 cerr << "processChunks: out of input" << endl;
             }
@@ -266,11 +1135,9 @@ RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
 
         any = true;
 
-        if (!cd.draining) {
-            size_t ready = cd.inbuf->getReadSpace();
-            assert(ready >= m_aWindowSize || cd.inputSize >= 0);
-            cd.inbuf->peek(cd.fltbuf, std::min(ready, m_aWindowSize));
-            cd.inbuf->skip(m_increment);
+        if (!analyser) {
+            if (!cd.draining) analyseInput(c);
+            else analyseChunk(c);
         }
 
         bool phaseReset = false;
@@ -278,7 +1145,6 @@ RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
         getIncrements(c, phaseIncrement, shiftIncrement, phaseReset);
 
         if (shiftIncrement <= m_aWindowSize) {
-            analyseChunk(c);
             last = processChunkForChannel
                 (c, phaseIncrement, shiftIncrement, phaseReset);
         } else {
@@ -286,11 +1152,9 @@ RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
             if (m_debugLevel > 1) {
                 cerr << "channel " << c << " breaking down overlong increment " << shiftIncrement << " into " << bit << "-size bits" << endl;
             }
-            if (!tmp) tmp = allocate<float>(m_aWindowSize);
-            analyseChunk(c);
-            v_copy(tmp, cd.fltbuf, m_aWindowSize);
+            v_copy(cd.fltspare, cd.fltbuf, m_aWindowSize);
             for (size_t i = 0; i < shiftIncrement; i += bit) {
-                v_copy(cd.fltbuf, tmp, m_aWindowSize);
+                v_copy(cd.fltbuf, cd.fltspare, m_aWindowSize);
                 size_t thisIncrement = bit;
                 if (i + thisIncrement > shiftIncrement) {
                     thisIncrement = shiftIncrement - i;
@@ -302,12 +1166,13 @@ RubberBandStretcher::Impl::processChunks(size_t c, bool &any, bool &last)
         }
 
         cd.chunkCount++;
+        ++processed;
         if (m_debugLevel > 2) {
             cerr << "channel " << c << ": last = " << last << ", chunkCount = " << cd.chunkCount << endl;
         }
     }
 
-    if (tmp) deallocate(tmp);
+    return processed;
 }
 
 bool
@@ -319,6 +1184,50 @@ RubberBandStretcher::Impl::processOneChunk()
 
     // This is the normal process method in RT mode.
 
+    if (!m_rtWorkers.empty()) {
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            if (!testInbufReadSpace(c)) {
+                if (m_debugLevel > 2) {
+                    cerr << "processOneChunk: out of input" << endl;
+                }
+                return false;
+            }
+        }
+
+        // Analysis and synthesis of each channel are independent of
+        // the other channels, but the increments are calculated from
+        // all of them together, so we have two rounds of handoff
+
+        for (size_t i = 0; i < m_rtWorkers.size(); ++i) {
+            m_rtWorkers[i]->dispatch(false);
+        }
+        processOneChunkPart(0, false);
+        for (size_t i = 0; i < m_rtWorkers.size(); ++i) {
+            m_rtWorkers[i]->collect();
+        }
+
+        m_rtPhaseReset = false;
+        if (!getIncrements(0, m_rtPhaseIncrement, m_rtShiftIncrement,
+                           m_rtPhaseReset)) {
+            calculateIncrements(m_rtPhaseIncrement, m_rtShiftIncrement,
+                                m_rtPhaseReset);
+        }
+
+        for (size_t i = 0; i < m_rtWorkers.size(); ++i) {
+            m_rtWorkers[i]->dispatch(true);
+        }
+        bool last = processOneChunkPart(0, true);
+        for (size_t i = 0; i < m_rtWorkers.size(); ++i) {
+            bool workerLast = m_rtWorkers[i]->collect();
+            if ((m_channels - 1) % (m_rtWorkers.size() + 1) == i + 1) {
+                last = workerLast;
+            }
+        }
+
+        return last;
+    }
+
     for (size_t c = 0; c < m_channels; ++c) {
         if (!testInbufReadSpace(c)) {
             if (m_debugLevel > 2) {
@@ -328,11 +1237,7 @@ RubberBandStretcher::Impl::processOneChunk()
         }
         ChannelData &cd = *m_channelData[c];
         if (!cd.draining) {
-            size_t ready = cd.inbuf->getReadSpace();
-            assert(ready >= m_aWindowSize || cd.inputSize >= 0);
-            cd.inbuf->peek(cd.fltbuf, std::min(ready, m_aWindowSize));
-            cd.inbuf->skip(m_increment);
-            analyseChunk(c);
+            analyseInput(c);
         }
     }
 
@@ -351,17 +1256,98 @@ RubberBandStretcher::Impl::processOneChunk()
     return last;
 }
 
+bool
+RubberBandStretcher::Impl::processOneChunkPart(size_t part, bool synthesis)
+{
+    // Analyse (or synthesise) the channels belonging to one share of
+    // a threaded real-time chunk.  Called on the calling thread for
+    // part 0, and on RealTimeWorker part for the others.  Returns
+    // the "last" flag for the last channel in this share.
+
+    size_t parts = m_rtWorkers.size() + 1;
+    bool last = false;
+
+    for (size_t c = part; c < m_channels; c += parts) {
+        ChannelData &cd = *m_channelData[c];
+        if (!synthesis) {
+            if (!cd.draining) {
+                analyseInput(c);
+            }
+        } else {
+            last = processChunkForChannel
+                (c, m_rtPhaseIncrement, m_rtShiftIncrement, m_rtPhaseReset);
+            cd.chunkCount++;
+        }
+    }
+
+    return last;
+}
+
+bool
+RubberBandStretcher::Impl::testOutputThrottled(size_t c)
+{
+    // Called by a processing thread before it processes a chunk.
+    // Once the input size is known we always carry on to the end, as
+    // the caller may not retrieve anything until then; the remaining
+    // input is no more than an inbuf's worth
+
+    if (m_outbufLimit == 0 || m_processWaiting) return false;
+
+    ChannelData &cd = *m_channelData[c];
+    if (cd.inputSize >= 0) return false;
+    if (size_t(cd.outbuf->getReadSpace()) < m_outbufLimit) return false;
+
+    m_outputThrottled = true;
+    return true;
+}
+
+void
+RubberBandStretcher::Impl::wakeThrottled()
+{
+    // Called from retrieve() after reading, so that any thread that
+    // stopped at the output buffer limit can see that there is space
+
+    if (!m_outputThrottled.exchange(false)) return;
+
+    for (ThreadSet::iterator i = m_threadSet.begin();
+         i != m_threadSet.end(); ++i) {
+        (*i)->signalDataAvailable();
+    }
+    for (TaskList::iterator i = m_taskList.begin();
+         i != m_taskList.end(); ++i) {
+        m_threadPool->schedule(*i);
+    }
+}
+
 bool
 RubberBandStretcher::Impl::testInbufReadSpace(size_t c)
 {
+    return testInbufReadSpace(c, m_channelData[c]->draining);
+}
+
+bool
+RubberBandStretcher::Impl::testInbufReadSpace(size_t c, bool &draining)
+{
+    // The draining flag is normally that of the channel, but an
+    // AnalysisThread reads the input ahead of the rest of the
+    // channel's processing and so keeps its own
+
     ChannelData &cd = *m_channelData[c];
     RingBuffer<float> &inbuf = *cd.inbuf;
 
+    // In threaded mode, process() sets the input size only after
+    // writing the final input, so we must read it before the read
+    // space.  Otherwise we could see the new input size together
+    // with a stale read space, and start draining too early.
+
+    long inputSize = cd.inputSize;
+    MBARRIER();
+
     size_t rs = inbuf.getReadSpace();
 
-    if (rs < m_aWindowSize && !cd.draining) {
+    if (rs < m_aWindowSize && !draining) {
 
-        if (cd.inputSize == -1) {
+        if (inputSize == -1) {
 
             // Not all the input data has been written to the inbuf
             // (that's why the input size is not yet set).  We can't
@@ -394,7 +1380,7 @@ RubberBandStretcher::Impl::testInbufReadSpace(size_t c)
                 cerr << "read space = " << rs << ", setting draining true" << endl;
             }
 
-            cd.draining = true;
+            draining = true;
         }
     }
 
@@ -435,7 +1421,7 @@ RubberBandStretcher::Impl::processChunkForChannel(size_t c,
         // then skip m_increment to advance the read pointer.
 
         modifyChunk(c, phaseIncrement, phaseReset);
-        synthesiseChunk(c, shiftIncrement); // reads from cd.mag, cd.phase
+        synthesiseChunk(c, shiftIncrement); // reads from mag, phase
 
         if (m_debugLevel > 2) {
             if (phaseReset) {
@@ -475,7 +1461,7 @@ RubberBandStretcher::Impl::processChunkForChannel(size_t c,
 
     int ws = cd.outbuf->getWriteSpace();
     if (ws < required) {
-        if (m_debugLevel > 0) {
+        if (m_debugLevel > 0 && !m_threaded) {
             cerr << "Buffer overrun on output for channel " << c << endl;
         }
 
@@ -487,9 +1473,47 @@ RubberBandStretcher::Impl::processChunkForChannel(size_t c,
         // input increments to allow the process() call to complete.
         // This is an unhappy situation.
 
-        RingBuffer<float> *oldbuf = cd.outbuf;
-        cd.outbuf = oldbuf->resized(oldbuf->getSize() + (required - ws));
-        m_emergencyScavenger.claim(oldbuf);
+        // In offline threaded mode we exclude readers during the
+        // copy, so that the output does not depend on when the client
+        // happened to read, and can then delete the old buffer at
+        // once.  That is also the mode in which this is the normal
+        // way for the buffer to grow to follow the backlog (see
+        // m_outbufLimit).  Otherwise the old buffer may still be
+        // being read by retrieve() or available() on another thread,
+        // so hand it to the scavenger only after publishing the new
+        // one (see m_emergencyScavenger).  Grow geometrically, so
+        // that a long run of overruns (e.g. from one very large
+        // process() call) does not copy the buffer over and over
+
+        // In RT mode we must not allocate here.  process() has
+        // already made room for everything the current block can
+        // produce (see prepareOutbufs), so this should not happen;
+        // if it does, the buffer keeps its size and the excess
+        // output is lost
+
+        if (m_realtime) {
+            writeChunk(c, shiftIncrement, last);
+            return last;
+        }
+
+        MutexLocker locker(m_threaded ? &m_outbufMutex : 0);
+        ws = cd.outbuf->getWriteSpace();
+        if (ws < required) {
+            RingBuffer<float> *oldbuf = cd.outbuf;
+            size_t size = std::max(size_t(oldbuf->getSize() + (required - ws)),
+                                   size_t(oldbuf->getSize()) * 2);
+            if (m_debugLevel > 1) {
+                cerr << "Growing output buffer for channel " << c
+                     << " to " << size << endl;
+            }
+            cd.outbuf = oldbuf->resized(size);
+            if (m_threaded) {
+                // Every reader holds the mutex, so none has the old one
+                delete oldbuf;
+            } else {
+                m_emergencyScavenger.claim(oldbuf);
+            }
+        }
     }
 
     writeChunk(c, shiftIncrement, last);
@@ -530,47 +1554,13 @@ RubberBandStretcher::Impl::calculateIncrements(size_t &phaseIncrementRtn,
         }
     }
 
-    const int hs = m_fftSize/2 + 1;
-
-    // Normally we would mix down the time-domain signal and apply a
-    // single FFT, or else mix down the Cartesian form of the
-    // frequency-domain signal.  Both of those would be inefficient
-    // from this position.  Fortunately, the onset detectors should
-    // work reasonably well (maybe even better?) if we just sum the
-    // magnitudes of the frequency-domain channel signals and forget
-    // about phase entirely.  Normally we don't expect the channel
-    // phases to cancel each other, and broadband effects will still
-    // be apparent.
-
     float df = 0.f;
     bool silent = false;
 
-    if (m_channels == 1) {
-
-        if (sizeof(process_t) == sizeof(double)) {
-            df = m_phaseResetAudioCurve->processDouble((double *)cd.mag, m_increment);
-            silent = (m_silentAudioCurve->processDouble((double *)cd.mag, m_increment) > 0.f);
-        } else {
-            df = m_phaseResetAudioCurve->processFloat((float *)cd.mag, m_increment);
-            silent = (m_silentAudioCurve->processFloat((float *)cd.mag, m_increment) > 0.f);
-        }
-
+    if (m_singlePrecision) {
+        calculateCurveValues<float>(df, silent);
     } else {
-
-        process_t *tmp = (process_t *)alloca(hs * sizeof(process_t));
-
-        v_zero(tmp, hs);
-        for (size_t c = 0; c < m_channels; ++c) {
-            v_add(tmp, m_channelData[c]->mag, hs);
-        }
-
-        if (sizeof(process_t) == sizeof(double)) {
-            df = m_phaseResetAudioCurve->processDouble((double *)tmp, m_increment);
-            silent = (m_silentAudioCurve->processDouble((double *)tmp, m_increment) > 0.f);
-        } else {
-            df = m_phaseResetAudioCurve->processFloat((float *)tmp, m_increment);
-            silent = (m_silentAudioCurve->processFloat((float *)tmp, m_increment) > 0.f);
-        }
+        calculateCurveValues<double>(df, silent);
     }
 
     int incr = m_stretchCalculator->calculateSingle
@@ -623,13 +1613,58 @@ RubberBandStretcher::Impl::calculateIncrements(size_t &phaseIncrementRtn,
     }
 }
 
+template <typename T>
+void
+RubberBandStretcher::Impl::calculateCurveValues(float &df, bool &silent)
+{
+    // Calculate the phase-reset and silence curve values for the
+    // current chunk, from the magnitudes of all channels.  This is
+    // only used in real-time mode (see calculateIncrements).
+
+    ChannelData &cd = *m_channelData[0];
+
+    const int hs = m_fftSize/2 + 1;
+
+    // Normally we would mix down the time-domain signal and apply a
+    // single FFT, or else mix down the Cartesian form of the
+    // frequency-domain signal.  Both of those would be inefficient
+    // from this position.  Fortunately, the onset detectors should
+    // work reasonably well (maybe even better?) if we just sum the
+    // magnitudes of the frequency-domain channel signals and forget
+    // about phase entirely.  Normally we don't expect the channel
+    // phases to cancel each other, and broadband effects will still
+    // be apparent.
+
+    const T *mag = cd.spectrum<T>().mag;
+
+    if (m_channels > 1) {
+
+        T *tmp = cd.spectrum<T>().spare;
+
+        v_zero(tmp, hs);
+        for (size_t c = 0; c < m_channels; ++c) {
+            v_add(tmp, m_channelData[c]->spectrum<T>().mag, hs);
+        }
+
+        mag = tmp;
+    }
+
+    if (sizeof(T) == sizeof(double)) {
+        df = m_phaseResetAudioCurve->processDouble((const double *)mag, m_increment);
+        silent = (m_silentAudioCurve->processDouble((const double *)mag, m_increment) > 0.f);
+    } else {
+        df = m_phaseResetAudioCurve->processFloat((const float *)mag, m_increment);
+        silent = (m_silentAudioCurve->processFloat((const float *)mag, m_increment) > 0.f);
+    }
+}
+
 bool
 RubberBandStretcher::Impl::getIncrements(size_t channel,
                                          size_t &phaseIncrementRtn,
                                          size_t &shiftIncrementRtn,
                                          bool &phaseReset)
 {
-    if (channel >= m_channels) {
+    if (channel >= m_channelData.size()) {
         phaseIncrementRtn = m_increment;
         shiftIncrementRtn = m_increment;
         phaseReset = false;
@@ -698,36 +1733,100 @@ RubberBandStretcher::Impl::getIncrements(size_t channel,
 }
 
 void
-RubberBandStretcher::Impl::analyseChunk(size_t channel)
+RubberBandStretcher::Impl::analyseInput(size_t channel)
+{
+    // Analyse the next m_aWindowSize samples from the channel's input
+    // buffer and advance it by one increment.  Where the input is
+    // contiguous in the buffer (always, if it is mirrored) we window
+    // it from there directly rather than copying it out first
+
+    ChannelData &cd = *m_channelData[channel];
+
+    size_t ready = cd.inbuf->getReadSpace();
+    assert(ready >= m_aWindowSize || cd.inputSize >= 0);
+
+    const float *input = 0;
+    if (ready >= m_aWindowSize) {
+        input = cd.inbuf->getReadPointer(int(m_aWindowSize));
+    }
+    if (!input) {
+        cd.inbuf->peek(cd.fltbuf, std::min(ready, m_aWindowSize));
+    }
+
+    analyseChunk(channel, input);
+
+    cd.inbuf->skip(m_increment);
+}
+
+void
+RubberBandStretcher::Impl::analyseChunk(size_t channel, const float *input)
+{
+    if (m_singlePrecision) {
+        analyseChunk<float>(channel, input);
+    } else {
+        analyseChunk<double>(channel, input);
+    }
+}
+
+template <typename T>
+void
+RubberBandStretcher::Impl::analyseChunk(size_t channel, const float *input)
 {
     ChannelData &cd = *m_channelData[channel];
+    ChannelData::Spectrum<T> &spec = cd.spectrum<T>();
 
-    process_t *const dblbuf = cd.dblbuf;
+    T *const dblbuf = spec.dblbuf;
     float *const fltbuf = cd.fltbuf;
 
-    // cd.fltbuf is known to contain m_aWindowSize samples
+    // Either input or cd.fltbuf is known to contain m_aWindowSize
+    // samples.  Either way, fltbuf is left containing the windowed
+    // frame, as synthesis may use it
 
-    if (m_aWindowSize > m_fftSize) {
-        m_afilter->cut(fltbuf);
+    if (input) {
+        if (m_aWindowSize > m_fftSize) {
+            m_afilter->cut(input, fltbuf);
+            m_awindow->cut(fltbuf);
+        } else {
+            m_awindow->cut(input, fltbuf);
+        }
+    } else {
+        if (m_aWindowSize > m_fftSize) {
+            m_afilter->cut(fltbuf);
+        }
+        m_awindow->cut(fltbuf);
     }
 
-    cutShiftAndFold(dblbuf, m_fftSize, fltbuf, m_awindow);
+    shiftAndFold(dblbuf, m_fftSize, fltbuf, int(m_aWindowSize));
+
+    cd.fft->forwardPolar(dblbuf, spec.mag, spec.phase);
+}
 
-    cd.fft->forwardPolar(dblbuf, cd.mag, cd.phase);
+void
+RubberBandStretcher::Impl::modifyChunk(size_t channel,
+                                       size_t outputIncrement,
+                                       bool phaseReset)
+{
+    if (m_singlePrecision) {
+        modifyChunk<float>(channel, outputIncrement, phaseReset);
+    } else {
+        modifyChunk<double>(channel, outputIncrement, phaseReset);
+    }
 }
 
+template <typename T>
 void
 RubberBandStretcher::Impl::modifyChunk(size_t channel,
                                        size_t outputIncrement,
                                        bool phaseReset)
 {
     ChannelData &cd = *m_channelData[channel];
+    ChannelData::Spectrum<T> &spec = cd.spectrum<T>();
 
     if (phaseReset && m_debugLevel > 1) {
         cerr << "phase reset: leaving phases unmodified" << endl;
     }
 
-    const process_t rate = m_sampleRate;
+    const T rate = m_sampleRate;
     const int count = m_fftSize / 2;
 
     bool unchanged = cd.unchanged && (outputIncrement == m_increment);
@@ -760,15 +1859,15 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
     if (limit1 < limit0) limit1 = limit0;
     if (limit2 < limit1) limit2 = limit1;
 
-    process_t prevInstability = 0.0;
+    T prevInstability = 0.0;
     bool prevDirection = false;
 
-    process_t distance = 0.0;
-    const process_t maxdist = 8.0;
+    T distance = 0.0;
+    const T maxdist = 8.0;
 
     const int lookback = 1;
 
-    process_t distacc = 0.0;
+    T distacc = 0.0;
 
     for (int i = count; i >= 0; i -= lookback) {
 
@@ -783,25 +1882,25 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
             }
         }
 
-        process_t p = cd.phase[i];
-        process_t perr = 0.0;
-        process_t outphase = p;
+        T p = spec.phase[i];
+        T perr = 0.0;
+        T outphase = p;
 
-        process_t mi = maxdist;
+        T mi = maxdist;
         if (i <= limit0) mi = 0.0;
         else if (i <= limit1) mi = 1.0;
         else if (i <= limit2) mi = 3.0;
 
         if (!resetThis) {
 
-            process_t omega = (2 * M_PI * m_increment * i) / (m_fftSize);
+            T omega = (2 * M_PI * m_increment * i) / (m_fftSize);
 
-            process_t pp = cd.prevPhase[i];
-            process_t ep = pp + omega;
+            T pp = spec.prevPhaseAt(i);
+            T ep = pp + omega;
             perr = princarg(p - ep);
 
-            process_t instability = fabs(perr - cd.prevError[i]);
-            bool direction = (perr > cd.prevError[i]);
+            T instability = fabs(perr - spec.prevErrorAt(i));
+            bool direction = (perr > spec.prevErrorAt(i));
 
             bool inherit = false;
 
@@ -816,11 +1915,11 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
                 }
             }
 
-            process_t advance = outputIncrement * ((omega + perr) / m_increment);
+            T advance = outputIncrement * ((omega + perr) / m_increment);
 
             if (inherit) {
-                process_t inherited =
-                    cd.unwrappedPhase[i + lookback] - cd.prevPhase[i + lookback];
+                T inherited =
+                    spec.unwrappedPhaseAt(i + lookback) - spec.prevPhaseAt(i + lookback);
                 advance = ((advance * distance) +
                            (inherited * (maxdist - distance)))
                     / maxdist;
@@ -828,7 +1927,7 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
                 distacc += distance;
                 distance += 1.0;
             } else {
-                outphase = cd.unwrappedPhase[i] + advance;
+                outphase = spec.unwrappedPhaseAt(i) + advance;
                 distance = 0.0;
             }
 
@@ -839,10 +1938,10 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
             distance = 0.0;
         }
 
-        cd.prevError[i] = perr;
-        cd.prevPhase[i] = p;
-        cd.phase[i] = outphase;
-        cd.unwrappedPhase[i] = outphase;
+        spec.prevErrorAt(i) = perr;
+        spec.prevPhaseAt(i) = p;
+        spec.phase[i] = outphase;
+        spec.unwrappedPhaseAt(i) = outphase;
     }
 
     if (m_debugLevel > 2) {
@@ -858,18 +1957,20 @@ RubberBandStretcher::Impl::modifyChunk(size_t channel,
 }
 
 
+template <typename T>
 void
 RubberBandStretcher::Impl::formantShiftChunk(size_t channel)
 {
     ChannelData &cd = *m_channelData[channel];
+    ChannelData::Spectrum<T> &spec = cd.spectrum<T>();
 
-    process_t *const mag = cd.mag;
-    process_t *const envelope = cd.envelope;
-    process_t *const dblbuf = cd.dblbuf;
+    T *const mag = spec.mag;
+    T *const envelope = spec.envelope;
+    T *const dblbuf = spec.dblbuf;
 
     const int sz = m_fftSize;
     const int hs = sz / 2;
-    const process_t factor = 1.0 / sz;
+    const T factor = 1.0 / sz;
 
     cd.fft->inverseCepstral(mag, dblbuf);
 
@@ -886,7 +1987,7 @@ RubberBandStretcher::Impl::formantShiftChunk(size_t channel)
 
     v_scale(dblbuf, factor, cutoff);
 
-    process_t *spare = (process_t *)alloca((hs + 1) * sizeof(process_t));
+    T *spare = spec.spare;
     cd.fft->forward(dblbuf, envelope, spare);
 
     v_exp(envelope, hs + 1);
@@ -916,18 +2017,31 @@ RubberBandStretcher::Impl::formantShiftChunk(size_t channel)
     cd.unchanged = false;
 }
 
+void
+RubberBandStretcher::Impl::synthesiseChunk(size_t channel,
+                                           size_t shiftIncrement)
+{
+    if (m_singlePrecision) {
+        synthesiseChunk<float>(channel, shiftIncrement);
+    } else {
+        synthesiseChunk<double>(channel, shiftIncrement);
+    }
+}
+
+template <typename T>
 void
 RubberBandStretcher::Impl::synthesiseChunk(size_t channel,
                                            size_t shiftIncrement)
 {
     if ((m_options & OptionFormantPreserved) &&
         (m_pitchScale != 1.0)) {
-        formantShiftChunk(channel);
+        formantShiftChunk<T>(channel);
     }
 
     ChannelData &cd = *m_channelData[channel];
+    ChannelData::Spectrum<T> &spec = cd.spectrum<T>();
 
-    process_t *const dblbuf = cd.dblbuf;
+    T *const dblbuf = spec.dblbuf;
     float *const fltbuf = cd.fltbuf;
     float *const accumulator = cd.accumulator;
     float *const windowAccumulator = cd.windowAccumulator;
@@ -943,9 +2057,9 @@ RubberBandStretcher::Impl::synthesiseChunk(size_t channel,
         // transform rather than after, to avoid overflow if using a
         // fixed-point FFT.
         float factor = 1.f / fsz;
-        v_scale(cd.mag, factor, hs + 1);
+        v_scale(spec.mag, factor, hs + 1);
 
-        cd.fft->inversePolar(cd.mag, cd.phase, cd.dblbuf);
+        cd.fft->inversePolar(spec.mag, spec.phase, dblbuf);
 
         if (wsz == fsz) {
             v_convert(fltbuf, dblbuf + hs, hs);
@@ -964,7 +2078,15 @@ RubberBandStretcher::Impl::synthesiseChunk(size_t channel,
     if (wsz > fsz) {
         int p = shiftIncrement * 2;
         if (cd.interpolatorScale != p) {
-            SincWindow<float>::write(cd.interpolator, wsz, p);
+            SincWindowMap::const_iterator i = m_interpolators.find(p);
+            if (i != m_interpolators.end() &&
+                i->second->getSize() == wsz) {
+                v_copy(cd.interpolator, i->second->getValues(), wsz);
+            } else if (cd.interpolatorCache) {
+                cd.interpolatorCache->write(cd.interpolator, wsz, p);
+            } else {
+                SincWindow<float>::write(cd.interpolator, wsz, p);
+            }
             cd.interpolatorScale = p;
         }
         v_multiply(fltbuf, cd.interpolator, wsz);
@@ -974,12 +2096,22 @@ RubberBandStretcher::Impl::synthesiseChunk(size_t channel,
     v_add(accumulator, fltbuf, wsz);
     cd.accumulatorFill = wsz;
 
+    SegmentOverlap *overlap = cd.segmentOverlap;
+    if (overlap) {
+        overlap->frames.insert(overlap->frames.end(), fltbuf, fltbuf + wsz);
+        overlap->synthesised = true;
+    }
+
     if (wsz > fsz) {
         // reuse fltbuf to calculate interpolating window shape for
         // window accumulator
         v_copy(fltbuf, cd.interpolator, wsz);
         m_swindow->cut(fltbuf);
         v_add(windowAccumulator, fltbuf, wsz);
+        if (overlap) {
+            overlap->windows.insert(overlap->windows.end(),
+                                    fltbuf, fltbuf + wsz);
+        }
     } else {
         m_swindow->add(windowAccumulator, m_awindow->getArea() * 1.5f);
     }
@@ -1000,6 +2132,22 @@ RubberBandStretcher::Impl::writeChunk(size_t channel, size_t shiftIncrement, boo
         cerr << "writeChunk(" << channel << ", " << shiftIncrement << ", " << last << ")" << endl;
     }
 
+    if (SegmentOverlap *overlap = cd.segmentOverlap) {
+        SegmentOverlap::Write write;
+        write.shiftIncrement = si;
+        write.inputSize = cd.inputSize;
+        write.synthesised = overlap->synthesised;
+        overlap->writes.push_back(write);
+        overlap->synthesised = false;
+        overlap->extent += si;
+        if (overlap->extent >= size_t(sz)) {
+            // Output beyond here no longer depends on anything the
+            // previous segment added to the accumulators
+            overlap->complete = true;
+            cd.segmentOverlap = 0;
+        }
+    }
+
     v_divide(accumulator, windowAccumulator, si);
 
     // for exact sample scaling (probably not meaningful if we
@@ -1015,26 +2163,40 @@ RubberBandStretcher::Impl::writeChunk(size_t channel, size_t shiftIncrement, boo
         (m_pitchScale != 1.0 || m_options & OptionPitchHighConsistency) &&
         cd.resampler) {
 
+        // The resample buffer is supposed to be initialised with
+        // enough space in the first place, but the pitch scale may
+        // have changed since then, or the stretch calculator may have
+        // gone mad, or something.  Outside RT mode we can just grow
+        // it; in RT mode we resample the chunk in as many pieces as
+        // it takes instead
+
         size_t reqSize = int(ceil(si / m_pitchScale));
-        if (reqSize > cd.resamplebufSize) {
-            // This shouldn't normally happen -- the buffer is
-            // supposed to be initialised with enough space in the
-            // first place.  But we retain this check in case the
-            // pitch scale has changed since then, or the stretch
-            // calculator has gone mad, or something.
+        if (reqSize > cd.resamplebufSize && !m_realtime) {
             cerr << "WARNING: RubberBandStretcher::Impl::writeChunk: resizing resampler buffer from "
                       << cd.resamplebufSize << " to " << reqSize << endl;
             cd.setResampleBufSize(reqSize);
         }
 
-        size_t outframes = cd.resampler->resample(&cd.accumulator,
-                                                  &cd.resamplebuf,
-                                                  si,
-                                                  1.0 / m_pitchScale,
-                                                  last);
+        int piece = si;
+        if (reqSize > cd.resamplebufSize) {
+            piece = int(floor(cd.resamplebufSize * m_pitchScale));
+            if (piece < 1) piece = 1;
+        }
+
+        for (int done = 0; done < si; done += piece) {
+
+            int n = std::min(piece, si - done);
+            const float *from = accumulator + done;
 
-        writeOutput(*cd.outbuf, cd.resamplebuf,
-                    outframes, cd.outCount, theoreticalOut);
+            size_t outframes = cd.resampler->resample(&from,
+                                                      &cd.resamplebuf,
+                                                      n,
+                                                      1.0 / m_pitchScale,
+                                                      last && done + n == si);
+
+            writeOutput(*cd.outbuf, cd.resamplebuf,
+                        outframes, cd.outCount, theoreticalOut);
+        }
 
     } else {
         writeOutput(*cd.outbuf, accumulator,
@@ -1099,7 +2261,10 @@ RubberBandStretcher::Impl::writeOutput(RingBuffer<float> &to, float *from, size_
 
         size_t written = to.write(from, qty);
 
-        if (written < qty) {
+        if (written < qty && m_realtime) {
+            m_rtWarnings |= RealTimeWarningOutputLost;
+        }
+        if (written < qty && (!m_realtime || m_debugLevel > 0)) {
             cerr << "WARNING: RubberBandStretcher::Impl::writeOutput: "
                  << "Buffer overrun on output: wrote " << written
                  << " of " << qty << " samples" << endl;
@@ -1135,6 +2300,8 @@ RubberBandStretcher::Impl::writeOutput(RingBuffer<float> &to, float *from, size_
 int
 RubberBandStretcher::Impl::available() const
 {
+    NoAllocationScope guard(m_realtime && !m_verifier);
+
     if (m_threaded) {
         MutexLocker locker(&m_threadSetMutex);
         if (m_channelData.empty()) return 0;
@@ -1142,11 +2309,27 @@ RubberBandStretcher::Impl::available() const
         if (m_channelData.empty()) return 0;
     }
 
-    if (!m_threaded) {
+    // See m_emergencyScavenger and m_outbufMutex
+    Scavenger<RingBuffer<float> >::Reader reader(m_emergencyScavenger,
+                                                 !m_threaded);
+    MutexLocker locker(m_threaded ? &m_outbufMutex : 0);
+
+    if (!m_segmentTasks.empty()) {
+        // Once all the input is in, wait for the next segment rather
+        // than report nothing available and leave the caller polling
+        bool wait = (m_mode == Finished &&
+                     m_channelData[0]->outbuf->getReadSpace() == 0);
+        RubberBandStretcher::Impl *self = (RubberBandStretcher::Impl *)this;
+        // processNonBlocking may have left segments undispatched
+        if (self->spliceSegments(wait)) {
+            self->dispatchSegments(m_mode == Finished, false);
+        }
+    } else if (!m_threaded) {
         for (size_t c = 0; c < m_channels; ++c) {
             if (m_channelData[c]->inputSize >= 0) {
 //                cerr << "available: m_done true" << endl;
-                if (m_channelData[c]->inbuf->getReadSpace() > 0) {
+                if (m_channelData[c]->inbuf->getReadSpace() > 0 ||
+                    !m_analysisThreads.empty()) {
                     if (m_debugLevel > 1) {
                         cerr << "calling processChunks(" << c << ") from available" << endl;
                     }
@@ -1164,13 +2347,17 @@ RubberBandStretcher::Impl::available() const
     bool haveResamplers = false;
 
     for (size_t i = 0; i < m_channels; ++i) {
+        // A process thread sets outputComplete only after writing
+        // its final output, so test it before reading the output
+        // space -- otherwise we could report -1 with output pending
+        if (!m_channelData[i]->outputComplete) consumed = false;
+        MBARRIER();
         size_t availIn = m_channelData[i]->inbuf->getReadSpace();
         size_t availOut = m_channelData[i]->outbuf->getReadSpace();
         if (m_debugLevel > 2) {
             cerr << "available on channel " << i << ": " << availOut << " (waiting: " << availIn << ")" << endl;
         }
         if (i == 0 || availOut < min) min = availOut;
-        if (!m_channelData[i]->outputComplete) consumed = false;
         if (m_channelData[i]->resampler) haveResamplers = true;
     }
 
@@ -1183,9 +2370,72 @@ RubberBandStretcher::Impl::available() const
 
 size_t
 RubberBandStretcher::Impl::retrieve(float *const *output, size_t samples) const
+{
+    // Pull and read in pieces no longer than the input callback
+    // buffer, which the output buffers can always hold.  The
+    // processing threads stop at the output buffer limit, and in RT
+    // mode the buffers cannot grow once we are processing, so waiting
+    // for the whole of a larger request to become available could
+    // wait forever.  In RT mode, pullInput() stops pulling as soon as
+    // a piece is available, so the output buffers need room for a
+    // piece plus the output of one more pull.  Make that room before
+    // processing begins, while we may still allocate; after that, as
+    // in process(), growing them is a reportable failure
+
+    RubberBandStretcher::Impl *self = (RubberBandStretcher::Impl *)this;
+    bool pullRT = (m_inputCallback && m_realtime);
+
+    if (pullRT && m_mode == JustCreated) {
+        self->prepareOutbufs(m_pullBufferSize, m_pullBufferSize);
+    }
+
+    NoAllocationScope guard(m_realtime && !m_verifier);
+
+    if (pullRT && self->prepareOutbufs(m_pullBufferSize, m_pullBufferSize)) {
+        m_rtWarnings |= RealTimeWarningOutputBuffersGrown;
+    }
+
+    if (!m_inputCallback) {
+        return readOutput(output, samples);
+    }
+
+    float **ptrs = (float **)alloca(m_channels * sizeof(float *));
+    size_t got = 0;
+
+    while (got < samples) {
+        size_t piece = std::min(samples - got, m_pullBufferSize);
+        self->pullInput(piece);
+        for (size_t c = 0; c < m_channels; ++c) {
+            ptrs[c] = output[c] + got;
+        }
+        size_t gotHere = readOutput(ptrs, piece);
+        got += gotHere;
+        if (gotHere < piece) break;
+    }
+
+    return got;
+}
+
+size_t
+RubberBandStretcher::Impl::readOutput(float *const *output,
+                                      size_t samples) const
 {
     size_t got = samples;
 
+    // See m_emergencyScavenger and m_outbufMutex
+    Scavenger<RingBuffer<float> >::Reader reader(m_emergencyScavenger,
+                                                 !m_threaded);
+    MutexLocker locker(m_threaded ? &m_outbufMutex : 0);
+
+    if (m_inputCallback) {
+        // The final pull will usually come up short: read what there
+        // is, rather than have the ring buffers warn about it
+        for (size_t c = 0; c < m_channels; ++c) {
+            size_t rs = m_channelData[c]->outbuf->getReadSpace();
+            if (rs < got) got = rs;
+        }
+    }
+
     for (size_t c = 0; c < m_channels; ++c) {
         size_t gotHere = m_channelData[c]->outbuf->read(output[c], got);
         if (gotHere < got) {
@@ -1209,8 +2459,64 @@ RubberBandStretcher::Impl::retrieve(float *const *output, size_t samples) const
         }
     }
 
+    if (m_verifier) verifyOutput(output, got);
+
+    if (m_threaded) {
+        ((RubberBandStretcher::Impl *)this)->wakeThrottled();
+    }
+
     return got;
 }
 
+void
+RubberBandStretcher::Impl::verifyOutput(float *const *output,
+                                        size_t samples) const
+{
+    // Retrieve the same number of samples from the single-threaded
+    // stretcher and insist that they are bit-identical.  Its output is
+    // always at least as far along as ours, as it does all of its
+    // processing within process() (and, at the end, available()).
+    // We compare in pieces no longer than m_verifyBuffer, so as not
+    // to allocate anything here
+
+    float **expected = m_verifyBuffer;
+    size_t done = 0;
+
+    m_verifier->available();
+
+    while (done < samples) {
+
+        size_t n = std::min(samples - done, m_verifyBufferSize);
+        size_t got = m_verifier->retrieve(expected, n);
+
+        if (got != n) {
+            cerr << "ERROR: RubberBandStretcher: threading verification failed: "
+                 << "single-threaded stretcher has only "
+                 << m_verifiedCount + done + got
+                 << " samples where we have " << m_verifiedCount + samples
+                 << endl;
+            abort();
+        }
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            for (size_t i = 0; i < n; ++i) {
+                if (memcmp(&output[c][done + i], &expected[c][i],
+                           sizeof(float))) {
+                    cerr << "ERROR: RubberBandStretcher: threading verification failed: "
+                         << "output differs from single-threaded output at sample "
+                         << m_verifiedCount + done + i << " of channel " << c
+                         << " (" << output[c][done + i] << " vs "
+                         << expected[c][i] << ")" << endl;
+                    abort();
+                }
+            }
+        }
+
+        done += n;
+    }
+
+    m_verifiedCount += samples;
+}
+
 }
 
@@ -35,7 +35,8 @@ namespace RubberBand
 PercussiveAudioCurve::PercussiveAudioCurve(Parameters parameters) :
     AudioCurveCalculator(parameters)
 {
-    m_prevMag = allocate_and_zero<double>(m_fftSize/2 + 1);
+    m_prevMagSize = m_fftSize/2 + 1;
+    m_prevMag = allocate_and_zero<double>(m_prevMagSize);
 }
 
 PercussiveAudioCurve::~PercussiveAudioCurve()
@@ -52,7 +53,12 @@ PercussiveAudioCurve::reset()
 void
 PercussiveAudioCurve::setFftSize(int newSize)
 {
-    m_prevMag = reallocate(m_prevMag, m_fftSize/2 + 1, newSize/2 + 1);
+    // Only reallocate when growing, so that a curve constructed for
+    // the largest size can switch between sizes without allocating
+    if (newSize/2 + 1 > m_prevMagSize) {
+        m_prevMag = reallocate(m_prevMag, m_prevMagSize, newSize/2 + 1);
+        m_prevMagSize = newSize/2 + 1;
+    }
     AudioCurveCalculator::setFftSize(newSize);
     reset();
 }
@@ -47,6 +47,7 @@ public:
 
 protected:
     double *m_prevMag;
+    int m_prevMagSize; // allocated length, may exceed m_fftSize/2 + 1
 };
 
 }
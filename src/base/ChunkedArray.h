@@ -0,0 +1,167 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef _RUBBERBAND_CHUNKED_ARRAY_H_
+#define _RUBBERBAND_CHUNKED_ARRAY_H_
+
+#include <vector>
+#include <iostream>
+
+#include "system/sysutils.h"
+#include "system/Allocators.h"
+
+namespace RubberBand {
+
+/**
+ * An array of plain values that grows at the end, stored in
+ * fixed-size chunks so that growing it never moves or copies what is
+ * already there.
+ *
+ * If file backing is requested, the chunks are mapped from a
+ * temporary file instead of being allocated, so that a very long
+ * array can be paged out to disk rather than held in memory.  If the
+ * file cannot be created or mapped, it carries on in memory.
+ */
+
+template <typename T>
+class ChunkedArray
+{
+public:
+    ChunkedArray() :
+        m_size(0),
+        m_fileBacked(false),
+        m_fd(-1),
+        m_mappedChunks(0) { }
+
+    ~ChunkedArray() {
+        release();
+    }
+
+    /**
+     * Choose whether to map chunks from a temporary file.  This
+     * discards the current contents.
+     */
+    void setFileBacked(bool fileBacked) {
+        release();
+        m_fileBacked = fileBacked;
+    }
+
+    /**
+     * Return true if file backing was requested and is (still) in
+     * use.
+     */
+    bool isFileBacked() const { return m_fileBacked; }
+
+    /**
+     * Ensure there is room for at least n values without further
+     * allocation.
+     */
+    void reserve(size_t n) {
+        while (m_chunks.size() * chunkSize < n) {
+            addChunk();
+        }
+    }
+
+    void push_back(const T &value) {
+        if (m_size == m_chunks.size() * chunkSize) {
+            addChunk();
+        }
+        m_chunks[m_size >> chunkBits][m_size & chunkMask] = value;
+        ++m_size;
+    }
+
+    const T &operator[](size_t i) const {
+        return m_chunks[i >> chunkBits][i & chunkMask];
+    }
+    T &operator[](size_t i) {
+        return m_chunks[i >> chunkBits][i & chunkMask];
+    }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    /**
+     * Remove all values, keeping the storage for reuse.
+     */
+    void clear() { m_size = 0; }
+
+    /**
+     * Remove all values and free the storage.
+     */
+    void release() {
+        for (size_t i = 0; i < m_chunks.size(); ++i) {
+            if (i < m_mappedChunks) {
+                system_unmap_temp_file(m_chunks[i], chunkBytes);
+            } else {
+                deallocate(m_chunks[i]);
+            }
+        }
+        m_chunks.clear();
+        m_mappedChunks = 0;
+        m_size = 0;
+        system_close_temp_file(m_fd);
+        m_fd = -1;
+    }
+
+private:
+    // 64K values per chunk, a whole number of pages for any T we use
+    static const int chunkBits = 16;
+    static const size_t chunkSize = size_t(1) << chunkBits;
+    static const size_t chunkMask = chunkSize - 1;
+    static const size_t chunkBytes = chunkSize * sizeof(T);
+
+    std::vector<T *> m_chunks;
+    size_t m_size;
+    bool m_fileBacked;
+    int m_fd;
+    size_t m_mappedChunks; // the first m_mappedChunks are from the file
+
+    void addChunk() {
+        T *chunk = 0;
+        if (m_fileBacked) {
+            if (m_fd < 0) {
+                m_fd = system_open_temp_file();
+            }
+            chunk = (T *)system_map_temp_file
+                (m_fd, m_chunks.size() * chunkBytes, chunkBytes);
+            if (chunk) {
+                ++m_mappedChunks;
+            } else {
+                std::cerr << "WARNING: ChunkedArray: Failed to map temporary file, using memory instead" << std::endl;
+                m_fileBacked = false;
+            }
+        }
+        if (!chunk) {
+            chunk = allocate<T>(chunkSize);
+        }
+        m_chunks.push_back(chunk);
+    }
+
+    ChunkedArray(const ChunkedArray &); // not provided
+    ChunkedArray &operator=(const ChunkedArray &); // not provided
+};
+
+}
+
+#endif
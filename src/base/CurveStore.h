@@ -0,0 +1,126 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef _RUBBERBAND_CURVE_STORE_H_
+#define _RUBBERBAND_CURVE_STORE_H_
+
+#include "ChunkedArray.h"
+
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+namespace RubberBand {
+
+/**
+ * Storage for a curve of float values, such as a detection function
+ * collected over the whole of a long input, in a ChunkedArray.
+ *
+ * In compact mode each value is held in 16 bits, as the upper half
+ * of its IEEE single-precision representation (rounded to nearest).
+ * This keeps the full range of a float with a relative precision of
+ * about one part in 256, and halves the storage needed.
+ */
+
+class CurveStore
+{
+public:
+    CurveStore() : m_compact(false) { }
+
+    /**
+     * Choose compact (16-bit) storage and/or file backing (see
+     * ChunkedArray).  This discards the current contents.
+     */
+    void setStorage(bool compact, bool fileBacked) {
+        m_floats.setFileBacked(fileBacked && !compact);
+        m_compacts.setFileBacked(fileBacked && compact);
+        m_compact = compact;
+    }
+
+    bool isCompact() const { return m_compact; }
+
+    void reserve(size_t n) {
+        if (m_compact) m_compacts.reserve(n);
+        else m_floats.reserve(n);
+    }
+
+    void push_back(float value) {
+        if (m_compact) m_compacts.push_back(toCompact(value));
+        else m_floats.push_back(value);
+    }
+
+    float operator[](size_t i) const {
+        if (m_compact) return fromCompact(m_compacts[i]);
+        else return m_floats[i];
+    }
+
+    size_t size() const {
+        return m_compact ? m_compacts.size() : m_floats.size();
+    }
+    bool empty() const { return size() == 0; }
+
+    void clear() {
+        m_floats.clear();
+        m_compacts.clear();
+    }
+
+    std::vector<float> toVector() const {
+        std::vector<float> v;
+        size_t n = size();
+        v.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            v.push_back((*this)[i]);
+        }
+        return v;
+    }
+
+    static uint16_t toCompact(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        if ((bits & 0x7fffffff) > 0x7f800000) { // NaN
+            return 0x7fc0;
+        }
+        bits += 0x7fff + ((bits >> 16) & 1);
+        return uint16_t(bits >> 16);
+    }
+
+    static float fromCompact(uint16_t compact) {
+        uint32_t bits = uint32_t(compact) << 16;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+private:
+    ChunkedArray<float> m_floats;
+    ChunkedArray<uint16_t> m_compacts;
+    bool m_compact;
+
+    CurveStore(const CurveStore &); // not provided
+    CurveStore &operator=(const CurveStore &); // not provided
+};
+
+}
+
+#endif
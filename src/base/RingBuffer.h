@@ -30,6 +30,7 @@
 #include "system/Allocators.h"
 
 #include <iostream>
+#include <atomic>
 
 namespace RubberBand {
 
@@ -38,11 +39,16 @@ namespace RubberBand {
  * one reader, that is to be used to store a sample type T.
  *
  * RingBuffer is thread-safe provided only one thread writes and only
- * one thread reads.
+ * one thread reads.  The read and write indices are atomics with
+ * acquire/release ordering, each on its own cache line, and each
+ * side keeps a private copy of the other side's index which it only
+ * refreshes when that copy says there is not enough to do what it
+ * was asked.  So the reader and writer do not contend for a cache
+ * line unless the buffer is nearly empty or nearly full.
  */
 
 template <typename T>
-class RingBuffer
+class RingBuffer : public Allocated
 {
 public:
     /**
@@ -53,8 +59,22 @@ public:
      * reasons.  Since the ring buffer performs best if its size is a
      * power of two, this means n should ideally be some power of two
      * minus one.
+     *
+     * If mirrored is true, the storage is mapped twice in succession
+     * in virtual memory where the platform supports it (see
+     * isMirrored()), so that any readable span is contiguous and can
+     * be accessed through getReadPointer().  The storage is then
+     * rounded up to a whole number of pages, but the capacity seen
+     * by the caller is still n.  Mirrored storage is mapped directly
+     * from the system, so the buffer is not mirrored if allocator
+     * hooks are in effect (see AllocatorScope): all of its memory
+     * then comes through them.
+     *
+     * If capacity is greater than n, storage is allocated for that
+     * many samples, so that setSize() can later grow the buffer up
+     * to it without allocating.
      */
-    RingBuffer(int n);
+    RingBuffer(int n, bool mirrored = false, int capacity = 0);
 
     virtual ~RingBuffer();
 
@@ -64,6 +84,26 @@ public:
      */
     int getSize() const;
 
+    /**
+     * Return the largest size that setSize() accepts: at least the
+     * capacity argument passed to the constructor.
+     */
+    int getCapacity() const { return m_size - 1; }
+
+    /**
+     * Change the room available to write to n samples, which must
+     * not exceed getCapacity().  The contents are preserved, and no
+     * allocation takes place.  This should be called from the writer
+     * thread.
+     */
+    void setSize(int n);
+
+    /**
+     * Return true if the buffer was requested to be mirrored and the
+     * platform was able to provide the mapping.
+     */
+    bool isMirrored() const { return m_mirrored; }
+
     /**
      * Return a new ring buffer (allocated with "new" -- caller must
      * delete when no longer needed) of the given size, containing the
@@ -137,6 +177,16 @@ public:
      */
     int peek(T *const destination, int n) const;
 
+    /**
+     * Return a pointer from which the next n samples can be read in
+     * place, without advancing the read pointer, or NULL if fewer
+     * than n are available or if they wrap around the end of the
+     * buffer (which they never do in a mirrored buffer).  The
+     * pointer remains valid until the samples are read or skipped.
+     * Should be called from the read thread.
+     */
+    const T *getReadPointer(int n) const;
+
     /**
      * Read one sample from the buffer, if available, without
      * advancing the read pointer -- i.e. a subsequent read() or
@@ -172,11 +222,47 @@ public:
     int zero(int n);
 
 protected:
-    T *const m_buffer;
-    int          m_writer;
-    int          m_reader;
-    const int    m_size;
+    T           *m_buffer;
+    int          m_size;
     bool         m_mlocked;
+    bool         m_mirrored;
+    int          m_spare; // storage beyond the current size (see setSize)
+
+    // Explicit padding rather than alignas, which "new" would not
+    // honour before C++17
+    char m_pad0[64];
+
+    std::atomic<int> m_writer;
+    int          m_readerCache; // writer's copy of m_reader
+
+    char m_pad1[64];
+
+    std::atomic<int> m_reader;
+    mutable int  m_writerCache; // reader's copy of m_writer
+
+    char m_pad2[64];
+
+    // Used by the writer: room to write at least n, refreshing the
+    // cached reader index if necessary
+    int writeSpaceWanted(int w, int n) {
+        int space = writeSpaceFor(w, m_readerCache);
+        if (space < n) {
+            m_readerCache = m_reader.load(std::memory_order_acquire);
+            space = writeSpaceFor(w, m_readerCache);
+        }
+        return space;
+    }
+
+    // Used by the reader: the data available to read, at least n if
+    // possible, refreshing the cached writer index if necessary
+    int readSpaceWanted(int r, int n) const {
+        int space = readSpaceFor(m_writerCache, r);
+        if (space < n) {
+            m_writerCache = m_writer.load(std::memory_order_acquire);
+            space = readSpaceFor(m_writerCache, r);
+        }
+        return space;
+    }
 
     int readSpaceFor(int w, int r) const {
         int space;
@@ -189,7 +275,8 @@ protected:
     int writeSpaceFor(int w, int r) const {
         int space = (r + m_size - w - 1);
         if (space >= m_size) space -= m_size;
-        return space;
+        space -= m_spare;
+        return space < 0 ? 0 : space;
     }
 
 private:
@@ -198,13 +285,31 @@ private:
 };
 
 template <typename T>
-RingBuffer<T>::RingBuffer(int n) :
-    m_buffer(allocate<T>(n + 1)),
+RingBuffer<T>::RingBuffer(int n, bool mirrored, int capacity) :
+    m_buffer(0),
+    m_size((capacity > n ? capacity : n) + 1),
+    m_mlocked(false),
+    m_mirrored(false),
+    m_spare(m_size - n - 1),
     m_writer(0),
-    m_size(n + 1),
-    m_mlocked(false)
+    m_readerCache(0),
+    m_reader(0),
+    m_writerCache(0)
 {
-    m_reader = 0;
+    if (mirrored && !current_allocator_hooks()) {
+        check_allocation_permitted("allocate");
+        size_t bytes = m_size * sizeof(T);
+        m_buffer = (T *)system_allocate_mirrored(bytes);
+        if (m_buffer) {
+            int extra = int(bytes / sizeof(T)) - m_size;
+            m_size += extra;
+            m_spare += extra;
+            m_mirrored = true;
+        }
+    }
+    if (!m_buffer) {
+        m_buffer = allocate<T>(m_size);
+    }
 }
 
 template <typename T>
@@ -214,24 +319,41 @@ RingBuffer<T>::~RingBuffer()
 	MUNLOCK((void *)m_buffer, m_size * sizeof(T));
     }
 
-    deallocate(m_buffer);
+    if (m_mirrored) {
+        check_allocation_permitted("deallocate");
+        system_deallocate_mirrored(m_buffer, m_size * sizeof(T));
+    } else {
+        deallocate(m_buffer);
+    }
 }
 
 template <typename T>
 int
 RingBuffer<T>::getSize() const
 {
-    return m_size - 1;
+    return m_size - m_spare - 1;
+}
+
+template <typename T>
+void
+RingBuffer<T>::setSize(int n)
+{
+    if (n > getCapacity()) {
+        std::cerr << "WARNING: RingBuffer::setSize: size " << n
+                  << " exceeds capacity " << getCapacity() << std::endl;
+        n = getCapacity();
+    }
+    m_spare = m_size - n - 1;
 }
 
 template <typename T>
 RingBuffer<T> *
 RingBuffer<T>::resized(int newSize) const
 {
-    RingBuffer<T> *newBuffer = new RingBuffer<T>(newSize);
+    RingBuffer<T> *newBuffer = new RingBuffer<T>(newSize, m_mirrored);
 
-    int w = m_writer;
-    int r = m_reader;
+    int w = m_writer.load(std::memory_order_acquire);
+    int r = m_reader.load(std::memory_order_acquire);
 
     while (r != w) {
         T value = m_buffer[r];
@@ -255,21 +377,29 @@ template <typename T>
 void
 RingBuffer<T>::reset()
 {
-    m_reader = m_writer;
+    // Neither side may be reading or writing during this, so the
+    // caches can be brought up to date as well
+    int w = m_writer.load(std::memory_order_relaxed);
+    m_readerCache = w;
+    m_writerCache = w;
+    m_reader.store(w, std::memory_order_release);
 }
 
 template <typename T>
 int
 RingBuffer<T>::getReadSpace() const
 {
-    return readSpaceFor(m_writer, m_reader);
+    // May be called from either side, so can't use the caches
+    return readSpaceFor(m_writer.load(std::memory_order_acquire),
+                        m_reader.load(std::memory_order_acquire));
 }
 
 template <typename T>
 int
 RingBuffer<T>::getWriteSpace() const
 {
-    return writeSpaceFor(m_writer, m_reader);
+    return writeSpaceFor(m_writer.load(std::memory_order_acquire),
+                         m_reader.load(std::memory_order_acquire));
 }
 
 template <typename T>
@@ -277,10 +407,9 @@ template <typename S>
 int
 RingBuffer<T>::read(S *const destination, int n)
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    int available = readSpaceFor(w, r);
+    int available = readSpaceWanted(r, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::read: " << n << " requested, only "
                   << available << " available" << std::endl;
@@ -292,7 +421,7 @@ RingBuffer<T>::read(S *const destination, int n)
     int here = m_size - r;
     T *const bufbase = m_buffer + r;
 
-    if (here >= n) {
+    if (here >= n || m_mirrored) {
         v_convert(destination, bufbase, n);
     } else {
         v_convert(destination, bufbase, here);
@@ -302,8 +431,7 @@ RingBuffer<T>::read(S *const destination, int n)
     r += n;
     while (r >= m_size) r -= m_size;
 
-    MBARRIER();
-    m_reader = r;
+    m_reader.store(r, std::memory_order_release);
 
     return n;
 }
@@ -313,10 +441,9 @@ template <typename S>
 int
 RingBuffer<T>::readAdding(S *const destination, int n)
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    int available = readSpaceFor(w, r);
+    int available = readSpaceWanted(r, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::read: " << n << " requested, only "
                   << available << " available" << std::endl;
@@ -327,7 +454,7 @@ RingBuffer<T>::readAdding(S *const destination, int n)
     int here = m_size - r;
     T *const bufbase = m_buffer + r;
 
-    if (here >= n) {
+    if (here >= n || m_mirrored) {
         v_add(destination, bufbase, n);
     } else {
         v_add(destination, bufbase, here);
@@ -337,8 +464,7 @@ RingBuffer<T>::readAdding(S *const destination, int n)
     r += n;
     while (r >= m_size) r -= m_size;
 
-    MBARRIER();
-    m_reader = r;
+    m_reader.store(r, std::memory_order_release);
 
     return n;
 }
@@ -347,10 +473,9 @@ template <typename T>
 T
 RingBuffer<T>::readOne()
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    if (w == r) {
+    if (readSpaceWanted(r, 1) == 0) {
 	std::cerr << "WARNING: RingBuffer::readOne: no sample available"
 		  << std::endl;
 	return T();
@@ -359,8 +484,7 @@ RingBuffer<T>::readOne()
     T value = m_buffer[r];
     if (++r == m_size) r = 0;
 
-    MBARRIER();
-    m_reader = r;
+    m_reader.store(r, std::memory_order_release);
 
     return value;
 }
@@ -369,10 +493,9 @@ template <typename T>
 int
 RingBuffer<T>::peek(T *const destination, int n) const
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    int available = readSpaceFor(w, r);
+    int available = readSpaceWanted(r, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::peek: " << n << " requested, only "
                   << available << " available" << std::endl;
@@ -384,7 +507,7 @@ RingBuffer<T>::peek(T *const destination, int n) const
     int here = m_size - r;
     const T *const bufbase = m_buffer + r;
 
-    if (here >= n) {
+    if (here >= n || m_mirrored) {
         v_copy(destination, bufbase, n);
     } else {
         v_copy(destination, bufbase, here);
@@ -394,14 +517,25 @@ RingBuffer<T>::peek(T *const destination, int n) const
     return n;
 }
 
+template <typename T>
+const T *
+RingBuffer<T>::getReadPointer(int n) const
+{
+    int r = m_reader.load(std::memory_order_relaxed);
+
+    if (readSpaceWanted(r, n) < n) return 0;
+    if (r + n > m_size && !m_mirrored) return 0;
+
+    return m_buffer + r;
+}
+
 template <typename T>
 T
 RingBuffer<T>::peekOne() const
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    if (w == r) {
+    if (readSpaceWanted(r, 1) == 0) {
 	std::cerr << "WARNING: RingBuffer::peekOne: no sample available"
 		  << std::endl;
 	return 0;
@@ -415,10 +549,9 @@ template <typename T>
 int
 RingBuffer<T>::skip(int n)
 {
-    int w = m_writer;
-    int r = m_reader;
+    int r = m_reader.load(std::memory_order_relaxed);
 
-    int available = readSpaceFor(w, r);
+    int available = readSpaceWanted(r, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::skip: " << n << " requested, only "
                   << available << " available" << std::endl;
@@ -429,8 +562,7 @@ RingBuffer<T>::skip(int n)
     r += n;
     while (r >= m_size) r -= m_size;
 
-    // No memory barrier required, because we didn't read any data
-    m_reader = r;
+    m_reader.store(r, std::memory_order_release);
 
     return n;
 }
@@ -440,10 +572,9 @@ template <typename S>
 int
 RingBuffer<T>::write(const S *const source, int n)
 {
-    int w = m_writer;
-    int r = m_reader;
+    int w = m_writer.load(std::memory_order_relaxed);
 
-    int available = writeSpaceFor(w, r);
+    int available = writeSpaceWanted(w, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::write: " << n
                   << " requested, only room for " << available << std::endl;
@@ -454,7 +585,7 @@ RingBuffer<T>::write(const S *const source, int n)
     int here = m_size - w;
     T *const bufbase = m_buffer + w;
 
-    if (here >= n) {
+    if (here >= n || m_mirrored) {
         v_convert<S, T>(bufbase, source, n);
     } else {
         v_convert<S, T>(bufbase, source, here);
@@ -464,8 +595,7 @@ RingBuffer<T>::write(const S *const source, int n)
     w += n;
     while (w >= m_size) w -= m_size;
 
-    MBARRIER();
-    m_writer = w;
+    m_writer.store(w, std::memory_order_release);
 
     return n;
 }
@@ -474,10 +604,9 @@ template <typename T>
 int
 RingBuffer<T>::zero(int n)
 {
-    int w = m_writer;
-    int r = m_reader;
+    int w = m_writer.load(std::memory_order_relaxed);
 
-    int available = writeSpaceFor(w, r);
+    int available = writeSpaceWanted(w, n);
     if (n > available) {
 	std::cerr << "WARNING: RingBuffer::zero: " << n
                   << " requested, only room for " << available << std::endl;
@@ -488,7 +617,7 @@ RingBuffer<T>::zero(int n)
     int here = m_size - w;
     T *const bufbase = m_buffer + w;
 
-    if (here >= n) {
+    if (here >= n || m_mirrored) {
         v_zero(bufbase, n);
     } else {
         v_zero(bufbase, here);
@@ -498,8 +627,7 @@ RingBuffer<T>::zero(int n)
     w += n;
     while (w >= m_size) w -= m_size;
 
-    MBARRIER();
-    m_writer = w;
+    m_writer.store(w, std::memory_order_release);
 
     return n;
 }
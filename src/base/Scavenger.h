@@ -27,11 +27,7 @@
 #include <vector>
 #include <list>
 #include <utility>
-#include <iostream>
-
-#ifndef WIN32
-#include <sys/time.h>
-#endif
+#include <atomic>
 
 #include "system/Thread.h"
 #include "system/sysutils.h"
@@ -40,54 +36,107 @@
 namespace RubberBand {
 
 /**
- * A very simple class that facilitates running things like plugins
- * without locking, by collecting unwanted objects and deleting them
- * after a delay so as to be sure nobody's in the middle of using
- * them.  Requires scavenge() to be called regularly from a non-RT
- * thread.
+ * Collects objects that have been replaced while other threads may
+ * still be using them, and deletes them once it is certain that
+ * nobody can be.
+ *
+ * This uses epoch-based reclamation.  A thread that reads a pointer
+ * which another thread may replace does so inside a Reader scope,
+ * which publishes the epoch current at the start of the read.  The
+ * replacing thread stores the new pointer and then passes the old
+ * object to claim(), which tags it with the current epoch and
+ * advances the epoch.  A reader that started after that advance must
+ * see the new pointer; so scavenge() may delete an object as soon as
+ * no reader is still inside a scope that started at or before the
+ * object's epoch.  There is no time-based delay.
  *
- * This is currently not at all suitable for large numbers of objects
- * -- it's just a quick hack for use with things like plugins.
+ * claim() and the Reader scopes are lock-free and may be used from
+ * any number of threads at once.  scavenge() may also be called from
+ * any thread; if another thread is already scavenging, it returns
+ * without doing anything.  It deletes objects, so should not be
+ * called from a thread that cannot afford to free memory.
+ *
+ * Not at all suitable for large numbers of objects.  If more than
+ * defaultObjectListSize objects are waiting at once, the excess are
+ * kept in a list that is protected by a mutex.
  */
 
-//!!! should review this, it's not really thread safe owing to lack of
-//!!! atomic updates
-
 template <typename T>
 class Scavenger
 {
 public:
-    Scavenger(int sec = 2, int defaultObjectListSize = 200);
+    Scavenger(int defaultObjectListSize = 200);
     ~Scavenger();
 
     /**
-     * Call from an RT thread etc., to pass ownership of t to us.
-     * Only one thread should be calling this on any given scavenger.
+     * Scope within which it is safe to use an object that might be
+     * passed to claim() by another thread.  The object pointer must
+     * be read after the Reader is constructed.  Scopes should be
+     * short, as nothing claimed after one starts can be deleted until
+     * it ends.  A Reader constructed with active false does nothing,
+     * for callers that only sometimes need one.
+     */
+    class Reader
+    {
+    public:
+        Reader(const Scavenger<T> &s, bool active = true) :
+            m_s(s), m_slot(active ? s.enter() : -1) { }
+        ~Reader() { if (m_slot >= 0) m_s.leave(m_slot); }
+    private:
+        const Scavenger<T> &m_s;
+        int m_slot;
+    };
+
+    /**
+     * Pass ownership of t to us.  The caller must already have made
+     * t unreachable to any reader that starts after this call.
      */
     void claim(T *t);
 
     /**
-     * Call from a non-RT thread.
-     * Only one thread should be calling this on any given scavenger.
+     * Delete any claimed objects that no reader can still be using.
+     * If clearNow is true, delete all claimed objects regardless:
+     * only do this when it is known that there are no readers.
      */
     void scavenge(bool clearNow = false);
 
 protected:
-    typedef std::pair<T *, int> ObjectTimePair;
-    typedef std::vector<ObjectTimePair> ObjectTimeList;
-    ObjectTimeList m_objects;
-    int m_sec;
-
-    typedef std::list<T *> ObjectList;
+    typedef unsigned long Epoch;
+    static const Epoch m_unset = ~0UL; // no object, or epoch not yet set
+
+    struct Slot {
+        Slot() : object(0), epoch(m_unset) { }
+        std::atomic<T *> object;
+        std::atomic<Epoch> epoch;
+    };
+    std::vector<Slot> m_objects;
+
+    typedef std::pair<T *, Epoch> ObjectEpochPair;
+    typedef std::list<ObjectEpochPair> ObjectList;
     ObjectList m_excess;
-    int m_lastExcess;
     Mutex m_excessMutex;
-    void pushExcess(T *);
-    void clearExcess(int);
+    void pushExcess(T *, Epoch);
+    void clearExcess(bool clearNow);
 
-    unsigned int m_claimed;
-    unsigned int m_scavenged;
+    // The current epoch starts at 1.  Each reader slot holds the
+    // epoch at which its reader started, or 0 when not in use.
+    mutable std::atomic<Epoch> m_epoch;
+    static const int m_readerSlots = 16;
+    mutable std::atomic<Epoch> m_readers[m_readerSlots];
+
+    int enter() const;
+    void leave(int) const;
+    bool inUse(Epoch) const;
+
+    Mutex m_scavengeMutex;
+
+    std::atomic<unsigned int> m_claimed;
+    std::atomic<unsigned int> m_scavenged;
     unsigned int m_asExcess;
+
+private:
+    Scavenger(const Scavenger &); // not provided
+    Scavenger &operator=(const Scavenger &); // not provided
 };
 
 
@@ -125,109 +174,151 @@ private:
 
 
 template <typename T>
-Scavenger<T>::Scavenger(int sec, int defaultObjectListSize) :
-    m_objects(ObjectTimeList(defaultObjectListSize)),
-    m_sec(sec),
-    m_lastExcess(0),
+Scavenger<T>::Scavenger(int defaultObjectListSize) :
+    m_objects(defaultObjectListSize),
+    m_epoch(1),
     m_claimed(0),
     m_scavenged(0),
     m_asExcess(0)
 {
+    for (int i = 0; i < m_readerSlots; ++i) {
+        m_readers[i] = 0;
+    }
 }
 
 template <typename T>
 Scavenger<T>::~Scavenger()
 {
-    if (m_scavenged < m_claimed) {
-	for (size_t i = 0; i < m_objects.size(); ++i) {
-	    ObjectTimePair &pair = m_objects[i];
-	    if (pair.first != 0) {
-		T *ot = pair.first;
-		pair.first = 0;
-		delete ot;
-		++m_scavenged;
-	    }
-	}
+    scavenge(true);
+}
+
+template <typename T>
+int
+Scavenger<T>::enter() const
+{
+    // Take a free reader slot, publishing the current epoch in it.
+    // If the epoch has moved on by the time the slot is visible, an
+    // object claimed in between may be deleted without regard to us,
+    // so publish the newer epoch and check again: when the loop ends,
+    // every object with an earlier epoch was made unreachable before
+    // we started reading.
+
+    Epoch e = m_epoch.load();
+
+    int slot = 0;
+    while (true) {
+        Epoch expected = 0;
+        if (m_readers[slot].compare_exchange_strong(expected, e)) break;
+        if (++slot == m_readerSlots) slot = 0;
+    }
+
+    Epoch current;
+    while ((current = m_epoch.load()) != e) {
+        m_readers[slot].store(current);
+        e = current;
     }
 
-    clearExcess(0);
+    return slot;
+}
+
+template <typename T>
+void
+Scavenger<T>::leave(int slot) const
+{
+    m_readers[slot].store(0);
+}
+
+template <typename T>
+bool
+Scavenger<T>::inUse(Epoch e) const
+{
+    // An object claimed at epoch e may be in use by any reader that
+    // started at or before e
+
+    for (int i = 0; i < m_readerSlots; ++i) {
+        Epoch r = m_readers[i].load();
+        if (r != 0 && r <= e) return true;
+    }
+    return false;
 }
 
 template <typename T>
 void
 Scavenger<T>::claim(T *t)
 {
-//    std::cerr << "Scavenger::claim(" << t << ")" << std::endl;
+    // Any reader that starts after this sees an epoch later than e
 
-    struct timeval tv;
-    (void)gettimeofday(&tv, 0);
-    int sec = tv.tv_sec;
+    Epoch e = m_epoch.fetch_add(1);
+    ++m_claimed;
 
     for (size_t i = 0; i < m_objects.size(); ++i) {
-	ObjectTimePair &pair = m_objects[i];
-	if (pair.first == 0) {
-	    pair.second = sec;
-	    pair.first = t;
-	    ++m_claimed;
-	    return;
-	}
+        Slot &slot = m_objects[i];
+        T *expected = 0;
+        if (slot.object.compare_exchange_strong(expected, t)) {
+            // The epoch is unset until now, so scavenge() will leave
+            // the slot alone if it looks at it in between
+            slot.epoch.store(e);
+            return;
+        }
     }
 
-    pushExcess(t);
+    pushExcess(t, e);
 }
 
 template <typename T>
 void
 Scavenger<T>::scavenge(bool clearNow)
 {
-    if (m_scavenged >= m_claimed) return;
+    if (m_scavenged.load() >= m_claimed.load()) return;
 
-    struct timeval tv;
-    (void)gettimeofday(&tv, 0);
-    int sec = tv.tv_sec;
-    bool anything = false;
+    if (clearNow) {
+        m_scavengeMutex.lock();
+    } else if (!m_scavengeMutex.trylock()) {
+        return;
+    }
 
     for (size_t i = 0; i < m_objects.size(); ++i) {
-	ObjectTimePair &pair = m_objects[i];
-        if (!pair.first) continue;
-	if (clearNow || pair.second + m_sec < sec) {
-	    T *ot = pair.first;
-	    pair.first = 0;
-	    delete ot;
-	    ++m_scavenged;
-            anything = true;
-	}
+        Slot &slot = m_objects[i];
+        T *ot = slot.object.load();
+        if (!ot) continue;
+        Epoch e = slot.epoch.load();
+        if (!clearNow && (e == m_unset || inUse(e))) continue;
+        slot.epoch.store(m_unset);
+        slot.object.store(0);
+        delete ot;
+        ++m_scavenged;
     }
 
-    if (clearNow || anything || (sec > m_lastExcess + m_sec)) {
-        clearExcess(sec);
-    }
+    clearExcess(clearNow);
+
+    m_scavengeMutex.unlock();
 }
 
 template <typename T>
 void
-Scavenger<T>::pushExcess(T *t)
+Scavenger<T>::pushExcess(T *t, Epoch e)
 {
     m_excessMutex.lock();
-    m_excess.push_back(t);
-    struct timeval tv;
-    (void)gettimeofday(&tv, 0);
-    m_lastExcess = tv.tv_sec;
+    m_excess.push_back(ObjectEpochPair(t, e));
     m_excessMutex.unlock();
 }
 
 template <typename T>
 void
-Scavenger<T>::clearExcess(int sec)
+Scavenger<T>::clearExcess(bool clearNow)
 {
     m_excessMutex.lock();
-    for (typename ObjectList::iterator i = m_excess.begin();
-	 i != m_excess.end(); ++i) {
-	delete *i;
-        ++m_asExcess;
+    typename ObjectList::iterator i = m_excess.begin();
+    while (i != m_excess.end()) {
+        if (clearNow || !inUse(i->second)) {
+            delete i->first;
+            ++m_scavenged;
+            ++m_asExcess;
+            i = m_excess.erase(i);
+        } else {
+            ++i;
+        }
     }
-    m_excess.clear();
-    m_lastExcess = sec;
     m_excessMutex.unlock();
 }
 
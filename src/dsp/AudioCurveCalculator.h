@@ -28,6 +28,7 @@
 
 
 #include "system/sysutils.h"
+#include "system/Allocators.h"
 
 namespace RubberBand
 {
@@ -49,7 +50,7 @@ namespace RubberBand
  * of their processing data, and the caller must call reset() before
  * resynchronising to an unrelated piece of input audio.
  */
-class AudioCurveCalculator
+class AudioCurveCalculator : public Allocated
 {
 public:
     struct Parameters {
@@ -38,7 +38,7 @@
 
 namespace RubberBand {
 
-class FFTImpl
+class FFTImpl : public Allocated
 {
 public:
     virtual ~FFTImpl() { }
@@ -87,19 +87,28 @@ public:
                       << std::endl;
         }
 
-        m_fbuf = new kiss_fft_scalar[m_size + 2];
-        m_fpacked = new kiss_fft_cpx[m_size + 2];
-        m_fplanf = kiss_fftr_alloc(m_size, 0, NULL, NULL);
-        m_fplani = kiss_fftr_alloc(m_size, 1, NULL, NULL);
+        m_fbuf = allocate<kiss_fft_scalar>(m_size + 2);
+        m_fpacked = allocate<kiss_fft_cpx>(m_size + 2);
+        m_fplanf = allocatePlan(0);
+        m_fplani = allocatePlan(1);
     }
 
     ~D_KISSFFT() {
-        kiss_fftr_free(m_fplanf);
-        kiss_fftr_free(m_fplani);
+        deallocate((char *)m_fplanf);
+        deallocate((char *)m_fplani);
         kiss_fft_cleanup();
 
-        delete[] m_fbuf;
-        delete[] m_fpacked;
+        deallocate(m_fbuf);
+        deallocate(m_fpacked);
+    }
+
+    kiss_fftr_cfg allocatePlan(int inverse) {
+        // Query the size, then have KISSFFT build the plan in memory
+        // from our own allocator rather than its malloc
+        size_t len = 0;
+        kiss_fftr_alloc(m_size, inverse, NULL, &len);
+        char *mem = allocate<char>(len);
+        return kiss_fftr_alloc(m_size, inverse, mem, &len);
     }
 
     FFT::Precisions
@@ -25,6 +25,7 @@
 #define _RUBBERBAND_FFT_H_
 
 #include "system/sysutils.h"
+#include "system/Allocators.h"
 
 #include <string>
 #include <set>
@@ -54,7 +55,7 @@ class FFTImpl;
  * This class is reentrant but not thread safe: use a separate
  * instance per thread, or use a mutex.
  */
-class FFT
+class FFT : public Allocated
 {
 public:
     enum Exception {
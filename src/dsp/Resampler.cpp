@@ -31,9 +31,27 @@
 #include "system/Allocators.h"
 #include "speex/speex_resampler.h"
 
+// Allocation functions for the Speex resampler code (see resample.c)
+
+extern "C" void *
+rubberband_speex_allocate(size_t bytes)
+{
+    try {
+        return RubberBand::allocate<char>(bytes);
+    } catch (const std::bad_alloc &) {
+        return 0;
+    }
+}
+
+extern "C" void
+rubberband_speex_deallocate(void *ptr)
+{
+    RubberBand::deallocate<char>((char *)ptr);
+}
+
 namespace RubberBand {
 
-class ResamplerImpl
+class ResamplerImpl : public Allocated
 {
 public:
     virtual ~ResamplerImpl() { }
@@ -53,6 +71,8 @@ public:
     virtual int getChannelCount() const = 0;
 
     virtual void reset() = 0;
+
+    virtual void prepare(float minRatio, float maxRatio) = 0;
 };
 
 namespace Resamplers {
@@ -80,6 +100,8 @@ public:
 
     void reset();
 
+    void prepare(float minRatio, float maxRatio);
+
 protected:
     SpeexResamplerState *m_resampler;
     float *m_iin;
@@ -92,6 +114,8 @@ protected:
     int m_debugLevel;
 
     void setRatio(float);
+    static void getFraction(float ratio, unsigned int &num,
+                            unsigned int &denom);
 };
 
 D_Speex::D_Speex(Resampler::Quality quality, int channels, int maxBufferSize,
@@ -145,13 +169,14 @@ D_Speex::~D_Speex()
 }
 
 void
-D_Speex::setRatio(float ratio)
+D_Speex::getFraction(float ratio, unsigned int &num, unsigned int &denom)
 {
     // Speex wants a ratio of two unsigned integers, not a single
     // float.  Let's do that.
 
     unsigned int big = 272408136U;
-    unsigned int denom = 1, num = 1;
+    denom = 1;
+    num = 1;
 
     if (ratio < 1.f) {
         denom = big;
@@ -162,6 +187,13 @@ D_Speex::setRatio(float ratio)
         double ddenom = double(big) / double(ratio);
         denom = (unsigned int)ddenom;
     }
+}
+
+void
+D_Speex::setRatio(float ratio)
+{
+    unsigned int denom = 1, num = 1;
+    getFraction(ratio, num, denom);
 
     if (m_debugLevel > 1) {
         std::cerr << "D_Speex: Desired ratio " << ratio << ", requesting ratio "
@@ -283,6 +315,34 @@ D_Speex::reset()
     speex_resampler_reset_mem(m_resampler);
 }
 
+void
+D_Speex::prepare(float minRatio, float maxRatio)
+{
+    // Speex grows its filter table and memory when the ratio changes
+    // and never shrinks them, so visiting the ratios that need the
+    // most of each is enough.  The filter length is greatest at the
+    // lowest ratio; the table is largest at the lowest ratio and just
+    // above each of the powers of two at which its oversampling is
+    // halved.  Before the first resample() call, changing the ratio
+    // leaves no other trace, so we can then simply restore it
+
+    float ratios[] = { minRatio, maxRatio, 1.f,
+                       0.5f, 0.25f, 0.125f, 0.0625f };
+
+    for (int i = 0; i < int(sizeof(ratios)/sizeof(ratios[0])); ++i) {
+        float r = ratios[i];
+        if (i > 2) r *= 1.001f;
+        if (r < minRatio || r > maxRatio) continue;
+        unsigned int num = 1, denom = 1;
+        getFraction(r, num, denom);
+        speex_resampler_set_rate_frac(m_resampler, denom, num, 48000, 48000);
+    }
+
+    unsigned int num = 1, denom = 1;
+    getFraction(m_lastratio, num, denom);
+    speex_resampler_set_rate_frac(m_resampler, denom, num, 48000, 48000);
+}
+
 } /* end namespace Resamplers */
 
 Resampler::Resampler(Resampler::Quality quality, int channels,
@@ -381,4 +441,10 @@ Resampler::reset()
     d->reset();
 }
 
+void
+Resampler::prepare(float minRatio, float maxRatio)
+{
+    d->prepare(minRatio, maxRatio);
+}
+
 }
@@ -25,12 +25,13 @@
 #define _RUBBERBAND_RESAMPLER_H_
 
 #include "system/sysutils.h"
+#include "system/Allocators.h"
 
 namespace RubberBand {
 
 class ResamplerImpl;
 
-class Resampler
+class Resampler : public Allocated
 {
 public:
     enum Quality { Best, FastestTolerable, Fastest };
@@ -73,6 +74,14 @@ public:
 
     void reset();
 
+    /**
+     * Prepare for resampling at any ratio between minRatio and
+     * maxRatio, so that no allocation is needed when the ratio later
+     * changes within that range.  Call this before the first
+     * resample() call.  It does not change the ratio or the state.
+     */
+    void prepare(float minRatio, float maxRatio);
+
 protected:
     ResamplerImpl *d;
     int m_method;
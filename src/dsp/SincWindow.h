@@ -90,6 +90,7 @@ public:
 
     inline T getArea() const { return m_area; }
     inline T getValue(int i) const { return m_cache[i]; }
+    inline const T *getValues() const { return m_cache; }
 
     inline int getSize() const { return m_size; }
     inline int getP() const { return m_p; }
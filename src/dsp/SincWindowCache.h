@@ -0,0 +1,141 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef _RUBBERBAND_SINC_WINDOW_CACHE_H_
+#define _RUBBERBAND_SINC_WINDOW_CACHE_H_
+
+#include "SincWindow.h"
+
+#include "system/VectorOps.h"
+#include "system/Allocators.h"
+
+namespace RubberBand {
+
+/**
+ * A bounded cache of sinc windows of a given maximum size, keyed by
+ * size and scale (the n and p arguments to SincWindow<T>::write).
+ *
+ * All storage is allocated on construction, so a lookup never
+ * allocates: on a miss the least recently used entry is overwritten.
+ * There is no locking, so a cache must only be used from one thread
+ * at a time -- each channel of a stretcher has its own.
+ */
+
+template <typename T>
+class SincWindowCache
+{
+public:
+    /**
+     * Construct a cache able to hold up to capacity windows, each of
+     * up to maxSize samples.
+     */
+    SincWindowCache(int maxSize, int capacity) :
+        m_maxSize(maxSize),
+        m_capacity(capacity),
+        m_clock(0),
+        m_hits(0),
+        m_misses(0) {
+        m_entries = new Entry[m_capacity];
+        for (int i = 0; i < m_capacity; ++i) {
+            m_entries[i].n = 0;
+            m_entries[i].p = 0;
+            m_entries[i].lastUsed = 0;
+            m_entries[i].data = allocate<T>(m_maxSize);
+        }
+    }
+
+    ~SincWindowCache() {
+        for (int i = 0; i < m_capacity; ++i) {
+            deallocate(m_entries[i].data);
+        }
+        delete[] m_entries;
+    }
+
+    /**
+     * Write a sinc window of size n with scale p into dst, exactly
+     * as SincWindow<T>::write would, but copying from the cache if a
+     * window of the same size and scale has been written recently.
+     * If n exceeds the maximum size of the cache, the window is
+     * calculated directly into dst.
+     */
+    void write(T *const dst, const int n, const int p) {
+
+        if (n > m_maxSize || m_capacity == 0) {
+            SincWindow<T>::write(dst, n, p);
+            return;
+        }
+
+        ++m_clock;
+
+        Entry *target = &m_entries[0];
+
+        for (int i = 0; i < m_capacity; ++i) {
+            Entry &e = m_entries[i];
+            if (e.n == n && e.p == p) {
+                e.lastUsed = m_clock;
+                ++m_hits;
+                v_copy(dst, e.data, n);
+                return;
+            }
+            if (e.lastUsed < target->lastUsed) {
+                target = &e;
+            }
+        }
+
+        ++m_misses;
+        SincWindow<T>::write(target->data, n, p);
+        target->n = n;
+        target->p = p;
+        target->lastUsed = m_clock;
+        v_copy(dst, target->data, n);
+    }
+
+    int getMaxSize() const { return m_maxSize; }
+    int getCapacity() const { return m_capacity; }
+
+    unsigned int getHitCount() const { return m_hits; }
+    unsigned int getMissCount() const { return m_misses; }
+
+private:
+    struct Entry {
+        int n;
+        int p;
+        unsigned int lastUsed;
+        T *data;
+    };
+
+    int m_maxSize;
+    int m_capacity;
+    Entry *m_entries;
+    unsigned int m_clock;
+    unsigned int m_hits;
+    unsigned int m_misses;
+
+    SincWindowCache(const SincWindowCache &); // not provided
+    SincWindowCache &operator=(const SincWindowCache &); // not provided
+};
+
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#include "WindowCache.h"
+
+#include "system/Allocators.h"
+
+#include <iostream>
+
+namespace RubberBand
+{
+
+WindowCache::Tables &
+WindowCache::tables()
+{
+    static Tables *t = new Tables;
+    return *t;
+}
+
+const Window<float> *
+WindowCache::getWindow(WindowType type, int size)
+{
+    Tables &t = tables();
+    MutexLocker locker(&t.mutex);
+    // Shared tables may outlive the stretcher that asked for them, so
+    // they come from the system allocator, not any hooks in scope
+    AllocatorScope scope(0);
+    Entry<Window<float> > &e = t.windows[Key(int(type), size)];
+    if (!e.window) {
+        e.window = new Window<float>(type, size);
+        e.refs = 0;
+    }
+    ++e.refs;
+    return e.window;
+}
+
+void
+WindowCache::release(const Window<float> *window)
+{
+    if (!window) return;
+    Tables &t = tables();
+    MutexLocker locker(&t.mutex);
+    Key key(int(window->getType()), window->getSize());
+    std::map<Key, Entry<Window<float> > >::iterator i = t.windows.find(key);
+    if (i == t.windows.end() || i->second.window != window) {
+        std::cerr << "WARNING: WindowCache::release: window not in cache"
+                  << std::endl;
+        return;
+    }
+    if (--i->second.refs == 0) {
+        delete i->second.window;
+        t.windows.erase(i);
+    }
+}
+
+const SincWindow<float> *
+WindowCache::getSincWindow(int size, int p)
+{
+    Tables &t = tables();
+    MutexLocker locker(&t.mutex);
+    AllocatorScope scope(0); // as in getWindow
+    Entry<SincWindow<float> > &e = t.sincs[Key(size, p)];
+    if (!e.window) {
+        e.window = new SincWindow<float>(size, p);
+        e.refs = 0;
+    }
+    ++e.refs;
+    return e.window;
+}
+
+void
+WindowCache::release(const SincWindow<float> *window)
+{
+    if (!window) return;
+    Tables &t = tables();
+    MutexLocker locker(&t.mutex);
+    Key key(window->getSize(), window->getP());
+    std::map<Key, Entry<SincWindow<float> > >::iterator i = t.sincs.find(key);
+    if (i == t.sincs.end() || i->second.window != window) {
+        std::cerr << "WARNING: WindowCache::release: sinc window not in cache"
+                  << std::endl;
+        return;
+    }
+    if (--i->second.refs == 0) {
+        delete i->second.window;
+        t.sincs.erase(i);
+    }
+}
+
+int
+WindowCache::getTableCount()
+{
+    Tables &t = tables();
+    MutexLocker locker(&t.mutex);
+    return int(t.windows.size() + t.sincs.size());
+}
+
+}
@@ -0,0 +1,87 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef _RUBBERBAND_WINDOW_CACHE_H_
+#define _RUBBERBAND_WINDOW_CACHE_H_
+
+#include "Window.h"
+#include "SincWindow.h"
+
+#include "system/Thread.h"
+
+#include <map>
+
+namespace RubberBand {
+
+/**
+ * A process-wide cache of window tables.  Windows are keyed by type
+ * and size, and sinc windows by size and scale (the n and p
+ * arguments to the SincWindow constructor), so that any number of
+ * stretchers using the same sizes share a single copy of each table
+ * rather than calculating their own.
+ *
+ * The windows returned are const, since they are shared.  Each get
+ * call must be balanced by a release call with the same pointer; a
+ * table is deleted when its last user releases it.
+ */
+
+class WindowCache
+{
+public:
+    static const Window<float> *getWindow(WindowType type, int size);
+    static void release(const Window<float> *window);
+
+    static const SincWindow<float> *getSincWindow(int size, int p);
+    static void release(const SincWindow<float> *window);
+
+    /**
+     * Return the number of distinct tables currently held.  For
+     * diagnostic purposes.
+     */
+    static int getTableCount();
+
+private:
+    template <typename W>
+    struct Entry {
+        W *window;
+        int refs;
+    };
+
+    typedef std::pair<int, int> Key;
+
+    struct Tables {
+        std::map<Key, Entry<Window<float> > > windows;
+        std::map<Key, Entry<SincWindow<float> > > sincs;
+        Mutex mutex;
+    };
+
+    // Created on first use, so that it is ready for stretchers
+    // constructed during static initialisation, and never destroyed,
+    // so that it is still there for any destroyed after main() ends
+    static Tables &tables();
+};
+
+}
+
+#endif
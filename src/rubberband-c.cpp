@@ -24,11 +24,43 @@
 #include "rubberband/rubberband-c.h"
 #include "rubberband/RubberBandStretcher.h"
 
+class RubberBandCAllocator : public RubberBand::RubberBandStretcher::Allocator
+{
+public:
+    RubberBandCAllocator(RubberBandAllocateFunction allocate,
+                         RubberBandDeallocateFunction deallocate,
+                         void *data) :
+        m_allocate(allocate), m_deallocate(deallocate), m_data(data) { }
+
+    void *allocate(size_t size, size_t alignment) {
+        return m_allocate(m_data, size, alignment);
+    }
+    void deallocate(void *ptr) {
+        m_deallocate(m_data, ptr);
+    }
+
+private:
+    RubberBandAllocateFunction m_allocate;
+    RubberBandDeallocateFunction m_deallocate;
+    void *m_data;
+};
+
 struct RubberBandState_
 {
     RubberBand::RubberBandStretcher *m_s;
+    RubberBandInputCallback m_inputCallback;
+    void *m_inputCallbackData;
+    RubberBandCAllocator *m_allocator;
 };
 
+static size_t
+rubberband_input_callback(void *data, float *const *input, size_t samples)
+{
+    RubberBandState_ *state = (RubberBandState_ *)data;
+    return state->m_inputCallback(state->m_inputCallbackData,
+                                  input, (unsigned int)samples);
+}
+
 RubberBandState rubberband_new(unsigned int sampleRate,
                                unsigned int channels,
                                RubberBandOptions options,
@@ -42,9 +74,28 @@ RubberBandState rubberband_new(unsigned int sampleRate,
     return state;
 }
 
+RubberBandState rubberband_new_with_allocator(unsigned int sampleRate,
+                                              unsigned int channels,
+                                              RubberBandOptions options,
+                                              double initialTimeRatio,
+                                              double initialPitchScale,
+                                              RubberBandAllocateFunction allocate,
+                                              RubberBandDeallocateFunction deallocate,
+                                              void *allocatorData)
+{
+    RubberBandState_ *state = new RubberBandState_();
+    state->m_allocator = new RubberBandCAllocator
+        (allocate, deallocate, allocatorData);
+    state->m_s = new RubberBand::RubberBandStretcher
+        (sampleRate, channels, options,
+         initialTimeRatio, initialPitchScale, state->m_allocator);
+    return state;
+}
+
 void rubberband_delete(RubberBandState state)
 {
     delete state->m_s;
+    delete state->m_allocator;
     delete state;
 }
 
@@ -118,6 +169,17 @@ void rubberband_set_max_process_size(RubberBandState state, unsigned int samples
     state->m_s->setMaxProcessSize(samples);
 }
 
+void rubberband_set_ratio_ranges(RubberBandState state, double min_time_ratio, double max_time_ratio, double min_pitch_scale, double max_pitch_scale)
+{
+    state->m_s->setRatioRanges(min_time_ratio, max_time_ratio,
+                               min_pitch_scale, max_pitch_scale);
+}
+
+int rubberband_get_realtime_warnings(RubberBandState state)
+{
+    return state->m_s->getRealTimeWarnings();
+}
+
 void rubberband_set_key_frame_map(RubberBandState state, unsigned int keyframecount, unsigned int *from, unsigned int *to)
 {
     std::map<size_t, size_t> kfm;
@@ -137,6 +199,27 @@ void rubberband_process(RubberBandState state, const float *const *input, unsign
     state->m_s->process(input, samples, final != 0);
 }
 
+unsigned int rubberband_process_nonblocking(RubberBandState state, const float *const *input, unsigned int samples, int final)
+{
+    return state->m_s->processNonBlocking(input, samples, final != 0);
+}
+
+void rubberband_set_notification_callback(RubberBandState state, RubberBandNotificationCallback callback, void *data)
+{
+    state->m_s->setNotificationCallback(callback, data);
+}
+
+void rubberband_set_input_callback(RubberBandState state, RubberBandInputCallback callback, void *data)
+{
+    state->m_inputCallback = callback;
+    state->m_inputCallbackData = data;
+    if (callback) {
+        state->m_s->setInputCallback(rubberband_input_callback, state);
+    } else {
+        state->m_s->setInputCallback(0, 0);
+    }
+}
+
 int rubberband_available(const RubberBandState state)
 {
     return state->m_s->available();
@@ -167,3 +250,35 @@ void rubberband_set_default_debug_level(int level)
     RubberBand::RubberBandStretcher::setDefaultDebugLevel(level);
 }
 
+void rubberband_set_thread_pool_size(unsigned int threads)
+{
+    RubberBand::RubberBandStretcher::setThreadPoolSize(threads);
+}
+
+void rubberband_set_threading_verification(int verify)
+{
+    RubberBand::RubberBandStretcher::setThreadingVerification(verify != 0);
+}
+
+void rubberband_set_thread_affinity(const int *processors, unsigned int count)
+{
+    std::vector<int> pv;
+    for (unsigned int i = 0; i < count; ++i) pv.push_back(processors[i]);
+    RubberBand::RubberBandStretcher::setThreadAffinity(pv);
+}
+
+void rubberband_set_thread_priority(int priority)
+{
+    RubberBand::RubberBandStretcher::setThreadPriority(priority);
+}
+
+void rubberband_set_thread_stack_size(unsigned int bytes)
+{
+    RubberBand::RubberBandStretcher::setThreadStackSize(bytes);
+}
+
+void rubberband_set_thread_name_prefix(const char *prefix)
+{
+    RubberBand::RubberBandStretcher::setThreadNamePrefix(prefix);
+}
+
@@ -78,30 +78,70 @@
 // the size changes but remains smaller than that.  The system alloc
 // functions no doubt do exactly the same thing for some value
 // probably not too distant from ours, but we want the certainty.
+//
+// The memory comes from the library's own allocator (see
+// Resampler.cpp) so as to follow any allocator hooks in use.  That
+// has no realloc, so each block starts with a record of its size.
 
 #define ALLOC_MINIMUM 4096
+#define ALLOC_HEADER 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern void *rubberband_speex_allocate(size_t bytes);
+extern void rubberband_speex_deallocate(void *ptr);
+#ifdef __cplusplus
+}
+#endif
 
 static void *speex_alloc (int count, int size)
 {
+    size_t bytes;
+    char *block;
+
     if (count * size < ALLOC_MINIMUM) {
         count = ALLOC_MINIMUM / size;
     }
 
-    return calloc(count, size);
+    bytes = (size_t)count * size;
+    block = (char *)rubberband_speex_allocate(bytes + ALLOC_HEADER);
+    if (!block) return 0;
+
+    *(size_t *)block = bytes;
+    memset(block + ALLOC_HEADER, 0, bytes);
+    return block + ALLOC_HEADER;
 }
 
 static void speex_free (void *ptr)
 {
-    free(ptr);
+    if (ptr) rubberband_speex_deallocate((char *)ptr - ALLOC_HEADER);
 }
 
 static void *speex_realloc (void *ptr, int oldcount, int newcount, int size)
 {
+    size_t oldbytes;
+    void *newptr;
+
     if (newcount * size < ALLOC_MINIMUM) {
         return ptr;
     }
 
-    return realloc(ptr, newcount * size);
+    if (!ptr) {
+        return speex_alloc(newcount, size);
+    }
+
+    oldbytes = *(size_t *)((char *)ptr - ALLOC_HEADER);
+    if (oldbytes >= (size_t)newcount * size) {
+        return ptr;
+    }
+
+    newptr = speex_alloc(newcount, size);
+    if (!newptr) return 0;
+
+    memcpy(newptr, ptr, oldbytes);
+    speex_free(ptr);
+    return newptr;
 }
 
 #include "speex_resampler.h"
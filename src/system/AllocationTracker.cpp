@@ -0,0 +1,109 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#include "Allocators.h"
+
+#ifdef RUBBERBAND_TRACK_ALLOCATIONS
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace RubberBand {
+
+void
+report_forbidden_allocation(const char *what)
+{
+    // Leave the scope first, in case reporting allocates
+    no_allocation_depth() = 0;
+    fprintf(stderr, "ERROR: RubberBand: %s called where allocation is not permitted (real-time processing)\n", what);
+    abort();
+}
+
+}
+
+// Replacements for the global allocation functions, so that heap use
+// by the standard library or anything else within a NoAllocationScope
+// is caught as well as our own allocate() calls
+
+void *
+operator new(size_t size)
+{
+    RubberBand::check_allocation_permitted("operator new");
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *
+operator new[](size_t size)
+{
+    RubberBand::check_allocation_permitted("operator new[]");
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *
+operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    RubberBand::check_allocation_permitted("operator new");
+    return malloc(size ? size : 1);
+}
+
+void *
+operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    RubberBand::check_allocation_permitted("operator new[]");
+    return malloc(size ? size : 1);
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+    if (!ptr) return;
+    RubberBand::check_allocation_permitted("operator delete");
+    free(ptr);
+}
+
+void
+operator delete[](void *ptr) noexcept
+{
+    if (!ptr) return;
+    RubberBand::check_allocation_permitted("operator delete[]");
+    free(ptr);
+}
+
+void
+operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    operator delete(ptr);
+}
+
+void
+operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    operator delete[](ptr);
+}
+
+#endif
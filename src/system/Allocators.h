@@ -29,19 +29,155 @@
 #include <new> // for std::bad_alloc
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 namespace RubberBand {
 
+/**
+ * Functions through which allocate() obtains its memory, in place of
+ * the system aligned allocator.  Hooks are installed for the calling
+ * thread with an AllocatorScope; each stretcher installs its own
+ * (if it has any) on entry to its public functions and in its worker
+ * threads and tasks.
+ *
+ * The allocate function is passed a size and an alignment, which is
+ * always RUBBERBAND_ALIGNMENT, and should return 0 on failure.
+ */
+struct AllocatorHooks
+{
+    void *(*allocate)(void *data, size_t bytes, size_t alignment);
+    void (*deallocate)(void *data, void *ptr);
+    void *data;
+};
+
+/// The hooks in effect for the calling thread, or 0 for the system allocator
+inline const AllocatorHooks *&current_allocator_hooks()
+{
+    static thread_local const AllocatorHooks *hooks = 0;
+    return hooks;
+}
+
+/// RAII class to install allocator hooks for the calling thread
+class AllocatorScope
+{
+public:
+    AllocatorScope(const AllocatorHooks *hooks) :
+        m_previous(current_allocator_hooks()) {
+        current_allocator_hooks() = hooks;
+    }
+    ~AllocatorScope() {
+        current_allocator_hooks() = m_previous;
+    }
+private:
+    const AllocatorHooks *m_previous;
+    AllocatorScope(const AllocatorScope &); // not provided
+    AllocatorScope &operator=(const AllocatorScope &); // not provided
+};
+
+#ifdef RUBBERBAND_TRACK_ALLOCATIONS
+
+/// The number of NoAllocationScopes active on the calling thread
+inline int &no_allocation_depth()
+{
+    static thread_local int depth = 0;
+    return depth;
+}
+
+/// Report an allocation within a NoAllocationScope, and abort
+void report_forbidden_allocation(const char *what);
+
+#endif
+
+/// Abort if the calling thread is in a NoAllocationScope (see below)
+inline void check_allocation_permitted(const char *what)
+{
+#ifdef RUBBERBAND_TRACK_ALLOCATIONS
+    if (no_allocation_depth() > 0) report_forbidden_allocation(what);
+#else
+    (void)what;
+#endif
+}
+
+/**
+ * RAII class marking code that must not use the heap, such as
+ * process() and retrieve() in real-time mode.  If the library is
+ * built with RUBBERBAND_TRACK_ALLOCATIONS defined, any allocation or
+ * deallocation on the same thread while a scope is active -- through
+ * allocate() and deallocate(), or through operator new and delete
+ * anywhere in the program -- aborts with a message saying what it
+ * was.  Otherwise this does nothing.
+ */
+class NoAllocationScope
+{
+public:
+    NoAllocationScope(bool active = true) : m_active(active) {
+#ifdef RUBBERBAND_TRACK_ALLOCATIONS
+        if (m_active) ++no_allocation_depth();
+#endif
+    }
+    ~NoAllocationScope() {
+#ifdef RUBBERBAND_TRACK_ALLOCATIONS
+        if (m_active) --no_allocation_depth();
+#endif
+    }
+private:
+    bool m_active;
+    NoAllocationScope(const NoAllocationScope &); // not provided
+    NoAllocationScope &operator=(const NoAllocationScope &); // not provided
+};
+
+/// Record at the start of each block returned by allocate()
+struct AllocationHeader
+{
+    void (*deallocate)(void *data, void *ptr); // 0 for system allocator
+    void *data;
+};
+
+/// Allocate memory aligned to RUBBERBAND_ALIGNMENT (see VectorOps.h)
 template <typename T>
 T *allocate(size_t count)
 {
+    // Round up to whole cache lines, so that the end of one buffer
+    // never shares a line with another allocation (aligned_alloc
+    // also requires the size to be a multiple of the alignment)
+    size_t bytes = count * sizeof(T);
+    bytes = (bytes + RUBBERBAND_ALIGNMENT - 1) & ~size_t(RUBBERBAND_ALIGNMENT - 1);
+    if (bytes == 0) bytes = RUBBERBAND_ALIGNMENT;
+
+    // Each block is preceded by a cache line recording where it came
+    // from, so that deallocate() can return it to the same allocator
+    // whatever thread or scope it is called from
+    bytes += RUBBERBAND_ALIGNMENT;
+
+    check_allocation_permitted("allocate");
+
+    const AllocatorHooks *hooks = current_allocator_hooks();
     void *ptr = 0;
-    ptr = malloc(count * sizeof(T));
+
+    if (hooks) {
+        ptr = hooks->allocate(hooks->data, bytes, RUBBERBAND_ALIGNMENT);
+    } else {
+#ifdef _WIN32
+        ptr = _aligned_malloc(bytes, RUBBERBAND_ALIGNMENT);
+#elif defined(__APPLE__)
+        // aligned_alloc is missing from older macOS
+        if (posix_memalign(&ptr, RUBBERBAND_ALIGNMENT, bytes)) ptr = 0;
+#else
+        ptr = aligned_alloc(RUBBERBAND_ALIGNMENT, bytes);
+#endif
+    }
 
     if (!ptr) {
         throw(std::bad_alloc());
     }
 
-    return (T *)ptr;
+    AllocationHeader *header = (AllocationHeader *)ptr;
+    header->deallocate = (hooks ? hooks->deallocate : 0);
+    header->data = (hooks ? hooks->data : 0);
+
+    return (T *)((char *)ptr + RUBBERBAND_ALIGNMENT);
 }
 
 template <typename T>
@@ -55,7 +191,23 @@ T *allocate_and_zero(size_t count)
 template <typename T>
 void deallocate(T *ptr)
 {
-    if (ptr) free((void *)ptr);
+    if (!ptr) return;
+
+    check_allocation_permitted("deallocate");
+
+    void *block = (char *)ptr - RUBBERBAND_ALIGNMENT;
+    AllocationHeader *header = (AllocationHeader *)block;
+
+    if (header->deallocate) {
+        header->deallocate(header->data, block);
+        return;
+    }
+
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
 }
 
 /// Reallocate preserving contents but leaving additional memory uninitialised
@@ -155,7 +307,48 @@ private:
     T *m_t;
 };
 
+/**
+ * Base class for objects that should be created through allocate()
+ * (and so through any allocator hooks in scope) when constructed
+ * with new.
+ */
+class Allocated
+{
+public:
+    static void *operator new(size_t size) {
+        return allocate<char>(size);
+    }
+    static void operator delete(void *ptr) {
+        deallocate<char>((char *)ptr);
+    }
+};
+
+/**
+ * Standard library allocator that obtains its memory through
+ * allocate(), for containers owned by objects that use allocator
+ * hooks.
+ */
+template <typename T>
+class StlAllocator
+{
+public:
+    typedef T value_type;
+
+    StlAllocator() { }
+    template <typename U> StlAllocator(const StlAllocator<U> &) { }
+
+    T *allocate(size_t n) { return RubberBand::allocate<T>(n); }
+    void deallocate(T *ptr, size_t) { RubberBand::deallocate<T>(ptr); }
+
+    template <typename U> struct rebind { typedef StlAllocator<U> other; };
+};
+
+template <typename T, typename U>
+bool operator==(const StlAllocator<T> &, const StlAllocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const StlAllocator<T> &, const StlAllocator<U> &) { return false; }
+
 }
 
 #endif
-
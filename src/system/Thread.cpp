@@ -29,6 +29,13 @@
 #ifdef USE_PTHREADS
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#if defined(_POSIX_MONOTONIC_CLOCK) && !defined(__APPLE__)
+#define RUBBERBAND_CONDITION_MONOTONIC 1
+#endif
 #endif
 
 using std::cerr;
@@ -38,9 +45,72 @@ using std::string;
 namespace RubberBand
 {
 
+struct ThreadSettings
+{
+    ThreadSettings() : priority(-1), stackSize(0), namePrefix("rb") { }
+    std::vector<int> processors;
+    int priority;
+    size_t stackSize;
+    string namePrefix;
+};
+
+static ThreadSettings _settings;
+static Mutex _settingsMutex;
+
+static ThreadSettings
+getSettings()
+{
+    MutexLocker locker(&_settingsMutex);
+    return _settings;
+}
+
+static string
+makeFullName(const ThreadSettings &settings, string name)
+{
+    // Most systems limit thread names to 15 characters
+    string full = settings.namePrefix;
+    if (name != "") {
+        if (full != "") full += "-";
+        full += name;
+    }
+    if (full.length() > 15) full = full.substr(0, 15);
+    return full;
+}
+
+void
+Thread::setAffinity(const std::vector<int> &processors)
+{
+    MutexLocker locker(&_settingsMutex);
+    _settings.processors = processors;
+}
+
+void
+Thread::setPriority(int priority)
+{
+    if (priority < -1) priority = -1;
+    if (priority > 99) priority = 99;
+    MutexLocker locker(&_settingsMutex);
+    _settings.priority = priority;
+}
+
+void
+Thread::setStackSize(size_t bytes)
+{
+    MutexLocker locker(&_settingsMutex);
+    _settings.stackSize = bytes;
+}
+
+void
+Thread::setNamePrefix(string prefix)
+{
+    MutexLocker locker(&_settingsMutex);
+    _settings.namePrefix = prefix;
+}
+
 #ifdef _WIN32
 
-Thread::Thread() :
+Thread::Thread(string name) :
+    m_name(name),
     m_id(0),
     m_extant(false)
 {
@@ -56,13 +126,36 @@ Thread::~Thread()
 void
 Thread::start()
 {
-    m_id = CreateThread(NULL, 0, staticRun, this, 0, 0);
+    ThreadSettings settings = getSettings();
+    m_fullName = makeFullName(settings, m_name);
+
+    m_id = CreateThread(NULL, settings.stackSize, staticRun, this, 0, 0);
     if (!m_id) {
         cerr << "ERROR: thread creation failed" << endl;
         exit(1);
     } else {
         m_extant = true;
     }
+
+    if (settings.priority > 0) {
+        SetThreadPriority(m_id, THREAD_PRIORITY_TIME_CRITICAL);
+    } else if (settings.priority == 0) {
+        SetThreadPriority(m_id, THREAD_PRIORITY_NORMAL);
+    }
+
+    if (!settings.processors.empty()) {
+        DWORD_PTR mask = 0;
+        for (size_t i = 0; i < settings.processors.size(); ++i) {
+            int p = settings.processors[i];
+            if (p >= 0 && p < int(sizeof(DWORD_PTR) * 8)) {
+                mask |= (DWORD_PTR(1) << p);
+            }
+        }
+        if (!mask || !SetThreadAffinityMask(m_id, mask)) {
+            cerr << "WARNING: Thread::start: failed to set affinity for thread \""
+                 << m_fullName << "\"" << endl;
+        }
+    }
 }
 
 void
@@ -183,11 +276,34 @@ Condition::signal()
     SetEvent(m_condition);
 }
 
+Semaphore::Semaphore()
+{
+    m_semaphore = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+}
+
+Semaphore::~Semaphore()
+{
+    CloseHandle(m_semaphore);
+}
+
+void
+Semaphore::post()
+{
+    ReleaseSemaphore(m_semaphore, 1, NULL);
+}
+
+void
+Semaphore::wait()
+{
+    WaitForSingleObject(m_semaphore, INFINITE);
+}
+
 #else /* !_WIN32 */
 
 #ifdef USE_PTHREADS
 
-Thread::Thread() :
+Thread::Thread(string name) :
+    m_name(name),
     m_id(0),
     m_extant(false)
 {
@@ -203,12 +319,72 @@ Thread::~Thread()
 void
 Thread::start()
 {
-    if (pthread_create(&m_id, 0, staticRun, this)) {
+    ThreadSettings settings = getSettings();
+    m_fullName = makeFullName(settings, m_name);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (settings.stackSize > 0) {
+        size_t size = settings.stackSize;
+#ifdef PTHREAD_STACK_MIN
+        if (size < size_t(PTHREAD_STACK_MIN)) size = PTHREAD_STACK_MIN;
+#endif
+        if (pthread_attr_setstacksize(&attr, size)) {
+            cerr << "WARNING: Thread::start: failed to set stack size of "
+                 << size << " bytes" << endl;
+        }
+    }
+
+    if (settings.priority >= 0) {
+        int policy = (settings.priority > 0 ? SCHED_FIFO : SCHED_OTHER);
+        struct sched_param param;
+        param.sched_priority = 0;
+        if (policy == SCHED_FIFO) {
+            int min = sched_get_priority_min(policy);
+            int max = sched_get_priority_max(policy);
+            param.sched_priority = settings.priority;
+            if (param.sched_priority < min) param.sched_priority = min;
+            if (param.sched_priority > max) param.sched_priority = max;
+        }
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, policy);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    int rv = pthread_create(&m_id, &attr, staticRun, this);
+
+    if (rv == EPERM && settings.priority >= 0) {
+        cerr << "WARNING: Thread::start: not permitted to set scheduling "
+             << "policy for thread \"" << m_fullName
+             << "\", using inherited policy" << endl;
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        rv = pthread_create(&m_id, &attr, staticRun, this);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (rv) {
         cerr << "ERROR: thread creation failed" << endl;
         exit(1);
     } else {
         m_extant = true;
     }
+
+#ifdef __linux__
+    if (!settings.processors.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < settings.processors.size(); ++i) {
+            int p = settings.processors[i];
+            if (p >= 0 && p < CPU_SETSIZE) CPU_SET(p, &set);
+        }
+        if (pthread_setaffinity_np(m_id, sizeof(set), &set)) {
+            cerr << "WARNING: Thread::start: failed to set affinity for thread \""
+                 << m_fullName << "\"" << endl;
+        }
+    }
+#endif
 }
 
 void
@@ -236,6 +412,13 @@ void *
 Thread::staticRun(void *arg)
 {
     Thread *thread = static_cast<Thread *>(arg);
+    if (thread->m_fullName != "") {
+#if defined(__APPLE__)
+        pthread_setname_np(thread->m_fullName.c_str());
+#elif defined(__linux__)
+        pthread_setname_np(pthread_self(), thread->m_fullName.c_str());
+#endif
+    }
     thread->run();
     return 0;
 }
@@ -276,7 +459,17 @@ Condition::Condition(string name) :
     m_locked(false)
 {
     pthread_mutex_init(&m_mutex, 0);
+#ifdef RUBBERBAND_CONDITION_MONOTONIC
+    // Time out against the monotonic clock, so that a timed wait is
+    // not stretched or cut short by changes to the wall-clock time
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_condition, &attr);
+    pthread_condattr_destroy(&attr);
+#else
     pthread_cond_init(&m_condition, 0);
+#endif
 }
 
 Condition::~Condition()
@@ -309,20 +502,31 @@ Condition::wait(int us)
     if (us == 0) {
         pthread_cond_wait(&m_condition, &m_mutex);
     } else {
-        struct timeval now;
-        gettimeofday(&now, 0);
-
-        now.tv_usec += us;
-        while (now.tv_usec > 1000000) {
-            now.tv_usec -= 1000000;
-            ++now.tv_sec;
-        }
+#if defined(__APPLE__)
+        struct timespec timeout;
+        timeout.tv_sec = us / 1000000;
+        timeout.tv_nsec = (us % 1000000) * 1000;
 
+        pthread_cond_timedwait_relative_np(&m_condition, &m_mutex, &timeout);
+#else
         struct timespec timeout;
+#ifdef RUBBERBAND_CONDITION_MONOTONIC
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+#else
+        struct timeval now;
+        gettimeofday(&now, 0);
         timeout.tv_sec = now.tv_sec;
         timeout.tv_nsec = now.tv_usec * 1000;
+#endif
+        timeout.tv_sec += us / 1000000;
+        timeout.tv_nsec += (us % 1000000) * 1000;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_nsec -= 1000000000;
+            ++timeout.tv_sec;
+        }
 
         pthread_cond_timedwait(&m_condition, &m_mutex, &timeout);
+#endif
     }
 
     m_locked = true;
@@ -334,9 +538,60 @@ Condition::signal()
     pthread_cond_signal(&m_condition);
 }
 
+#ifdef __APPLE__
+
+Semaphore::Semaphore()
+{
+    m_semaphore = dispatch_semaphore_create(0);
+}
+
+Semaphore::~Semaphore()
+{
+    dispatch_release(m_semaphore);
+}
+
+void
+Semaphore::post()
+{
+    dispatch_semaphore_signal(m_semaphore);
+}
+
+void
+Semaphore::wait()
+{
+    dispatch_semaphore_wait(m_semaphore, DISPATCH_TIME_FOREVER);
+}
+
+#else
+
+Semaphore::Semaphore()
+{
+    sem_init(&m_semaphore, 0, 0);
+}
+
+Semaphore::~Semaphore()
+{
+    sem_destroy(&m_semaphore);
+}
+
+void
+Semaphore::post()
+{
+    sem_post(&m_semaphore);
+}
+
+void
+Semaphore::wait()
+{
+    while (sem_wait(&m_semaphore) != 0 && errno == EINTR) { }
+}
+
+#endif
+
 #else /* !USE_PTHREADS */
 
-Thread::Thread()
+Thread::Thread(string name) :
+    m_name(name)
 {
 }
 
@@ -420,6 +675,26 @@ Condition::signal()
     abort();
 }
 
+Semaphore::Semaphore()
+{
+}
+
+Semaphore::~Semaphore()
+{
+}
+
+void
+Semaphore::post()
+{
+    abort();
+}
+
+void
+Semaphore::wait()
+{
+    abort();
+}
+
 #endif /* !USE_PTHREADS */
 #endif /* !_WIN32 */
 
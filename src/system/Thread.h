@@ -25,12 +25,18 @@
 #define _RUBBERBAND_THREAD_H_
 
 #include <string>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h>
 #else /* !_WIN32 */
 #ifdef USE_PTHREADS
 #include <pthread.h>
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
 #else /* !USE_PTHREADS */
 #error No thread implementation selected
 #endif /* !USE_PTHREADS */
@@ -50,7 +56,12 @@ public:
 #endif
 #endif
 
-    Thread();
+    /**
+     * Construct a thread with the given name.  The name is appended
+     * to the process-wide name prefix (see setNamePrefix) and given
+     * to the system thread when it is started, where supported.
+     */
+    Thread(std::string name = "");
     virtual ~Thread();
 
     Id id();
@@ -60,10 +71,45 @@ public:
 
     static bool threadingAvailable();
 
+    /**
+     * The following settings are process-wide, and are applied to
+     * each thread as it is started.  Threads that are already running
+     * are not affected.
+     */
+
+    /**
+     * Restrict threads to the given set of processor indices.  An
+     * empty set (the default) places no restriction.
+     */
+    static void setAffinity(const std::vector<int> &processors);
+
+    /**
+     * Set the scheduling priority.  A value from 1 to 99 requests
+     * SCHED_FIFO at that priority; zero requests the default
+     * time-sharing policy (SCHED_OTHER); and -1 (the default) means
+     * threads inherit the policy of the thread that starts them.  If
+     * the process is not permitted to use SCHED_FIFO, threads are
+     * started with the inherited policy and a warning is printed.
+     */
+    static void setPriority(int priority);
+
+    /**
+     * Set the stack size in bytes, or zero for the system default.
+     */
+    static void setStackSize(size_t bytes);
+
+    /**
+     * Set the prefix for thread names.  The default is "rb".
+     */
+    static void setNamePrefix(std::string prefix);
+
 protected:
     virtual void run() = 0;
 
 private:
+    std::string m_name;
+    std::string m_fullName;
+
 #ifdef _WIN32
     HANDLE m_id;
     bool m_extant;
@@ -113,12 +159,18 @@ private:
   To wait on a condition, call lock(), test the termination condition
   if desired, then wait().  The condition will be unlocked during the
   wait and re-locked when wait() returns (which will happen when the
-  condition is signalled or the timer times out).
+  condition is signalled or the timer times out).  A wait of zero
+  microseconds (the default) has no timeout.  Timeouts are measured
+  against a monotonic clock where one is available.
 
   To signal a condition, call signal().  If the condition is signalled
   between lock() and wait(), the signal may be missed by the waiting
   thread.  To avoid this, the signalling thread should also lock the
   condition before calling signal() and unlock it afterwards.
+
+  wait() may also return spuriously, so a waiter that has no timeout
+  should re-test its termination condition in a loop while holding
+  the lock, rather than relying on a timer to catch a missed signal.
 */
 
 class Condition
@@ -148,6 +200,41 @@ private:
 #endif
 };
 
+/**
+  A counting semaphore, for parking a thread until another has work
+  for it.  Unlike signalling a Condition, post() takes no lock and
+  never blocks, so it may be called from a real-time thread.
+*/
+
+class Semaphore
+{
+public:
+    Semaphore();
+    ~Semaphore();
+
+    /// Increment the count, waking a waiting thread if there is one
+    void post();
+
+    /// Wait until the count is nonzero, then decrement it
+    void wait();
+
+private:
+#ifdef _WIN32
+    HANDLE m_semaphore;
+#else
+#ifdef USE_PTHREADS
+#ifdef __APPLE__
+    dispatch_semaphore_t m_semaphore;
+#else
+    sem_t m_semaphore;
+#endif
+#endif
+#endif
+
+    Semaphore(const Semaphore &); // not provided
+    Semaphore &operator=(const Semaphore &); // not provided
+};
+
 }
 
 #endif
@@ -0,0 +1,270 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#include "ThreadPool.h"
+
+#include "sysutils.h"
+
+#include <algorithm>
+
+namespace RubberBand
+{
+
+ThreadPool *
+ThreadPool::m_shared = 0;
+
+int
+ThreadPool::m_sharedThreadCount = 0;
+
+Mutex
+ThreadPool::m_sharedMutex;
+
+ThreadPool::Task::Task() :
+    m_state(Idle),
+    m_worker(-1),
+    m_finished("task finished")
+{
+}
+
+ThreadPool::Task::~Task()
+{
+}
+
+ThreadPool::ThreadPool(int threads) :
+    m_queued(0),
+    m_nextQueue(0),
+    m_steals(0),
+    m_condition("thread pool"),
+    m_exiting(false)
+{
+    setThreadCount(threads);
+}
+
+ThreadPool::~ThreadPool()
+{
+    m_condition.lock();
+    m_exiting = true;
+    for (size_t i = 0; i < m_queues.size(); ++i) {
+        m_queues[i].clear();
+    }
+    m_queued = 0;
+    m_condition.signal();
+    m_condition.unlock();
+
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        m_workers[i]->wait();
+        delete m_workers[i];
+    }
+}
+
+int
+ThreadPool::getThreadCount() const
+{
+    return int(m_workers.size());
+}
+
+int
+ThreadPool::getStealCount() const
+{
+    return m_steals;
+}
+
+void
+ThreadPool::setThreadCount(int threads)
+{
+    if (threads <= 0) {
+        threads = system_get_processor_count();
+        if (threads < 1) threads = 1;
+    }
+
+    m_condition.lock();
+    while (int(m_workers.size()) < threads) {
+        Worker *worker = new Worker(this, int(m_workers.size()));
+        m_workers.push_back(worker);
+        m_queues.push_back(std::deque<Task *>());
+        worker->start();
+    }
+    m_condition.unlock();
+}
+
+void
+ThreadPool::schedule(Task *task)
+{
+    m_condition.lock();
+    switch (task->m_state) {
+    case Idle:
+        // Back on the queue of the worker that last ran it, or round
+        // robin if it has never been run
+        if (task->m_worker < 0) {
+            task->m_worker = m_nextQueue;
+            m_nextQueue = (m_nextQueue + 1) % int(m_queues.size());
+        }
+        task->m_state = Queued;
+        enqueue(task, task->m_worker);
+        m_condition.signal();
+        break;
+    case Running:
+        task->m_state = RunningAndQueued;
+        break;
+    case Queued:
+    case RunningAndQueued:
+        break;
+    }
+    m_condition.unlock();
+}
+
+void
+ThreadPool::cancel(Task *task)
+{
+    // Lock ordering: a task's m_finished is always taken before the
+    // pool's m_condition, here and in Worker::run
+
+    task->m_finished.lock();
+
+    while (true) {
+        m_condition.lock();
+        if (task->m_state == Queued) {
+            std::deque<Task *> &queue = m_queues[task->m_worker];
+            queue.erase(std::find(queue.begin(), queue.end(), task));
+            --m_queued;
+            task->m_state = Idle;
+        } else if (task->m_state == RunningAndQueued) {
+            task->m_state = Running;
+        }
+        bool idle = (task->m_state == Idle);
+        m_condition.unlock();
+        if (idle) break;
+        task->m_finished.wait();
+    }
+
+    task->m_finished.unlock();
+}
+
+void
+ThreadPool::enqueue(Task *task, int worker)
+{
+    task->m_worker = worker;
+    m_queues[worker].push_back(task);
+    ++m_queued;
+}
+
+ThreadPool::Task *
+ThreadPool::take(int worker)
+{
+    if (m_queued == 0) return 0;
+
+    Task *task = 0;
+
+    // Our own queue first, most recent first as it is the most likely
+    // to still be in cache; otherwise the oldest task from the next
+    // non-empty queue along
+
+    if (!m_queues[worker].empty()) {
+        task = m_queues[worker].back();
+        m_queues[worker].pop_back();
+    } else {
+        int n = int(m_queues.size());
+        for (int i = 1; i < n; ++i) {
+            std::deque<Task *> &victim = m_queues[(worker + i) % n];
+            if (!victim.empty()) {
+                task = victim.front();
+                victim.pop_front();
+                ++m_steals;
+                break;
+            }
+        }
+    }
+
+    --m_queued;
+    task->m_worker = worker;
+    task->m_state = Running;
+    return task;
+}
+
+void
+ThreadPool::Worker::run()
+{
+    Condition &condition = m_pool->m_condition;
+
+    condition.lock();
+
+    while (true) {
+
+        while (m_pool->m_queued == 0 && !m_pool->m_exiting) {
+            condition.wait();
+        }
+
+        if (m_pool->m_exiting) {
+            // pass the wakeup on to the next worker
+            condition.signal();
+            break;
+        }
+
+        Task *task = m_pool->take(m_index);
+
+        condition.unlock();
+
+        task->run();
+
+        task->m_finished.lock();
+        condition.lock();
+
+        if (task->m_state == RunningAndQueued) {
+            task->m_state = Queued;
+            m_pool->enqueue(task, m_index);
+            condition.signal();
+        } else {
+            task->m_state = Idle;
+        }
+
+        // The task may be deleted by a waiting canceller as soon as
+        // we release m_finished, so we must not touch it after this
+        task->m_finished.signal();
+        task->m_finished.unlock();
+    }
+
+    condition.unlock();
+}
+
+ThreadPool *
+ThreadPool::getShared()
+{
+    MutexLocker locker(&m_sharedMutex);
+    if (!m_shared) {
+        m_shared = new ThreadPool(m_sharedThreadCount);
+    }
+    return m_shared;
+}
+
+void
+ThreadPool::setSharedThreadCount(int threads)
+{
+    MutexLocker locker(&m_sharedMutex);
+    m_sharedThreadCount = threads;
+    if (m_shared) {
+        m_shared->setThreadCount(threads);
+    }
+}
+
+}
@@ -0,0 +1,163 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef _RUBBERBAND_THREAD_POOL_H_
+#define _RUBBERBAND_THREAD_POOL_H_
+
+#include "Thread.h"
+
+#include <vector>
+#include <deque>
+
+namespace RubberBand
+{
+
+/**
+ * A fixed set of worker threads that run tasks submitted to it by
+ * any number of clients.
+ *
+ * A task is never run by more than one worker at a time.  If a task
+ * is scheduled while it is already queued, nothing happens; if it is
+ * scheduled while it is running, it will be queued again when its
+ * current run finishes.  This suits tasks that process whatever input
+ * has accumulated for them, such as a per-channel process step.
+ *
+ * Each worker has its own queue.  A task is queued to the worker that
+ * last ran it, so that a task that is scheduled repeatedly tends to
+ * stay on one thread with its data in that thread's cache, and a
+ * worker whose queue is empty takes ("steals") the oldest task from
+ * the queue of another worker.  This keeps all the workers busy when
+ * tasks take uneven amounts of time, without giving up locality when
+ * they don't.
+ *
+ * A process-wide shared instance is available through getShared().
+ */
+
+class ThreadPool
+{
+public:
+    class Task
+    {
+    public:
+        Task();
+        virtual ~Task();
+
+        virtual void run() = 0;
+
+    private:
+        friend class ThreadPool;
+        int m_state;
+        int m_worker; // queue the task is on or was last run from
+        Condition m_finished;
+    };
+
+    /**
+     * Construct a pool with the given number of worker threads.  If
+     * threads is zero, use one thread per available processor.
+     */
+    ThreadPool(int threads);
+
+    /**
+     * Destroy the pool, waiting for any running tasks to finish.
+     * Queued tasks that have not started will not be run.  Clients
+     * should cancel their tasks before the pool is destroyed.
+     */
+    ~ThreadPool();
+
+    int getThreadCount() const;
+
+    /**
+     * Return the number of times a worker has taken a task from
+     * another worker's queue.  For diagnostic purposes.
+     */
+    int getStealCount() const;
+
+    /**
+     * Increase the number of worker threads to the given count (or
+     * one per available processor, if zero).  The pool never shrinks.
+     */
+    void setThreadCount(int threads);
+
+    /**
+     * Arrange for the task to be run on a worker thread as soon as
+     * one is available.
+     */
+    void schedule(Task *task);
+
+    /**
+     * Remove the task from the queue if it has not yet started, and
+     * wait for it to finish if it has.  When this returns, the task
+     * is not running and will not be run again unless it is
+     * rescheduled.
+     */
+    void cancel(Task *task);
+
+    /**
+     * Return the process-wide shared pool, creating it if necessary.
+     */
+    static ThreadPool *getShared();
+
+    /**
+     * Set the number of threads for the shared pool.  If the pool has
+     * already been created, it may be grown but will not be shrunk.
+     */
+    static void setSharedThreadCount(int threads);
+
+protected:
+    class Worker : public Thread
+    {
+    public:
+        Worker(ThreadPool *pool, int index) :
+            Thread("pool"), m_pool(pool), m_index(index) { }
+        void run();
+    private:
+        ThreadPool *m_pool;
+        int m_index;
+    };
+
+    enum TaskState { Idle, Queued, Running, RunningAndQueued };
+
+    void enqueue(Task *task, int worker); // with m_condition held
+    Task *take(int worker); // with m_condition held
+
+    std::vector<Worker *> m_workers;
+    std::vector<std::deque<Task *> > m_queues; // one per worker
+    int m_queued; // total across m_queues
+    int m_nextQueue;
+    int m_steals;
+    Condition m_condition; // protects queues, task states, m_exiting
+    bool m_exiting;
+
+    static ThreadPool *m_shared;
+    static int m_sharedThreadCount;
+    static Mutex m_sharedMutex;
+
+private:
+    ThreadPool(const ThreadPool &); // not provided
+    ThreadPool &operator=(const ThreadPool &); // not provided
+};
+
+}
+
+#endif
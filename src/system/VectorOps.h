@@ -37,6 +37,34 @@ namespace RubberBand {
 // auto-vectorizable by a sensible compiler (definitely gcc-4.3 on
 // Linux, ideally also gcc-4.0 on OS/X).
 
+// Memory from allocate() and friends in Allocators.h starts on a
+// boundary of this many bytes: a cache line, and enough for the
+// widest SIMD loads in use.
+
+#define RUBBERBAND_ALIGNMENT 64
+
+template<typename T>
+inline bool v_is_aligned(const T *const ptr)
+{
+    return (size_t(ptr) & (RUBBERBAND_ALIGNMENT - 1)) == 0;
+}
+
+// Return ptr, telling the compiler that it is aligned to
+// RUBBERBAND_ALIGNMENT so that it can use aligned loads and stores
+// and skip the peeling loop at the start.  Only call this on a
+// pointer known to be aligned, such as one from allocate(): the
+// kernels below test v_is_aligned() first.
+
+template<typename T>
+inline T *v_aligned(T *const ptr)
+{
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+    return (T *)__builtin_assume_aligned(ptr, RUBBERBAND_ALIGNMENT);
+#else
+    return ptr;
+#endif
+}
+
 template<typename T>
 inline void v_zero(T *const ptr,
                    const int count)
@@ -72,6 +100,14 @@ inline void v_copy(T *const dst,
                    const T *const src,
                    const int count)
 {
+    if (v_is_aligned(dst) && v_is_aligned(src)) {
+        T *const d = v_aligned(dst);
+        const T *const s = v_aligned(src);
+        for (int i = 0; i < count; ++i) {
+            d[i] = s[i];
+        }
+        return;
+    }
     for (int i = 0; i < count; ++i) {
         dst[i] = src[i];
     }
@@ -138,6 +174,14 @@ inline void v_add(T *const dst,
                   const T *const src,
                   const int count)
 {
+    if (v_is_aligned(dst) && v_is_aligned(src)) {
+        T *const d = v_aligned(dst);
+        const T *const s = v_aligned(src);
+        for (int i = 0; i < count; ++i) {
+            d[i] += s[i];
+        }
+        return;
+    }
     for (int i = 0; i < count; ++i) {
         dst[i] += src[i];
     }
@@ -211,6 +255,14 @@ inline void v_multiply(T *const dst,
                        const T *const src,
                        const int count)
 {
+    if (v_is_aligned(dst) && v_is_aligned(src)) {
+        T *const d = v_aligned(dst);
+        const T *const s = v_aligned(src);
+        for (int i = 0; i < count; ++i) {
+            d[i] *= s[i];
+        }
+        return;
+    }
     for (int i = 0; i < count; ++i) {
         dst[i] *= src[i];
     }
@@ -222,6 +274,15 @@ inline void v_multiply(T *const dst,
                        const T *const src2,
                        const int count)
 {
+    if (v_is_aligned(dst) && v_is_aligned(src1) && v_is_aligned(src2)) {
+        T *const d = v_aligned(dst);
+        const T *const s1 = v_aligned(src1);
+        const T *const s2 = v_aligned(src2);
+        for (int i = 0; i < count; ++i) {
+            d[i] = s1[i] * s2[i];
+        }
+        return;
+    }
     for (int i = 0; i < count; ++i) {
         dst[i] = src1[i] * src2[i];
     }
@@ -243,6 +304,15 @@ inline void v_multiply_and_add(T *const dst,
                                const T *const src2,
                                const int count)
 {
+    if (v_is_aligned(dst) && v_is_aligned(src1) && v_is_aligned(src2)) {
+        T *const d = v_aligned(dst);
+        const T *const s1 = v_aligned(src1);
+        const T *const s2 = v_aligned(src2);
+        for (int i = 0; i < count; ++i) {
+            d[i] += s1[i] * s2[i];
+        }
+        return;
+    }
     for (int i = 0; i < count; ++i) {
         dst[i] += src1[i] * src2[i];
     }
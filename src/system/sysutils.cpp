@@ -30,6 +30,8 @@
 #else /* !_WIN32 */
 #include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #ifdef __APPLE__
 #include <sys/sysctl.h>
 #include <mach/mach.h>
@@ -38,6 +40,9 @@
 #include <stdio.h>
 #include <string.h>
 #endif /* !__APPLE__, !_WIN32 */
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif /* !_WIN32 */
 
 #ifdef __sun
@@ -46,6 +51,7 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <string>
 
 #ifdef _WIN32
 #include <fstream>
@@ -141,6 +147,39 @@ system_is_multiprocessor()
     return mp;
 }
 
+int
+system_get_processor_count()
+{
+    static int count = 0;
+
+    if (count > 0) return count;
+
+#ifdef _WIN32
+
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    count = sysinfo.dwNumberOfProcessors;
+
+#else /* !_WIN32 */
+#ifdef __APPLE__
+
+    size_t sz = sizeof(count);
+    if (sysctlbyname("hw.ncpu", &count, &sz, NULL, 0)) {
+        count = 0;
+    }
+
+#else /* !__APPLE__, !_WIN32 */
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) count = int(n);
+
+#endif /* !__APPLE__, !_WIN32 */
+#endif /* !_WIN32 */
+
+    if (count < 1) count = 1;
+    return count;
+}
+
 #ifdef _WIN32
 
 void gettimeofday(struct timeval *tv, void *tz)
@@ -243,6 +282,119 @@ system_get_process_status(int pid)
 #endif
 }
 
+void *
+system_allocate_mirrored(size_t &bytes)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = ((bytes + page - 1) / page) * page;
+    if (size == 0) size = page;
+
+    int fd = syscall(SYS_memfd_create, "rubberband", 1 /* MFD_CLOEXEC */);
+    if (fd < 0) return 0;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    // Reserve the whole range first, so that nothing else can be
+    // mapped into the second half, then map the file over each half
+
+    char *base = (char *)mmap(0, size * 2, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == (char *)MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    void *a = mmap(base, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0);
+    void *b = mmap(base + size, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+
+    if (a != base || b != base + size) {
+        munmap(base, size * 2);
+        return 0;
+    }
+
+    bytes = size;
+    return base;
+#else
+    (void)bytes;
+    return 0;
+#endif
+}
+
+void
+system_deallocate_mirrored(void *ptr, size_t bytes)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+    if (ptr) munmap(ptr, bytes * 2);
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
+
+int
+system_open_temp_file()
+{
+#ifndef _WIN32
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    std::string path = std::string(dir) + "/rubberband-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+void
+system_close_temp_file(int fd)
+{
+#ifndef _WIN32
+    if (fd >= 0) close(fd);
+#else
+    (void)fd;
+#endif
+}
+
+void *
+system_map_temp_file(int fd, size_t offset, size_t bytes)
+{
+#ifndef _WIN32
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    if (size_t(st.st_size) < offset + bytes) {
+        if (ftruncate(fd, offset + bytes) != 0) return 0;
+    }
+    void *ptr = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (ptr == MAP_FAILED) return 0;
+    return ptr;
+#else
+    (void)fd;
+    (void)offset;
+    (void)bytes;
+    return 0;
+#endif
+}
+
+void
+system_unmap_temp_file(void *ptr, size_t bytes)
+{
+#ifndef _WIN32
+    if (ptr) munmap(ptr, bytes);
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
+
 #ifdef _WIN32
 void system_memorybarrier()
 {
@@ -30,19 +30,43 @@
 #include <alloca.h>
 #endif
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 
 namespace RubberBand {
 
 extern const char *system_get_platform_tag();
 extern bool system_is_multiprocessor();
+extern int system_get_processor_count();
 extern void system_specific_initialise();
 extern void system_specific_application_initialise();
 
 enum ProcessStatus { ProcessRunning, ProcessNotRunning, UnknownProcessStatus };
 extern ProcessStatus system_get_process_status(int pid);
 
+// Map a buffer of at least "bytes" bytes twice into consecutive
+// virtual addresses, so that an access that runs off the end of the
+// first mapping continues at the start of the same memory.  "bytes"
+// is rounded up to the page size and the rounded size returned in
+// it.  Returns 0 if this is not supported on this platform or fails.
+extern void *system_allocate_mirrored(size_t &bytes);
+extern void system_deallocate_mirrored(void *ptr, size_t bytes);
+
+// Open a new temporary file to use as backing store for large
+// buffers, removing its name so that it goes away when closed, and
+// map regions of it into memory.  Mapping a region beyond the end of
+// the file extends it; offsets must be multiples of the page size.
+// These return -1 and 0 respectively if not supported or on failure.
+extern int system_open_temp_file();
+extern void system_close_temp_file(int fd);
+extern void *system_map_temp_file(int fd, size_t offset, size_t bytes);
+extern void system_unmap_temp_file(void *ptr, size_t bytes);
+
 #ifdef __APPLE__
 struct timespec { long tv_sec; long tv_nsec; };
 void clock_gettime(int clk_id, struct timespec *p);
@@ -73,6 +97,21 @@ inline float modf(float x, float y) { return x - (y * float(floor(x / y))); }
 inline double princarg(double a) { return mod(a + M_PI, -2.0 * M_PI) + M_PI; }
 inline float princargf(float a) { return modf(a + (float)M_PI, -2.f * (float)M_PI) + (float)M_PI; }
 
+// Call in each iteration of a loop that spins waiting for another
+// thread, so that the processor can ease off (and give way to
+// another hardware thread on the same core) rather than run flat out
+inline void system_cpu_pause()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && (defined(__aarch64__) || \
+                            (defined(__arm__) && __ARM_ARCH >= 7))
+    __asm__ __volatile__("yield");
+#endif
+}
+
 } // end namespace
 
 // The following should be functions in the RubberBand namespace, really
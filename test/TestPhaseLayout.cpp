@@ -0,0 +1,172 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+// Run a fixed set of stretches and print a hash of the output of
+// each.  The Makefile builds this twice, once against the library
+// with the default phase vocoder state layout and once against a
+// build with USE_BLOCKED_PHASE_STATE defined, and "make test" checks
+// that the two print the same.  With "-b", run longer stretches and
+// print timings instead, for "make benchmark".
+
+#include "rubberband/RubberBandStretcher.h"
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+
+using namespace RubberBand;
+using namespace std;
+
+typedef RubberBandStretcher RBS;
+
+static const size_t rate = 44100;
+static const size_t channels = 2;
+static const size_t blockSize = 512;
+
+#ifdef USE_BLOCKED_PHASE_STATE
+static const char *layout = "blocked";
+#else
+static const char *layout = "default";
+#endif
+
+struct Config {
+    const char *name;
+    RBS::Options options;
+    double timeRatio;
+    double pitchScale;
+};
+
+static const Config configs[] = {
+    { "real-time, standard window", RBS::OptionProcessRealTime, 1.3, 1.0 },
+    { "real-time, long window, pitched",
+      RBS::OptionProcessRealTime | RBS::OptionWindowLong, 0.8, 1.2 },
+    { "offline", RBS::OptionThreadingNever, 1.5, 1.0 },
+    { "offline, independent phase",
+      RBS::OptionThreadingNever | RBS::OptionPhaseIndependent, 0.7, 0.9 },
+};
+
+static vector<vector<float> >
+makeInput(size_t duration)
+{
+    vector<vector<float> > input(channels, vector<float>(duration));
+    for (size_t c = 0; c < channels; ++c) {
+        for (size_t i = 0; i < duration; ++i) {
+            input[c][i] = 0.3f * sinf(float(i) * 0.05f * float(c + 1)) +
+                0.1f * sinf(float(i) * 0.31f) +
+                ((i % 22050) < 100 ? 0.2f : 0.f);
+        }
+    }
+    return input;
+}
+
+static void
+hashOutput(unsigned long long &hash, const float *data, size_t n)
+{
+    // FNV-1a over the bits of the samples: the layouts must agree
+    // exactly, not just closely
+    for (size_t i = 0; i < n; ++i) {
+        unsigned int bits;
+        memcpy(&bits, &data[i], sizeof(bits));
+        hash = (hash ^ bits) * 1099511628211ULL;
+    }
+}
+
+static size_t
+run(const Config &config, const vector<vector<float> > &input,
+    unsigned long long &hash)
+{
+    size_t duration = input[0].size();
+    bool realtime = (config.options & RBS::OptionProcessRealTime);
+    RBS s(rate, channels, config.options,
+          config.timeRatio, config.pitchScale);
+    if (realtime) s.setMaxProcessSize(blockSize);
+
+    vector<const float *> in(channels);
+    vector<vector<float> > out(channels, vector<float>(blockSize * 16));
+    vector<float *> outPtrs(channels);
+    for (size_t c = 0; c < channels; ++c) outPtrs[c] = &out[c][0];
+
+    if (!realtime) {
+        for (size_t c = 0; c < channels; ++c) in[c] = &input[c][0];
+        s.study(&in[0], duration, true);
+    }
+
+    hash = 14695981039346656037ULL;
+    size_t total = 0;
+
+    for (size_t i = 0; i < duration; i += blockSize) {
+        size_t n = min(blockSize, duration - i);
+        bool final = (i + n >= duration);
+        for (size_t c = 0; c < channels; ++c) in[c] = &input[c][i];
+        s.process(&in[0], n, final);
+        int avail;
+        while ((avail = s.available()) > 0 || (final && avail == 0)) {
+            if (avail == 0) continue;
+            size_t got = s.retrieve(&outPtrs[0],
+                                    min(size_t(avail), blockSize * 16));
+            for (size_t c = 0; c < channels; ++c) {
+                hashOutput(hash, outPtrs[c], got);
+            }
+            total += got;
+        }
+    }
+
+    return total;
+}
+
+int
+main(int argc, char **argv)
+{
+    bool bench = (argc > 1 && !strcmp(argv[1], "-b"));
+    size_t configCount = sizeof(configs) / sizeof(configs[0]);
+
+    if (!bench) {
+        vector<vector<float> > input = makeInput(rate * 4);
+        for (size_t i = 0; i < configCount; ++i) {
+            unsigned long long hash = 0;
+            size_t total = run(configs[i], input, hash);
+            cout << configs[i].name << ": " << total << " samples, hash "
+                 << hex << hash << dec << endl;
+        }
+        return 0;
+    }
+
+    vector<vector<float> > input = makeInput(rate * 30);
+    for (size_t i = 0; i < configCount; ++i) {
+        double best = 0.0;
+        for (int rep = 0; rep < 5; ++rep) {
+            unsigned long long hash = 0;
+            chrono::steady_clock::time_point start =
+                chrono::steady_clock::now();
+            run(configs[i], input, hash);
+            double t = chrono::duration<double>
+                (chrono::steady_clock::now() - start).count();
+            if (rep == 0 || t < best) best = t;
+        }
+        cout << layout << " layout, " << configs[i].name << ": best of 5 "
+             << best << " s for 30 s of stereo input" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+// Pull input through an input callback with retrieve() calls asking
+// for far more output than the output buffers hold, and check that
+// they return (rather than waiting forever for processing threads
+// that have stopped at the output buffer limit) with the same output
+// as pushing the input through process() in small blocks.  Either
+// retrieving in pieces or keeping the threads from stopping while
+// pullInput() waits for them is enough to avoid the hang, so this
+// covers both.
+
+#include "rubberband/RubberBandStretcher.h"
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+using namespace RubberBand;
+using namespace std;
+
+typedef RubberBandStretcher RBS;
+
+static const size_t channels = 2;
+static const size_t rate = 44100;
+static const size_t duration = rate * 20;
+static const size_t blockSize = 1024;
+static const size_t requestSize = 1000000;
+
+struct Source {
+    const vector<vector<float> > *input;
+    size_t position;
+};
+
+static size_t
+supply(void *data, float *const *buffer, size_t samples)
+{
+    Source *source = (Source *)data;
+    size_t n = min(samples, duration - source->position);
+    for (size_t c = 0; c < channels; ++c) {
+        memcpy(buffer[c], &(*source->input)[c][source->position],
+               n * sizeof(float));
+    }
+    source->position += n;
+    return n;
+}
+
+static void
+study(RBS &s, const vector<vector<float> > &input)
+{
+    vector<const float *> ptrs(channels);
+    for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][0];
+    s.study(&ptrs[0], duration, true);
+}
+
+static vector<vector<float> >
+runPush(const vector<vector<float> > &input, RBS::Options options)
+{
+    RBS s(rate, channels, options, 4.0, 1.0);
+    study(s, input);
+
+    vector<vector<float> > output(channels);
+    vector<vector<float> > buffer(channels, vector<float>(blockSize * 8));
+    vector<const float *> in(channels);
+    vector<float *> out(channels);
+    for (size_t c = 0; c < channels; ++c) out[c] = &buffer[c][0];
+
+    size_t i = 0;
+    int avail;
+    while ((avail = s.available()) >= 0) {
+        if (avail > 0) {
+            size_t n = s.retrieve(&out[0], min(size_t(avail), blockSize * 8));
+            for (size_t c = 0; c < channels; ++c) {
+                output[c].insert(output[c].end(), out[c], out[c] + n);
+            }
+        } else if (i < duration) {
+            size_t n = min(blockSize, duration - i);
+            for (size_t c = 0; c < channels; ++c) in[c] = &input[c][i];
+            s.process(&in[0], n, i + n >= duration);
+            i += n;
+        }
+    }
+
+    return output;
+}
+
+static vector<vector<float> >
+runPull(const vector<vector<float> > &input, RBS::Options options)
+{
+    RBS s(rate, channels, options, 4.0, 1.0);
+    study(s, input);
+
+    Source source = { &input, 0 };
+    s.setInputCallback(supply, &source);
+
+    vector<vector<float> > output(channels);
+    vector<vector<float> > buffer(channels, vector<float>(requestSize));
+    vector<float *> out(channels);
+    for (size_t c = 0; c < channels; ++c) out[c] = &buffer[c][0];
+
+    while (true) {
+        size_t n = s.retrieve(&out[0], requestSize);
+        for (size_t c = 0; c < channels; ++c) {
+            output[c].insert(output[c].end(), out[c], out[c] + n);
+        }
+        if (n < requestSize) break;
+    }
+
+    return output;
+}
+
+static bool
+compare(const char *name,
+        const vector<vector<float> > &expected,
+        const vector<vector<float> > &output)
+{
+    for (size_t c = 0; c < channels; ++c) {
+        if (output[c].size() != expected[c].size()) {
+            cerr << "FAIL: " << name << ": channel " << c << " has "
+                 << output[c].size() << " samples, expected "
+                 << expected[c].size() << endl;
+            return false;
+        }
+        if (!expected[c].empty() &&
+            memcmp(&output[c][0], &expected[c][0],
+                   expected[c].size() * sizeof(float))) {
+            cerr << "FAIL: " << name << ": channel " << c
+                 << " differs from output pushed through process()" << endl;
+            return false;
+        }
+    }
+    cerr << "ok: " << name << " (" << expected[0].size() << " samples)"
+         << endl;
+    return true;
+}
+
+int
+main(int, char **)
+{
+    vector<vector<float> > input(channels, vector<float>(duration));
+    for (size_t c = 0; c < channels; ++c) {
+        for (size_t i = 0; i < duration; ++i) {
+            input[c][i] = 0.3f * sinf(float(i) * 0.03f * float(c + 1));
+            if (i % 15000 < 100) input[c][i] += 0.4f;
+        }
+    }
+
+    vector<vector<float> > expected =
+        runPush(input, RBS::OptionThreadingNever);
+
+    bool good = true;
+
+    good = compare("pull, single-threaded", expected,
+                   runPull(input, RBS::OptionThreadingNever)) && good;
+
+    good = compare("pull, threading always", expected,
+                   runPull(input, RBS::OptionThreadingAlways)) && good;
+
+    return good ? 0 : 1;
+}
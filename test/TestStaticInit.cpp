@@ -0,0 +1,74 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+// Construct a stretcher during static initialisation, before any
+// particular order of initialisation of the library's own statics
+// can be relied on, and check that it runs.  The library's shared
+// state (such as the window cache) must be created on first use for
+// this to work.
+
+#include "rubberband/RubberBandStretcher.h"
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+
+using namespace RubberBand;
+using namespace std;
+
+typedef RubberBandStretcher RBS;
+
+static const size_t blockSize = 1024;
+
+static RBS early(44100, 2, RBS::OptionProcessRealTime, 1.2, 1.1);
+
+int
+main(int, char **)
+{
+    vector<float> left(blockSize), right(blockSize);
+    for (size_t i = 0; i < blockSize; ++i) {
+        left[i] = 0.3f * sinf(float(i) * 0.02f);
+        right[i] = 0.3f * sinf(float(i) * 0.03f);
+    }
+    const float *input[2] = { &left[0], &right[0] };
+
+    vector<float> outLeft(blockSize * 8), outRight(blockSize * 8);
+    float *output[2] = { &outLeft[0], &outRight[0] };
+
+    size_t total = 0;
+    for (int i = 0; i < 50; ++i) {
+        early.process(input, blockSize, false);
+        int avail;
+        while ((avail = early.available()) > 0) {
+            total += early.retrieve(output, min(size_t(avail), blockSize * 8));
+        }
+    }
+
+    if (total == 0) {
+        cerr << "FAIL: static stretcher produced no output" << endl;
+        return 1;
+    }
+
+    cerr << "ok: static stretcher (" << total << " samples)" << endl;
+    return 0;
+}
@@ -0,0 +1,316 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2014 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+// Run the same input through a stretcher with each of the threading
+// options, with threading verification enabled, and check that the
+// output is identical to that with OptionThreadingNever.  Pipelined
+// analysis only applies where there are no per-channel threads, so
+// that case is run on mono input, and we check that the stretcher
+// really did go into that mode.  Verification
+// aborts on the first sample that differs, so reaching the end of a
+// run already means that every retrieve() matched; the comparison
+// here also catches differences in the total length.
+//
+// The offline modes are also fed through processNonBlocking(), which
+// must produce the same output, and must take only part of the input
+// at a time where it would otherwise have had to wait.
+
+#include "rubberband/RubberBandStretcher.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+using namespace RubberBand;
+using namespace std;
+
+typedef RubberBandStretcher RBS;
+
+static const size_t rate = 44100;
+static const size_t duration = rate * 8;
+static const size_t blockSize = 1024;
+
+static vector<vector<float> >
+makeInput(size_t channels)
+{
+    // Tones with a click every so often, so that there are phase
+    // resets for segmented processing to split at
+
+    vector<vector<float> > input(channels, vector<float>(duration));
+    unsigned int seed = 1;
+    for (size_t c = 0; c < channels; ++c) {
+        for (size_t i = 0; i < duration; ++i) {
+            seed = seed * 1103515245 + 12345;
+            float v = 0.3f * sinf(float(i) * 0.02f * float(c + 1));
+            if (i % 20000 < 200) {
+                v += float((seed >> 16) & 0x7fff) / 32768.f - 0.5f;
+            }
+            input[c][i] = v;
+        }
+    }
+    return input;
+}
+
+static void
+drain(RBS &s, vector<vector<float> > &output, bool final)
+{
+    size_t channels = output.size();
+    vector<float> buffer(channels * blockSize * 8);
+    vector<float *> ptrs(channels);
+    for (size_t c = 0; c < channels; ++c) {
+        ptrs[c] = &buffer[c * blockSize * 8];
+    }
+    int avail;
+    while ((avail = s.available()) > 0 || (final && avail == 0)) {
+        if (avail == 0) continue;
+        size_t n = s.retrieve(&ptrs[0], min(size_t(avail), blockSize * 8));
+        for (size_t c = 0; c < channels; ++c) {
+            output[c].insert(output[c].end(), ptrs[c], ptrs[c] + n);
+        }
+    }
+}
+
+static vector<vector<float> >
+runOffline(const vector<vector<float> > &input, RBS::Options options)
+{
+    size_t channels = input.size();
+    RBS s(rate, channels, options, 1.3, 1.0);
+    vector<vector<float> > output(channels);
+    vector<const float *> ptrs(channels);
+
+    for (size_t i = 0; i < duration; i += blockSize) {
+        size_t n = min(blockSize, duration - i);
+        for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][i];
+        s.study(&ptrs[0], n, i + n >= duration);
+    }
+
+    for (size_t i = 0; i < duration; i += blockSize) {
+        size_t n = min(blockSize, duration - i);
+        for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][i];
+        s.process(&ptrs[0], n, i + n >= duration);
+        drain(s, output, false);
+    }
+
+    drain(s, output, true);
+    return output;
+}
+
+static mutex notifyMutex;
+static condition_variable notifyCondition;
+static int notifyCount = 0;
+
+static void
+notified(void *)
+{
+    lock_guard<mutex> locker(notifyMutex);
+    ++notifyCount;
+    notifyCondition.notify_all();
+}
+
+static vector<vector<float> >
+runNonBlocking(const vector<vector<float> > &input, RBS::Options options,
+               size_t &partial)
+{
+    // Offer all of the remaining input on every call, so that any
+    // mode with bounded input buffers has to turn some of it away
+
+    size_t channels = input.size();
+    RBS s(rate, channels, options, 1.3, 1.0);
+    s.setNotificationCallback(notified, 0);
+    vector<vector<float> > output(channels);
+    vector<const float *> ptrs(channels);
+
+    for (size_t i = 0; i < duration; i += blockSize) {
+        size_t n = min(blockSize, duration - i);
+        for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][i];
+        s.study(&ptrs[0], n, i + n >= duration);
+    }
+
+    partial = 0;
+    size_t i = 0;
+    while (i < duration) {
+        int before;
+        {
+            lock_guard<mutex> locker(notifyMutex);
+            before = notifyCount;
+        }
+        for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][i];
+        size_t n = s.processNonBlocking(&ptrs[0], duration - i, true);
+        if (n < duration - i) ++partial;
+        i += n;
+        drain(s, output, false);
+        if (n == 0) {
+            // Nothing fitted: wait for a processing thread to say it
+            // has made room, polling in case its word came too early
+            unique_lock<mutex> locker(notifyMutex);
+            notifyCondition.wait_for(locker, chrono::milliseconds(10),
+                                     [&]() { return notifyCount != before; });
+        }
+    }
+
+    drain(s, output, true);
+    return output;
+}
+
+static vector<vector<float> >
+runRealTime(const vector<vector<float> > &input, RBS::Options options)
+{
+    size_t channels = input.size();
+    RBS s(rate, channels, options | RBS::OptionProcessRealTime, 1.0, 1.0);
+    s.setMaxProcessSize(blockSize);
+    vector<vector<float> > output(channels);
+    vector<const float *> ptrs(channels);
+
+    for (size_t i = 0; i < duration; i += blockSize) {
+        // Change the ratio and pitch as we go, as a real-time user would
+        size_t k = i / (duration / 4);
+        s.setTimeRatio(0.8 + 0.2 * double(k));
+        s.setPitchScale(1.0 + 0.1 * double(k));
+        size_t n = min(blockSize, duration - i);
+        for (size_t c = 0; c < channels; ++c) ptrs[c] = &input[c][i];
+        s.process(&ptrs[0], n, i + n >= duration);
+        drain(s, output, false);
+    }
+
+    return output;
+}
+
+static bool
+compare(const char *name,
+        const vector<vector<float> > &expected,
+        const vector<vector<float> > &output)
+{
+    size_t channels = expected.size();
+    for (size_t c = 0; c < channels; ++c) {
+        if (output[c].size() != expected[c].size()) {
+            cerr << "FAIL: " << name << ": channel " << c << " has "
+                 << output[c].size() << " samples, expected "
+                 << expected[c].size() << endl;
+            return false;
+        }
+        if (!expected[c].empty() &&
+            memcmp(&output[c][0], &expected[c][0],
+                   expected[c].size() * sizeof(float))) {
+            cerr << "FAIL: " << name << ": channel " << c
+                 << " differs from single-threaded output" << endl;
+            return false;
+        }
+    }
+    cerr << "ok: " << name << " (" << expected[0].size() << " samples)"
+         << endl;
+    return true;
+}
+
+static bool
+usesPipelinedAnalysis(size_t channels, RBS::Options options)
+{
+    // There is no API to ask which mode a stretcher chose, but it
+    // says so on construction at debug level 1
+
+    ostringstream messages;
+    streambuf *saved = cerr.rdbuf(messages.rdbuf());
+    RBS::setDefaultDebugLevel(1);
+    {
+        RBS s(rate, channels, options, 1.3, 1.0);
+    }
+    RBS::setDefaultDebugLevel(0);
+    cerr.rdbuf(saved);
+
+    return messages.str().find("pipelined analysis") != string::npos;
+}
+
+int
+main(int, char **)
+{
+    RBS::setThreadPoolSize(3);
+    RBS::setThreadingVerification(true);
+
+    vector<vector<float> > input = makeInput(4);
+    bool good = true;
+
+    vector<vector<float> > expected =
+        runOffline(input, RBS::OptionThreadingNever);
+
+    struct { const char *name; RBS::Options options; } offline[] = {
+        { "offline, threading always",
+          RBS::OptionThreadingAlways },
+        { "offline, shared pool",
+          RBS::OptionThreadingAlways | RBS::OptionThreadingShared },
+        { "offline, segmented",
+          RBS::OptionThreadingAlways | RBS::OptionThreadingSegmented },
+    };
+
+    for (size_t i = 0; i < sizeof(offline)/sizeof(offline[0]); ++i) {
+        good = compare(offline[i].name, expected,
+                       runOffline(input, offline[i].options)) && good;
+        size_t partial = 0;
+        string name = string(offline[i].name) + ", non-blocking";
+        good = compare(name.c_str(), expected,
+                       runNonBlocking(input, offline[i].options, partial))
+            && good;
+        // Segment input is unbounded, so only the others turn any away
+        bool bounded = !(offline[i].options & RBS::OptionThreadingSegmented);
+        if (bounded && partial == 0) {
+            cerr << "FAIL: " << name << ": all input accepted at once"
+                 << endl;
+            good = false;
+        }
+    }
+
+    vector<vector<float> > mono = makeInput(1);
+    RBS::Options pipelined =
+        RBS::OptionThreadingAlways | RBS::OptionThreadingPipelined;
+
+    if (!usesPipelinedAnalysis(1, pipelined)) {
+        cerr << "FAIL: offline, pipelined: pipelined analysis not in use"
+             << endl;
+        good = false;
+    } else {
+        vector<vector<float> > monoExpected =
+            runOffline(mono, RBS::OptionThreadingNever);
+        good = compare("offline, pipelined", monoExpected,
+                       runOffline(mono, pipelined)) && good;
+        size_t partial = 0;
+        good = compare("offline, pipelined, non-blocking", monoExpected,
+                       runNonBlocking(mono, pipelined, partial)) && good;
+        if (partial == 0) {
+            cerr << "FAIL: offline, pipelined, non-blocking: "
+                 << "all input accepted at once" << endl;
+            good = false;
+        }
+    }
+
+    expected = runRealTime(input, RBS::OptionThreadingNever);
+
+    good = compare("real-time, workers", expected,
+                   runRealTime(input, RBS::OptionThreadingAlways |
+                               RBS::OptionThreadingRealTime)) && good;
+
+    return good ? 0 : 1;
+}